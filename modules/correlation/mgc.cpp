@@ -9,9 +9,14 @@
 #include <algorithm>
 #include <assert.h>
 #include <complex>
+#include <cstdint>
+#include <deque>
 #include <functional>
 #include <iterator>
+#include <limits>
 #include <numeric>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #if defined(_MSC_VER)
@@ -28,7 +33,8 @@
 
 #include "../../3rdparty/blaze/Math.h"
 
-#include "../utils/graph/connected_components.hpp"
+#include "../utils/parallel.hpp"
+#include "../space/tree.hpp"
 #include "../distance.hpp"
 
 namespace metric {
@@ -53,25 +59,777 @@ Container distance_matrix(const Container& data)
     return matrix;
 }
 
-template <typename T>
-blaze::DynamicMatrix<size_t> MGC_direct::rank_distance_matrix(const DistanceMatrix<T>& data)
-{
-    blaze::DynamicMatrix<size_t> matrix(data.rows(), data.columns());
+namespace MGC_details {
+
+    /**
+     * @brief rank every row of a distance matrix
+     *
+     * @details Ties are ranked in the order of their columns, so the ranks do not depend on the number of threads.
+     *
+     * @param data distance matrix
+     * @param ranks [out] ranks(i, j) is the position of data(i, j) in the sorted row i
+     * @param threads number of threads, 0 means one per hardware thread
+     */
+    template <typename Matrix, typename Rank>
+    void rank_rows(const Matrix& data, blaze::DynamicMatrix<Rank>& ranks, size_t threads = 1)
+    {
+        using T = typename Matrix::ElementType;
 
-    std::vector<size_t> indexes(data.rows());
-    std::iota(indexes.begin(), indexes.end(), 0);
+        ranks.resize(data.rows(), data.columns(), false);
+
+        parallel_for(data.rows(), threads, [&](size_t begin, size_t end, size_t) {
+            std::vector<T> values(data.columns());
+            std::vector<size_t> indexes(data.columns());
+            std::iota(indexes.begin(), indexes.end(), 0);
+
+            for (size_t i = begin; i < end; ++i) {
+                for (size_t j = 0; j < values.size(); ++j) {
+                    values[j] = data(i, j);
+                }
+                // starting from the order of the previous row saves work, the runs of ties are put in the order
+                // of their columns afterwards
+                std::sort(indexes.begin(), indexes.end(), [&values](auto i1, auto i2) { return values[i1] < values[i2]; });
+                for (auto first = indexes.begin(); first != indexes.end();) {
+                    auto last = std::find_if(
+                        first + 1, indexes.end(), [&](auto index) { return values[index] != values[*first]; });
+                    std::sort(first, last);
+                    first = last;
+                }
+
+                /* Fill result row */
+                for (size_t iter = 0; iter < indexes.size(); ++iter) {
+                    ranks(i, indexes[iter]) = Rank(iter);
+                }
+            }
+        });
+    }
+
+    // column sums divided by n - 1, centered entry (i, j) is X(i, j) minus entry j; summed in at least double
+    template <typename T, typename Matrix>
+    blaze::DynamicVector<T, blaze::rowVector> column_means(const Matrix& X, size_t threads = 1)
+    {
+        using A = MGC_direct::accumulator_type<T>;
+
+        const size_t n = X.rows();
+        blaze::DynamicVector<A, blaze::rowVector> list_of_sums(n, 0);
+        const A scale = A(1) / (n - 1);
+
+        // every column is summed from top to bottom, whatever the number of threads
+        parallel_for(n, threads, [&](size_t begin, size_t end, size_t) {
+            for (size_t i = 0; i < n; ++i) {
+                for (size_t j = begin; j < end; ++j) {
+                    list_of_sums[j] += X(i, j);
+                }
+            }
+            for (size_t j = begin; j < end; ++j) {
+                list_of_sums[j] *= scale;
+            }
+        });
+        return list_of_sums;
+    }
+
+    /**
+     * @brief distance matrix of a set of records
+     *
+     * @param data records
+     * @param threads number of threads, 0 means one per hardware thread
+     * @return distance matrix of type T
+     */
+    template <typename Metric, typename T = double, typename Container>
+    DistanceMatrix<T> distance_matrix(const Container& data, size_t threads = 1)
+    {
+        const size_t n = data.size();
+        DistanceMatrix<T> X(n);
+
+        // row p is paired with row n - 1 - p, so that every thread gets the same number of distances
+        parallel_for((n + 1) / 2, threads, [&](size_t begin, size_t end, size_t) {
+            Metric metric;
+            for (size_t p = begin; p < end; ++p) {
+                for (size_t i : { p, n - 1 - p }) {
+                    X(i, i) = 0;
+                    for (size_t j = i + 1; j < n; ++j) {
+                        X(i, j) = metric(data[i], data[j]);
+                    }
+                    if (i == n - 1 - i) {
+                        break;
+                    }
+                }
+            }
+        });
+        return X;
+    }
+
+    /**
+     * @brief window of a square matrix used as a ring buffer
+     *
+     * @details Entry (i, j) of the window is entry (first + i, first + j) of the data, both modulo its size, so a
+     * sliding window moves by advancing first instead of moving the entries.
+     */
+    template <typename Matrix>
+    struct RingView {
+        using ElementType = typename Matrix::ElementType;
+
+        const Matrix& data;
+        size_t first;
+        size_t n;
+
+        size_t rows() const { return n; }
+        size_t columns() const { return n; }
+        ElementType operator()(size_t i, size_t j) const { return data(slot(i), slot(j)); }
+
+        size_t slot(size_t i) const
+        {
+            const size_t s = first + i;
+            return s < data.rows() ? s : s - data.rows();
+        }
+    };
+
+    /**
+     * @brief append a sample to a sliding window of distances and row ranks
+     *
+     * @details The new sample comes last, so it is ranked after its ties in every row, as rank_rows would do. The
+     * existing rows are updated in place with one pass each; only the new row is sorted.
+     *
+     * @param samples samples of the window, in order
+     * @param sample new sample
+     * @param X distances of the window, a ring buffer starting at first
+     * @param R row ranks of X, a ring buffer starting at first
+     * @param first slot of the oldest sample
+     * @param threads number of threads, 0 means one per hardware thread
+     */
+    template <typename Metric, typename Record, typename T>
+    void window_push(std::deque<Record>& samples, const Record& sample, blaze::DynamicMatrix<T>& X,
+        blaze::DynamicMatrix<uint32_t>& R, size_t first, size_t threads = 1)
+    {
+        const size_t n = samples.size();
+        const RingView<blaze::DynamicMatrix<T>> window { X, first, n + 1 };
+        const size_t z = window.slot(n);
+
+        X(z, z) = 0;
+        parallel_for(n, threads, [&](size_t begin, size_t end, size_t) {
+            Metric metric;
+            for (size_t i = begin; i < end; ++i) {
+                const size_t s = window.slot(i);
+                const T d = metric(samples[i], sample);
+                X(s, z) = d;
+                X(z, s) = d;
+
+                // the ranks from that of the new distance on move up by one
+                uint32_t rank = 0;
+                for (size_t j = 0; j < n; ++j) {
+                    rank += X(s, window.slot(j)) <= d;
+                }
+                for (size_t j = 0; j < n; ++j) {
+                    auto& r = R(s, window.slot(j));
+                    r += r >= rank;
+                }
+                R(s, z) = rank;
+            }
+        });
+
+        std::vector<T> values(n + 1);
+        std::vector<size_t> indexes(n + 1);
+        for (size_t j = 0; j <= n; ++j) {
+            values[j] = window(n, j);
+            indexes[j] = j;
+        }
+        std::stable_sort(indexes.begin(), indexes.end(), [&values](auto i1, auto i2) { return values[i1] < values[i2]; });
+        for (size_t iter = 0; iter < indexes.size(); ++iter) {
+            R(z, window.slot(indexes[iter])) = uint32_t(iter);
+        }
+
+        samples.push_back(sample);
+    }
+
+    /**
+     * @brief remove the oldest sample of a sliding window of distances and row ranks
+     *
+     * @details The caller advances first by one slot afterwards.
+     *
+     * @param samples samples of the window, in order
+     * @param X distances of the window, a ring buffer starting at first
+     * @param R row ranks of X, a ring buffer starting at first
+     * @param first slot of the oldest sample
+     * @param threads number of threads, 0 means one per hardware thread
+     */
+    template <typename Record, typename T>
+    void window_pop(std::deque<Record>& samples, const blaze::DynamicMatrix<T>& X,
+        blaze::DynamicMatrix<uint32_t>& R, size_t first, size_t threads = 1)
+    {
+        const size_t n = samples.size();
+        const RingView<blaze::DynamicMatrix<T>> window { X, first, n };
+
+        // the other samples keep their order, the ranks above that of the oldest sample move down by one
+        parallel_for(n - 1, threads, [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin + 1; i < end + 1; ++i) {
+                const size_t s = window.slot(i);
+                const uint32_t removed = R(s, first);
+                for (size_t j = 1; j < n; ++j) {
+                    auto& r = R(s, window.slot(j));
+                    r -= r > removed;
+                }
+            }
+        });
+
+        samples.pop_front();
+    }
+
+    template <typename T>
+    std::vector<T> diagonal(const blaze::DynamicMatrix<T>& matrix)
+    {
+        std::vector<T> result(matrix.rows());
+        for (size_t i = 0; i < result.size(); ++i) {
+            result[i] = matrix(i, i);
+        }
+        return result;
+    }
+
+    /**
+     * @brief neighbour graph of a set of records, found with a cover tree
+     *
+     * @param data records
+     * @param neighbours number of neighbours per record, the record itself included
+     * @param meanSamples indexes of the records that estimate the mean distances
+     * @param threads number of threads, 0 means one per hardware thread
+     * @return neighbour graph with distances of type T
+     */
+    template <typename Metric, typename T = double, typename Record>
+    NeighbourGraph<T> neighbour_graph(const std::vector<Record>& data, size_t neighbours,
+        const std::vector<size_t>& meanSamples, size_t threads = 1)
+    {
+        using A = MGC_direct::accumulator_type<T>;
+        const size_t n = data.size();
+        NeighbourGraph<T> graph;
+        graph.neighbours = std::min(neighbours, n);
+        graph.ids.resize(n * graph.neighbours);
+        graph.ranks.resize(n * graph.neighbours);
+        graph.distances.resize(n * graph.neighbours);
+        graph.means.resize(n);
+        if (n == 0) {
+            return graph;
+        }
+
+        const Tree<Record, Metric> tree(data);
+        // the mean over all other records, estimated from the samples
+        const A scale = A(n) / meanSamples.size() / (n - 1);
+
+        parallel_for(n, threads, [&](size_t begin, size_t end, size_t) {
+            Metric metric;
+            std::vector<std::pair<T, size_t>> row;
+            for (size_t i = begin; i < end; ++i) {
+                row.clear();
+                for (const auto& neighbour : tree.knn(data[i], unsigned(graph.neighbours))) {
+                    row.emplace_back(T(neighbour.second), neighbour.first->get_ID());
+                }
+                // missing neighbours get an id past the samples, which is never paired
+                row.resize(graph.neighbours, { std::numeric_limits<T>::infinity(), n });
+                std::sort(row.begin(), row.end());
+
+                // ranks follow (distance, id) as in rank_rows, the row is stored in the order of the ids
+                const size_t first = i * graph.neighbours;
+                std::vector<size_t> order(row.size());
+                std::iota(order.begin(), order.end(), 0);
+                std::sort(order.begin(), order.end(), [&](auto r1, auto r2) { return row[r1].second < row[r2].second; });
+                for (size_t r = 0; r < order.size(); ++r) {
+                    graph.ranks[first + r] = uint32_t(order[r]);
+                    graph.ids[first + r] = uint32_t(row[order[r]].second);
+                    graph.distances[first + r] = row[order[r]].first;
+                }
+
+                A sum = 0;
+                for (const auto sample : meanSamples) {
+                    sum += T(metric(data[i], data[sample]));
+                }
+                graph.means[i] = T(sum * scale);
+            }
+        });
+        return graph;
+    }
+
+    /**
+     * @brief one table of local covariances while it is summed up
+     */
+    template <typename T>
+    struct LocalCovariance {
+        blaze::DynamicMatrix<T> covXY;
+        std::vector<T> EX;
+        std::vector<T> EY;
+
+        explicit LocalCovariance(size_t n)
+            : covXY(n, n, 0)
+            , EX(n, 0)
+            , EY(n, 0)
+        {
+        }
+
+        // add the product of a and b at the ranks (k, l)
+        void add(size_t k, size_t l, T a, T b)
+        {
+            covXY(k, l) += a * b;
+            EX[k] += a;
+            EY[l] += b;
+        }
+
+        // cumulative sums over the ranks, then the product of the means of the samples is removed
+        void finish(size_t threads, size_t samples = 0)
+        {
+            const size_t n = covXY.rows();
+            if (samples == 0) {
+                samples = n;
+            }
+            if (n == 0) {
+                return;
+            }
+
+            for (size_t k = 0; k < n - 1; ++k) {
+                covXY(k + 1, 0) = covXY(k, 0) + covXY(k + 1, 0);
+                EX[k + 1] += EX[k];
+            }
+
+            for (size_t l = 0; l < n - 1; ++l) {
+                EY[l + 1] += EY[l];
+            }
+
+            for (size_t k = 0; k < n - 1; ++k) {
+                for (size_t l = 0; l < n - 1; ++l) {
+                    covXY(k + 1, l + 1) += covXY(k + 1, l) + covXY(k, l + 1) - covXY(k, l);
+                }
+            }
+
+            const T scale = T(1) / samples / samples;
+            parallel_for(n, threads, [&](size_t begin, size_t end, size_t) {
+                for (size_t k = begin; k < end; ++k) {
+                    for (size_t l = 0; l < n; ++l) {
+                        covXY(k, l) -= EX[k] * EY[l] * scale;
+                    }
+                }
+            });
+        }
+    };
+
+    /**
+     * @brief the diagonal of a table of local covariances while it is summed up
+     *
+     * @details Cell (m, m) of the cumulated table sums the products at all ranks (k, l) with k, l <= m, so every
+     * product is only added at max(k, l) and the diagonal is the cumulative sum of those. Like LocalCovariance, the
+     * first row is not cumulated over its columns, the products at (0, l) only count at (l, l).
+     */
+    template <typename T>
+    struct LocalVariance {
+        std::vector<T> cov;
+        std::vector<T> firstRow;
+        std::vector<T> EX;
+        std::vector<T> EY;
+
+        explicit LocalVariance(size_t n)
+            : cov(n, 0)
+            , firstRow(n, 0)
+            , EX(n, 0)
+            , EY(n, 0)
+        {
+        }
+
+        // add the product of a and b at the ranks (k, l)
+        void add(size_t k, size_t l, T a, T b)
+        {
+            if (k == 0 && l != 0) {
+                firstRow[l] += a * b;
+            } else {
+                cov[std::max(k, l)] += a * b;
+            }
+            EX[k] += a;
+            EY[l] += b;
+        }
+
+        // cumulative sums over the ranks, then the product of the means of the samples is removed
+        std::vector<T> finish(size_t samples)
+        {
+            const size_t n = cov.size();
+            for (size_t m = 1; m < n; ++m) {
+                cov[m] += cov[m - 1];
+                EX[m] += EX[m - 1];
+                EY[m] += EY[m - 1];
+            }
+
+            const T scale = T(1) / samples / samples;
+            for (size_t m = 0; m < n; ++m) {
+                cov[m] += firstRow[m];
+                cov[m] -= EX[m] * EY[m] * scale;
+            }
+            return std::move(cov);
+        }
+    };
+
+    // adds the vector b to a entrywise
+    template <typename T>
+    void add_vector(std::vector<T>& a, const std::vector<T>& b)
+    {
+        for (size_t k = 0; k < a.size(); ++k) {
+            a[k] += b[k];
+        }
+    }
+
+    template <typename T>
+    struct LocalCorrelations {
+        blaze::DynamicMatrix<T> corr;
+        std::vector<T> varX;
+        std::vector<T> varY;
+    };
+
+    /**
+     * @brief local covariances and local variances of two distance matrices in one pass
+     *
+     * @details For the centered matrices A and B of X and Y, corr, varX and varY equal
+     * MGC_direct::local_covariance(A, trans(B), trans(RX), RY), local_covariance(A, trans(A), trans(RX), RX) and
+     * local_covariance(B, trans(B), trans(RY), RY), of which only the diagonals of the variances are summed up. The
+     * centered matrices are never stored: entry (j, i) of a centered matrix is read from X(i, j) by symmetry, and the
+     * transposed ranks are read as columns of RX and RY. Every entry of the inputs is read once for the three tables,
+     * by the thread owning the rank RX(j, i) of its row of the table. There is one n x n table for all threads, each
+     * thread only allocates vectors of n values; instead every thread reads all n² ranks RX(j, i) to find its pairs.
+     *
+     * @param X first distance matrix
+     * @param meansX column_means(X)
+     * @param RX row ranks of X
+     * @param Y second distance matrix
+     * @param meansY column_means(Y)
+     * @param RY row ranks of Y
+     * @param threads number of threads, 0 means one per hardware thread
+     * @return local covariances and the diagonals of the local variances
+     */
+    template <typename T, typename MatrixX, typename RanksX, typename MatrixY, typename RanksY>
+    LocalCorrelations<MGC_direct::accumulator_type<T>> local_covariances(const MatrixX& X,
+        const blaze::DynamicVector<T, blaze::rowVector>& meansX, const RanksX& RX, const MatrixY& Y, const blaze::DynamicVector<T, blaze::rowVector>& meansY,
+        const RanksY& RY, size_t threads = 1)
+    {
+        using A = MGC_direct::accumulator_type<T>;
+        const size_t n = X.rows();
+
+        // the ranks k of the rows of the table are split between threads, every thread walks all pairs (i, j) and
+        // only sums up those of its own ranks, so the rows it writes are written by no other thread and every cell
+        // sums its products in the same order for any number of threads; the vectors indexed by other ranks are
+        // partial per thread and added to those of the first thread in order
+        const size_t chunks = thread_count(threads);
+        LocalCovariance<A> corr(n);
+        std::vector<std::vector<A>> partialEY(chunks);
+        std::vector<LocalVariance<A>> varsX(chunks, LocalVariance<A>(0));
+        std::vector<LocalVariance<A>> varsY(chunks, LocalVariance<A>(0));
+        const size_t used = parallel_for(n, threads, [&](size_t kBegin, size_t kEnd, size_t chunk) {
+            auto& EY = partialEY[chunk];
+            EY.assign(n, 0);
+            varsX[chunk] = LocalVariance<A>(n);
+            varsY[chunk] = LocalVariance<A>(n);
+            auto& varX = varsX[chunk];
+            auto& varY = varsY[chunk];
+            for (size_t i = 0; i < n; ++i) {
+                for (size_t j = 0; j < n; ++j) {
+                    const size_t kX = RX(j, i);
+                    if (kX < kBegin || kX >= kEnd) {
+                        continue;
+                    }
+                    // A(i, j), A(j, i), B(i, j) and B(j, i)
+                    const T a = i == j ? T(0) : X(i, j) - meansX[j];
+                    const T at = i == j ? T(0) : X(i, j) - meansX[i];
+                    const T b = i == j ? T(0) : Y(i, j) - meansY[j];
+                    const T bt = i == j ? T(0) : Y(i, j) - meansY[i];
+                    const size_t lX = RX(i, j);
+                    const size_t kY = RY(j, i);
+                    const size_t lY = RY(i, j);
+                    corr.covXY(kX, lY) += a * bt;
+                    corr.EX[kX] += a;
+                    EY[lY] += bt;
+                    varX.add(kX, lX, a, at);
+                    varY.add(kY, lY, b, bt);
+                }
+            }
+        });
+
+        corr.EY = std::move(partialEY[0]);
+        for (size_t chunk = 1; chunk < used; ++chunk) {
+            add_vector(corr.EY, partialEY[chunk]);
+            for (auto vars : { &varsX, &varsY }) {
+                add_vector((*vars)[0].cov, (*vars)[chunk].cov);
+                add_vector((*vars)[0].firstRow, (*vars)[chunk].firstRow);
+                add_vector((*vars)[0].EX, (*vars)[chunk].EX);
+                add_vector((*vars)[0].EY, (*vars)[chunk].EY);
+            }
+        }
+
+        std::vector<A> diagonalX = varsX[0].finish(n);
+        std::vector<A> diagonalY = varsY[0].finish(n);
+        corr.finish(threads);
+
+        return { std::move(corr.covXY), std::move(diagonalX), std::move(diagonalY) };
+    }
+
+    /**
+     * @brief local covariances of X and of Y with its samples relabeled by a permutation
+     *
+     * @details Same as the corr table of local_covariances for the distance matrix Y(perm[i], perm[j]), whose
+     * means and row ranks are remapped from those of Y instead of being computed again. Single threaded, the
+     * permutations are run in parallel instead.
+     *
+     * @param perm permutation of the samples of Y
+     * @return all local covariances matrix
+     */
+    template <typename T, typename Rank, typename MatrixX, typename MatrixY>
+    blaze::DynamicMatrix<MGC_direct::accumulator_type<T>> permuted_covariance(const MatrixX& X,
+        const blaze::DynamicVector<T, blaze::rowVector>& meansX, const blaze::DynamicMatrix<Rank>& RX, const MatrixY& Y, const blaze::DynamicVector<T, blaze::rowVector>& meansY,
+        const blaze::DynamicMatrix<Rank>& RY, const std::vector<size_t>& perm)
+    {
+        const size_t n = X.rows();
+
+        LocalCovariance<MGC_direct::accumulator_type<T>> corr(n);
+        for (size_t i = 0; i < n; ++i) {
+            const size_t pi = perm[i];
+            for (size_t j = 0; j < n; ++j) {
+                const size_t pj = perm[j];
+                const T a = i == j ? T(0) : X(i, j) - meansX[j];
+                const T bt = i == j ? T(0) : Y(pi, pj) - meansY[pi];
+                corr.add(RX(j, i), RY(pi, pj), a, bt);
+            }
+        }
+        corr.finish(1);
+
+        return std::move(corr.covXY);
+    }
+
+    /**
+     * @brief local covariances at the scales below the number of neighbours, summed over neighbour pairs only
+     *
+     * @details Same as one table of local_covariances restricted to its first k rows and columns, where A and B
+     * are the spaces of the graphs GA and GB: a pair (i, j) counts when i is a neighbour of j in A and j a
+     * neighbour of i in B, which are exactly the pairs that reach those scales.
+     *
+     * @param GA neighbour graph of the first space
+     * @param GB neighbour graph of the second space
+     * @return k x k local covariances
+     */
+    template <typename T>
+    blaze::DynamicMatrix<MGC_direct::accumulator_type<T>> sparse_local_covariance(
+        const NeighbourGraph<T>& GA, const NeighbourGraph<T>& GB)
+    {
+        using A = MGC_direct::accumulator_type<T>;
+        const size_t n = GA.samples();
+        const size_t k = std::min(GA.neighbours, GB.neighbours);
+
+        LocalCovariance<A> cov(k);
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t e = i * GB.neighbours; e < (i + 1) * GB.neighbours; ++e) {
+                const size_t j = GB.ids[e];
+                const size_t l = GB.ranks[e];
+                if (j == i || j >= n || l >= k) {
+                    continue;
+                }
+                // rank of i among the neighbours of j in A
+                const auto first = GA.ids.begin() + j * GA.neighbours;
+                const auto found = std::lower_bound(first, first + GA.neighbours, uint32_t(i));
+                if (found == first + GA.neighbours || *found != i) {
+                    continue;
+                }
+                const size_t f = found - GA.ids.begin();
+                if (GA.ranks[f] >= k) {
+                    continue;
+                }
+                cov.covXY(GA.ranks[f], l) += A(GA.distances[f] - GA.means[j]) * (GB.distances[e] - GB.means[i]);
+            }
+        }
+
+        // the marginal sums need no pairing
+        for (size_t j = 0; j < n; ++j) {
+            for (size_t e = j * GA.neighbours; e < (j + 1) * GA.neighbours; ++e) {
+                if (GA.ids[e] != j && GA.ids[e] < n && GA.ranks[e] < k) {
+                    cov.EX[GA.ranks[e]] += GA.distances[e] - GA.means[j];
+                }
+            }
+        }
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t e = i * GB.neighbours; e < (i + 1) * GB.neighbours; ++e) {
+                if (GB.ids[e] != i && GB.ids[e] < n && GB.ranks[e] < k) {
+                    cov.EY[GB.ranks[e]] += GB.distances[e] - GB.means[i];
+                }
+            }
+        }
+
+        cov.finish(1, n);
+        return std::move(cov.covXY);
+    }
+
+    // divide the local covariances by the local standard deviations; the rows are blaze expressions, so the square
+    // roots and divisions are vectorized, and are correctly rounded as in scalar code
+    template <typename T>
+    void normalize(
+        blaze::DynamicMatrix<T>& corr, const std::vector<T>& varX, const std::vector<T>& varY, size_t threads = 1)
+    {
+        const blaze::DynamicVector<T, blaze::rowVector> varianceY(varY.size(), varY.data());
+
+        parallel_for(corr.rows(), threads, [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; ++i) {
+                auto row = blaze::row(corr, i);
+                row /= blaze::sqrt(varX[i] * varianceY);
+
+                // branch free, NaN becomes 0
+                for (size_t j = 0; j < row.size(); ++j) {
+                    const T value = row[j] > T(1) ? T(1) : row[j];
+                    row[j] = value == value ? value : T(0);
+                }
+            }
+        });
+    }
+
+    /**
+     * @brief forest of the scales, with the number of cells and the largest correlation of every tree
+     *
+     * @details The smaller scale becomes the root when two trees are merged, so every root is the smallest scale of
+     * its tree. The counts and maxima are valid at the roots only.
+     */
+    template <typename T>
+    struct ScaleForest {
+        std::vector<size_t> parent;
+        std::vector<size_t> cells;
+        std::vector<T> maximum;
+
+        explicit ScaleForest(size_t n)
+            : parent(n)
+            , cells(n, 0)
+            , maximum(n, std::numeric_limits<T>::lowest())
+        {
+            std::iota(parent.begin(), parent.end(), 0);
+        }
+
+        size_t find(size_t i)
+        {
+            while (parent[i] != i) {
+                parent[i] = parent[parent[i]];
+                i = parent[i];
+            }
+            return i;
+        }
+
+        size_t merge(size_t i, size_t j)
+        {
+            i = find(i);
+            j = find(j);
+            if (j < i) {
+                std::swap(i, j);
+            }
+            if (i != j) {
+                parent[j] = i;
+                cells[i] += cells[j];
+                maximum[i] = std::max(maximum[i], maximum[j]);
+            }
+            return i;
+        }
+
+        void add(size_t root, size_t count, T value)
+        {
+            cells[root] += count;
+            maximum[root] = std::max(maximum[root], value);
+        }
+    };
+
+    template <typename T>
+    struct SignificantRegion {
+        std::vector<size_t> component;  // root of every scale
+        size_t root;  // component of the region, component.size() when the region is empty
+        size_t cells = 0;
+        T maximum = 0;
+
+        bool contains(size_t i, size_t j) const { return i != j && component[i] == root && component[j] == root; }
+    };
+
+    /**
+     * @brief largest connected region of the local correlations above a threshold
+     *
+     * @details The scales are the vertices of a graph with an edge between the scales i != j wherever
+     * corr(i, j) > threshold, the graph metric::graph::largest_connected_component reads from the thresholded table.
+     * The region is made of those cells between the scales of the largest component. Every thread merges the
+     * components of its rows in one pass over the table, counting the cells and keeping the largest correlation
+     * along, then the forests are merged; the region itself is never stored. Of equally large components, the one
+     * with the smallest scale is taken.
+     *
+     * @param corr local correlations
+     * @param threshold significance threshold
+     * @param threads number of threads, 0 means one per hardware thread
+     * @return components of the scales, and the size and the largest correlation of the region
+     */
+    template <typename T>
+    SignificantRegion<T> significant_region(const blaze::DynamicMatrix<T>& corr, T threshold, size_t threads = 1)
+    {
+        const size_t n = corr.rows();
+
+        std::vector<ScaleForest<T>> forests(thread_count(threads), ScaleForest<T>(0));
+        const size_t chunks = parallel_for(n, threads, [&](size_t begin, size_t end, size_t chunk) {
+            ScaleForest<T> forest(n);
+            for (size_t i = begin; i < end; ++i) {
+                for (size_t j = 0; j < n; ++j) {
+                    if (i != j && corr(i, j) > threshold) {
+                        forest.add(forest.merge(i, j), 1, corr(i, j));
+                    }
+                }
+            }
+            forests[chunk] = std::move(forest);
+        });
+
+        auto& forest = forests[0];
+        for (size_t chunk = 1; chunk < chunks; ++chunk) {
+            auto& other = forests[chunk];
+            for (size_t i = 0; i < n; ++i) {
+                forest.merge(i, other.find(i));
+            }
+            for (size_t i = 0; i < n; ++i) {
+                if (other.parent[i] == i && other.cells[i] > 0) {
+                    forest.add(forest.find(i), other.cells[i], other.maximum[i]);
+                }
+            }
+        }
+
+        // components of a single scale do not count
+        SignificantRegion<T> region;
+        region.component.resize(n);
+        region.root = n;
+        std::vector<size_t> scales(n, 0);
+        size_t largest = 1;
+        for (size_t i = 0; i < n; ++i) {
+            region.component[i] = forest.find(i);
+            const size_t count = ++scales[region.component[i]];
+            if (count > largest || (count == largest && count > 1 && region.component[i] < region.root)) {
+                largest = count;
+                region.root = region.component[i];
+            }
+        }
+        if (region.root < n) {
+            region.cells = forest.cells[region.root];
+            region.maximum = forest.maximum[region.root];
+        }
+        return region;
+    }
 
-    for (int i = 0; i < data.rows(); ++i) {
-        auto row = blaze::row(data, i);
-        std::sort(indexes.begin(), indexes.end(), [&row](auto i1, auto i2) { return row[i1] < row[i2]; });
+    /**
+     * @brief MGC statistic from the size of the significant region and its largest local correlation
+     *
+     * @details The local correlation at the maximal scale, unless the region is large enough, but not the whole
+     * table, and holds a larger correlation. The cells outside the region count as a correlation of 0.
+     */
+    template <typename T>
+    T optimal_correlation(const blaze::DynamicMatrix<T>& corr, size_t cells, T maximum)
+    {
+        const size_t m = corr.rows();
+        const size_t n = corr.columns();
+        T mgc = corr(m - 1, m - 1);
 
-        /* Fill result row */
-        auto outRow = blaze::row(matrix, i);
-        for (size_t iter = 0; iter < row.size(); ++iter) {
-            outRow[indexes[iter]] = iter;
+        if (cells != m * n && cells >= 2 * std::min(m, n)) {
+            mgc = std::max(mgc, std::max(maximum, T(0)));
         }
+        return mgc;
     }
 
+}  // namespace MGC_details
+
+template <typename T>
+blaze::DynamicMatrix<size_t> MGC_direct::rank_distance_matrix(const DistanceMatrix<T>& data)
+{
+    blaze::DynamicMatrix<size_t> matrix;
+    MGC_details::rank_rows(data, matrix, threads);
     return matrix;
 }
 
@@ -88,20 +846,18 @@ blaze::DynamicMatrix<size_t> MGC_direct::center_ranked_distance_matrix(const Dis
 template <typename T>
 blaze::DynamicMatrix<T> MGC_direct::center_distance_matrix(const DistanceMatrix<T>& X)
 {
-    blaze::DynamicVector<T, blaze::rowVector> list_of_sums = blaze::sum<blaze::columnwise>(X);
-    list_of_sums /= X.rows() - 1;
+    const auto list_of_sums = MGC_details::column_means<T>(X, threads);
 
     blaze::DynamicMatrix<T> centered_distance_matrix(X.rows(), X.columns());
 
-    for (auto i = 0; i < X.rows(); ++i) {
-        for (auto j = 0; j < X.rows(); ++j) {
-            centered_distance_matrix(i, j) = X(i, j) - list_of_sums[j];
+    parallel_for(X.rows(), threads, [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) {
+            for (size_t j = 0; j < X.rows(); ++j) {
+                centered_distance_matrix(i, j) = X(i, j) - list_of_sums[j];
+            }
+            centered_distance_matrix(i, i) = 0;
         }
-    }
-
-    for (int i = 0; i < X.rows(); ++i) {
-        centered_distance_matrix(i, i) = 0;
-    }
+    });
 
     return centered_distance_matrix;
 }
@@ -182,27 +938,32 @@ T MGC_direct::icdf_normal(const T p)
 
 template <typename T>
 blaze::DynamicMatrix<bool> MGC_direct::significant_local_correlation(const blaze::DynamicMatrix<T>& localCorr, T p)
+{
+    const T thres = significance_threshold(localCorr, p, localCorr.rows());
+    const auto region = MGC_details::significant_region(localCorr, thres, threads);
+
+    blaze::DynamicMatrix<bool> R(localCorr.rows(), localCorr.columns(), false);
+    if (region.root < localCorr.rows()) {
+        for (size_t i = 0; i < R.rows(); ++i) {
+            for (size_t j = 0; j < R.columns(); ++j) {
+                R(i, j) = region.contains(i, j) && localCorr(i, j) > thres;
+            }
+        }
+    }
+    return R;
+}
+
+template <typename T>
+T MGC_direct::significance_threshold(const blaze::DynamicMatrix<T>& localCorr, T p, size_t samples)
 {
     /* Sample size minus one */
-    T sz = T(localCorr.rows() - 1);
+    T sz = T(samples - 1);
 
     /* Normal approximation, which is equivalent to beta approximation for n larger than 10 */
     T thres = icdf_normal(1 - p / sz) / sqrt(sz * (sz - 3) / 2 - 1);
 
     /* Take the maximal of threshold and local correlation at the maximal scale */
-    thres = std::max(thres, localCorr(localCorr.rows() - 1, localCorr.rows() - 1));
-
-    /* Threshold R = (localCorr > thres) */
-    blaze::DynamicMatrix<bool> R;
-    R = blaze::map(localCorr, [thres](T e) { return e > thres ? true : false; });
-
-    auto components = metric::graph::largest_connected_component(R);
-
-    if (components.empty()) {
-        return blaze::DynamicMatrix<bool>(R.rows(), R.columns(), false);
-    } else {
-        return components[0];
-    }
+    return std::max(thres, localCorr(localCorr.rows() - 1, localCorr.rows() - 1));
 }
 
 template <typename T>
@@ -225,148 +986,264 @@ template <typename T>
 T MGC_direct::optimal_local_generalized_correlation(
     const blaze::DynamicMatrix<T>& corr, const blaze::DynamicMatrix<bool>& R)
 {
-    size_t m = corr.rows();
-    size_t n = corr.columns();
-    auto MGC = corr(corr.rows() - 1, corr.rows() - 1);  // default sample mgc to local corr at maximal scale
-
-    auto optimalScale = m * n;  // default the optimal scale to maximal scale
-
-    size_t R_sum = blaze::nonZeros(R);
-
-    if (frobeniusNorm(R) != double(0) && R_sum != R.rows() * R.columns())
-    // if (frobeniusNorm(R) != double(0) )
-    {
-
-        if (R_sum >= 2 * std::min(m, n)) {
-            // proceed only when the region area is sufficiently large
-            auto tmp = max_in_matrix_regarding_second_boolean_matrix(corr, R);
-
-            // find all scales within R that maximize the local correlation
-            size_t k = 0, l = 0;
-            for (size_t i = 0; i < corr.rows(); ++i) {
-                // ?
-                for (size_t j = 0; j < corr.rows(); ++j) {
-                    if (corr(i, j) >= tmp && R(i, j) == true) {
-                        k = i;
-                        l = j;
-                    }
-                }
-            }
-
-            if (tmp >= MGC) {
-                MGC = tmp;
-                optimalScale = l * m + (k + 1);  // take the scale of maximal stat and change to single index
+    // size and largest correlation of the region in one pass
+    size_t R_sum = 0;
+    T maximum = std::numeric_limits<T>::lowest();
+    for (size_t i = 0; i < R.rows(); ++i) {
+        for (size_t j = 0; j < R.columns(); ++j) {
+            if (R(i, j)) {
+                ++R_sum;
+                maximum = std::max(maximum, corr(i, j));
             }
         }
     }
 
-    return MGC;
+    return MGC_details::optimal_correlation(corr, R_sum, maximum);
 }
 
 template <typename T>
 void MGC_direct::normalize_generalized_correlation(
     blaze::DynamicMatrix<T>& corr, const blaze::DynamicMatrix<T>& varX, const blaze::DynamicMatrix<T>& varY)
 {
-    for (size_t i = 0; i < corr.rows(); ++i) {
-        for (size_t j = 0; j < corr.rows(); ++j) {
-            corr(i, j) = corr(i, j) / std::sqrt(varX(i, i) * varY(j, j));
+    MGC_details::normalize(corr, MGC_details::diagonal(varX), MGC_details::diagonal(varY));
+}
 
-            if (isnan(corr(i, j))) {
-                corr(i, j) = 0;
-            } else if (corr(i, j) > 1) {
-                corr(i, j) = 1;
-            }
-        }
+template <typename MatrixX, typename MatrixY>
+auto MGC_direct::operator()(const MatrixX& X, const MatrixY& Y) -> accumulator_type<value_type<MatrixX, MatrixY>>
+{
+    // 16 bit ranks are enough up to 65536 samples
+    if (X.rows() <= size_t(std::numeric_limits<uint16_t>::max()) + 1) {
+        return correlation<uint16_t, value_type<MatrixX, MatrixY>>(X, Y);
     }
+    return correlation<uint32_t, value_type<MatrixX, MatrixY>>(X, Y);
 }
 
-template <typename T>
-T MGC_direct::operator()(const DistanceMatrix<T>& X, const DistanceMatrix<T>& Y)
+template <typename MatrixX, typename RanksX, typename MatrixY, typename RanksY>
+auto MGC_direct::ranked(const MatrixX& X, const RanksX& RX, const MatrixY& Y, const RanksY& RY)
+    -> accumulator_type<value_type<MatrixX, MatrixY>>
 {
+    using T = value_type<MatrixX, MatrixY>;
+
+    const auto meansX = MGC_details::column_means<T>(X, threads);
+    const auto meansY = MGC_details::column_means<T>(Y, threads);
 
-    // center distance matrix
-    blaze::DynamicMatrix<T> A = center_distance_matrix(X);
-    blaze::DynamicMatrix<T> B = center_distance_matrix(Y);
+    auto local = MGC_details::local_covariances(X, meansX, RX, Y, meansY, RY, threads);
+    return statistic(local.corr, local.varX, local.varY, threads);
+}
+
+template <typename Rank, typename T, typename MatrixX, typename MatrixY>
+auto MGC_direct::correlation(const MatrixX& X, const MatrixY& Y) -> accumulator_type<T>
+{
+    const size_t n = X.rows();
+    const size_t cells = n * n;
 
-    auto RXt = center_ranked_distance_matrix(X);
-    auto RYt = center_ranked_distance_matrix(Y);
+    const auto meansX = MGC_details::column_means<T>(X, threads);
+    const auto meansY = MGC_details::column_means<T>(Y, threads);
 
-    // transpose copies
-    blaze::DynamicMatrix<T> At = blaze::trans(A);
-    blaze::DynamicMatrix<T> Bt = blaze::trans(B);
-    blaze::DynamicMatrix<size_t> RX = blaze::trans(RXt);
-    blaze::DynamicMatrix<size_t> RY = blaze::trans(RYt);
+    blaze::DynamicMatrix<Rank> RX;
+    blaze::DynamicMatrix<Rank> RY;
+    MGC_details::rank_rows(X, RX, threads);
+    MGC_details::rank_rows(Y, RY, threads);
 
     // compute generalized correlation
-    auto corr = local_covariance(A, Bt, RX, RYt);  // compute all local covariances
-    auto varX = local_covariance(A, At, RX, RXt);  // compute local variances for first data
-    auto varY = local_covariance(B, Bt, RY, RYt);  // compute local variances for second data
-
-    blaze::clear(A);
-    A.shrinkToFit();
-    blaze::clear(At);
-    At.shrinkToFit();
-    blaze::clear(B);
-    B.shrinkToFit();
-    blaze::clear(Bt);
-    Bt.shrinkToFit();
-    blaze::clear(RXt);
-    RXt.shrinkToFit();
+    auto local = MGC_details::local_covariances(X, meansX, RX, Y, meansY, RY, threads);
+    peak_memory = 2 * cells * sizeof(Rank) + cells * sizeof(accumulator_type<T>);
+
     blaze::clear(RX);
     RX.shrinkToFit();
     blaze::clear(RY);
     RY.shrinkToFit();
-    blaze::clear(RYt);
-    RYt.shrinkToFit();
 
-    // normalize the generalized correlation
-    normalize_generalized_correlation(corr, varX, varY);
+    return statistic(local.corr, local.varX, local.varY, threads);
+}
 
-    blaze::clear(varX);
-    varX.shrinkToFit();
-    blaze::clear(varY);
-    varY.shrinkToFit();
+template <typename T>
+T MGC_direct::statistic(blaze::DynamicMatrix<T>& corr, const std::vector<T>& varX, const std::vector<T>& varY,
+    size_t threads, size_t samples)
+{
+    // normalize the generalized correlation
+    MGC_details::normalize(corr, varX, varY, threads);
 
     /* Find the largest connected region of significant local correlations */
-    auto R = significant_local_correlation(corr /*,p=0.02*/);
+    const T thres = significance_threshold(corr, T(0.02), samples == 0 ? corr.rows() : samples);
+    const auto region = MGC_details::significant_region(corr, thres, threads);
 
     /* Find the maximal scaled correlation within the significant region (the Multiscale Graph Correlation) */
-    return optimal_local_generalized_correlation(corr, R);
+    return MGC_details::optimal_correlation(corr, region.cells, region.maximum);
 }
 
-template <class recType1, class Metric1, class recType2, class Metric2>
-template <typename Container1, typename Container2>
-double MGC<recType1, Metric1, recType2, Metric2>::operator()(const Container1& a, const Container2& b) const
+template <typename MatrixX, typename MatrixY>
+MGC_test_result MGC_direct::test(const MatrixX& X, const MatrixY& Y, size_t permutations, double alpha, unsigned seed)
 {
-    assert(a.size() == b.size()) /* "data sets to not have same size"*/;
+    if (X.rows() <= size_t(std::numeric_limits<uint16_t>::max()) + 1) {
+        return permutation_test<uint16_t, value_type<MatrixX, MatrixY>>(X, Y, permutations, alpha, seed);
+    }
+    return permutation_test<uint32_t, value_type<MatrixX, MatrixY>>(X, Y, permutations, alpha, seed);
+}
 
-    /* Compute distance matrix 1 */
-    DistanceMatrix<double> X(a.size());
-    for (size_t i = 0; i < X.rows(); ++i) {
-        X(i, i) = 0;
-        for (size_t j = i + 1; j < X.columns(); ++j) {
-            double distance = Metric1()(a[i], a[j]);
-            X(i, j) = distance;
-        }
+template <typename Rank, typename T, typename MatrixX, typename MatrixY>
+MGC_test_result MGC_direct::permutation_test(
+    const MatrixX& X, const MatrixY& Y, size_t permutations, double alpha, unsigned seed)
+{
+    const size_t n = X.rows();
+
+    const auto meansX = MGC_details::column_means<T>(X, threads);
+    const auto meansY = MGC_details::column_means<T>(Y, threads);
+
+    blaze::DynamicMatrix<Rank> RX;
+    blaze::DynamicMatrix<Rank> RY;
+    MGC_details::rank_rows(X, RX, threads);
+    MGC_details::rank_rows(Y, RY, threads);
+
+    // the local variances do not change when the samples of Y are relabeled
+    auto local = MGC_details::local_covariances(X, meansX, RX, Y, meansY, RY, threads);
+    const auto& varX = local.varX;
+    const auto& varY = local.varY;
+
+    MGC_test_result result;
+    result.statistic = statistic(local.corr, varX, varY, threads);
+    blaze::clear(local.corr);
+    local.corr.shrinkToFit();
+
+    // one seed per permutation, so that the permutations do not depend on the number of threads
+    std::default_random_engine rng(seed);
+    std::vector<unsigned> seeds(permutations);
+    for (auto& permutationSeed : seeds) {
+        permutationSeed = unsigned(rng());
     }
 
-    /* Compute distance matrix 2 */
-    DistanceMatrix<double> Y(b.size());
-    for (size_t i = 0; i < Y.rows(); ++i) {
-        Y(i, i) = 0;
-        for (size_t j = i + 1; j < Y.columns(); ++j) {
-            double distance = Metric2()(b[i], b[j]);
-            Y(i, j) = distance;
+    const size_t wave = thread_count(threads);
+    std::vector<accumulator_type<T>> waveValues(wave);
+    size_t exceeding = 0;
+
+    for (size_t first = 0; first < permutations; first += wave) {
+        const size_t count = std::min(wave, permutations - first);
+
+        parallel_for(count, count, [&](size_t begin, size_t end, size_t) {
+            MGC_direct single;
+            std::vector<size_t> perm(n);
+            for (size_t p = begin; p < end; ++p) {
+                std::iota(perm.begin(), perm.end(), 0);
+                std::shuffle(perm.begin(), perm.end(), std::default_random_engine(seeds[first + p]));
+                auto corr = MGC_details::permuted_covariance(X, meansX, RX, Y, meansY, RY, perm);
+                waveValues[p] = single.statistic(corr, varX, varY, 1);
+            }
+        });
+
+        // the permutations are counted in order, so early stopping does not depend on the number of threads
+        for (size_t p = 0; p < count; ++p) {
+            if (waveValues[p] >= result.statistic) {
+                ++exceeding;
+            }
+            result.permutations = first + p + 1;
+            result.p_value = double(1 + exceeding) / double(1 + result.permutations);
+
+            if (alpha > 0) {
+                const size_t remaining = permutations - result.permutations;
+                const bool above = double(1 + exceeding) / double(1 + permutations) > alpha;
+                const bool below = double(1 + exceeding + remaining) / double(1 + permutations) <= alpha;
+                if (above || below) {
+                    return result;
+                }
+            }
         }
     }
 
-    return MGC_direct()(X, Y);
+    return result;
+}
+
+template <typename T>
+auto MGC_direct::approximate(const NeighbourGraph<T>& X, const NeighbourGraph<T>& Y) -> accumulator_type<T>
+{
+    assert(X.samples() == Y.samples());
+    const size_t n = X.samples();
+    const size_t k = std::min(X.neighbours, Y.neighbours);
+
+    auto corr = MGC_details::sparse_local_covariance(X, Y);
+    const auto varX = MGC_details::diagonal(MGC_details::sparse_local_covariance(X, X));
+    const auto varY = MGC_details::diagonal(MGC_details::sparse_local_covariance(Y, Y));
+    peak_memory = 3 * k * k * sizeof(accumulator_type<T>);
+
+    return statistic(corr, varX, varY, threads, n);
+}
+
+template <class recType1, class Metric1, class recType2, class Metric2, typename T>
+template <typename Container1, typename Container2>
+double MGC<recType1, Metric1, recType2, Metric2, T>::operator()(const Container1& a, const Container2& b) const
+{
+    assert(a.size() == b.size()) /* "data sets to not have same size"*/;
+
+    const auto X = MGC_details::distance_matrix<Metric1, T>(a, threads);
+    const auto Y = MGC_details::distance_matrix<Metric2, T>(b, threads);
+
+    return MGC_direct(threads)(X, Y);
+}
+
+template <class recType1, class Metric1, class recType2, class Metric2, typename T>
+template <typename T1, typename T2>
+double MGC<recType1, Metric1, recType2, Metric2, T>::operator()(
+    const DistanceMatrix<T1>& a, const DistanceMatrix<T2>& b) const
+{
+    assert(a.rows() == b.rows());
+    return MGC_direct(threads)(a, b);
+}
+
+template <class recType1, class Metric1, class recType2, class Metric2, typename T>
+template <typename T1, typename T2>
+double MGC<recType1, Metric1, recType2, Metric2, T>::operator()(
+    const CondensedDistanceMatrix<T1>& a, const CondensedDistanceMatrix<T2>& b) const
+{
+    assert(a.rows() == b.rows());
+    return MGC_direct(threads)(a, b);
+}
+
+template <class recType1, class Metric1, class recType2, class Metric2, typename T>
+template <typename R1, typename M1, typename D1, typename R2, typename M2, typename D2>
+double MGC<recType1, Metric1, recType2, Metric2, T>::operator()(
+    const Matrix<R1, M1, D1>& a, const Matrix<R2, M2, D2>& b) const
+{
+    return operator()(a.distances(), b.distances());
+}
+
+template <class recType1, class Metric1, class recType2, class Metric2, typename T>
+template <typename Container1, typename Container2>
+double MGC<recType1, Metric1, recType2, Metric2, T>::approximate(const Container1& a, const Container2& b,
+    size_t neighbours, size_t meanSamples, unsigned seed) const
+{
+    assert(a.size() == b.size()) /* "data sets to not have same size"*/;
+
+    const std::vector<typename Container1::value_type> vectorA(a.begin(), a.end());
+    const std::vector<typename Container2::value_type> vectorB(b.begin(), b.end());
+
+    // the same samples estimate the means of both spaces
+    std::vector<size_t> indexes(vectorA.size());
+    std::iota(indexes.begin(), indexes.end(), 0);
+    std::shuffle(indexes.begin(), indexes.end(), std::default_random_engine(seed));
+    indexes.resize(std::min(meanSamples, indexes.size()));
+
+    const auto X = MGC_details::neighbour_graph<Metric1, T>(vectorA, neighbours, indexes, threads);
+    const auto Y = MGC_details::neighbour_graph<Metric2, T>(vectorB, neighbours, indexes, threads);
+
+    return MGC_direct(threads).approximate(X, Y);
+}
+
+template <class recType1, class Metric1, class recType2, class Metric2, typename T>
+template <typename Container1, typename Container2>
+MGC_test_result MGC<recType1, Metric1, recType2, Metric2, T>::test(const Container1& a, const Container2& b,
+    size_t permutations, double alpha, unsigned seed) const
+{
+    assert(a.size() == b.size()) /* "data sets to not have same size"*/;
+
+    const auto X = MGC_details::distance_matrix<Metric1, T>(a, threads);
+    const auto Y = MGC_details::distance_matrix<Metric2, T>(b, threads);
+
+    return MGC_direct(threads).test(X, Y, permutations, alpha, seed);
 }
 
-template <class recType1, class Metric1, class recType2, class Metric2>
+template <class recType1, class Metric1, class recType2, class Metric2, typename T>
 template <typename Container1, typename Container2>
-double MGC<recType1, Metric1, recType2, Metric2>::estimate(
-    const Container1& a, const Container2& b, const size_t sampleSize, const double threshold, size_t maxIterations)
+double MGC<recType1, Metric1, recType2, Metric2, T>::estimate(const Container1& a, const Container2& b,
+    const size_t sampleSize, const double threshold, size_t maxIterations, unsigned seed, MGC_estimate_stats* stats)
 {
     assert(a.size() == b.size());
 
@@ -382,6 +1259,9 @@ double MGC<recType1, Metric1, recType2, Metric2>::estimate(
     }
 
     if (maxIterations < 1) {
+        if (stats != nullptr) {
+            *stats = MGC_estimate_stats();
+        }
         return operator()(a, b);
     }
 
@@ -389,66 +1269,81 @@ double MGC<recType1, Metric1, recType2, Metric2>::estimate(
     std::vector<size_t> indexes(dataSize);
     std::iota(indexes.begin(), indexes.end(), 0);
 
-    auto rng = std::default_random_engine();
+    std::default_random_engine rng(seed);
     std::shuffle(indexes.begin(), indexes.end(), rng);
 
     /* Create vector container for fast random access */
     const std::vector<typename Container1::value_type> vectorA(a.begin(), a.end());
     const std::vector<typename Container2::value_type> vectorB(b.begin(), b.end());
 
-    /* Create samples */
-    std::vector<typename Container1::value_type> sampleA;
-    std::vector<typename Container2::value_type> sampleB;
-    sampleA.reserve(sampleSize);
-    sampleB.reserve(sampleSize);
+    const size_t wave = thread_count(threads);
+    std::vector<double> waveValues(wave);
 
+    /* Sorted mgc values, their mean and sum of squared deviations (Welford) */
     std::vector<double> mgcValues;
+    mgcValues.reserve(maxIterations);
     double mu = 0;
-    for (auto i = 1; i <= maxIterations; ++i) {
-        size_t start = (i - 1) * sampleSize;
-        size_t end = std::min(i * sampleSize - 1, dataSize - 1);
-
-        /* Create samples */
-        sampleA.clear();
-        sampleB.clear();
-
-        for (auto j = start; j < end; ++j) {
-            sampleA.push_back(vectorA[indexes[j]]);
-            sampleB.push_back(vectorB[indexes[j]]);
-        }
-
-        /* Get sample mgc value */
-        double mgc = operator()(sampleA, sampleB);
-        mgcValues.push_back(mgc);
-
-        std::sort(mgcValues.begin(), mgcValues.end());
-
-        const size_t n = mgcValues.size();
-        const auto p0 = linspace(0.5 / n, 1 - 0.5 / n, n);
-
-        mu = mean(mgcValues);
-        double sigma = variance(mgcValues, mu);
-
-        const std::vector<double> synth = icdf(p0, mu, sigma);
-        std::vector<double> diff;
-        diff.reserve(n);
-        for (auto i = 0; i < n; ++i) {
-            diff.push_back(mgcValues[i] - synth[i]);
-        }
+    double sigma = 0;
+    double convergence = 0;
+
+    for (size_t first = 0; first < maxIterations; first += wave) {
+        const size_t count = std::min(wave, maxIterations - first);
+
+        /* Get sample mgc values, one subsample per thread */
+        parallel_for(count, count, [&](size_t begin, size_t end, size_t) {
+            std::vector<typename Container1::value_type> sampleA;
+            std::vector<typename Container2::value_type> sampleB;
+            sampleA.reserve(sampleSize);
+            sampleB.reserve(sampleSize);
+            for (size_t s = begin; s < end; ++s) {
+                sampleA.clear();
+                sampleB.clear();
+                const size_t start = (first + s) * sampleSize;
+                for (size_t j = start; j < start + sampleSize; ++j) {
+                    sampleA.push_back(vectorA[indexes[j]]);
+                    sampleB.push_back(vectorB[indexes[j]]);
+                }
+                waveValues[s] = MGC(1)(sampleA, sampleB);
+            }
+        });
+
+        /* Check convergence after every subsample, in order */
+        for (size_t s = 0; s < count; ++s) {
+            const double mgc = waveValues[s];
+            mgcValues.insert(std::upper_bound(mgcValues.begin(), mgcValues.end(), mgc), mgc);
+
+            const size_t n = mgcValues.size();
+            const double delta = mgc - mu;
+            mu += delta / n;
+            sigma += delta * (mgc - mu);
+
+            const auto p0 = linspace(0.5 / n, 1 - 0.5 / n, n);
+            const std::vector<double> synth = icdf(p0, mu, sigma);
+            std::vector<double> diff;
+            diff.reserve(n);
+            for (size_t i = 0; i < n; ++i) {
+                diff.push_back(mgcValues[i] - synth[i]);
+            }
 
-        auto convergence = peak2ems(diff) / n;
-        std::cout << n << " " << convergence << " " << mgc << " " << mu << std::endl;
+            convergence = peak2ems(diff) / n;
 
-        if (convergence < threshold) {
-            return mu;
+            if (convergence < threshold) {
+                if (stats != nullptr) {
+                    *stats = { n, convergence, true };
+                }
+                return mu;
+            }
         }
     }
 
+    if (stats != nullptr) {
+        *stats = { mgcValues.size(), convergence, false };
+    }
     return mu;
 }
 
-template <class recType1, class Metric1, class recType2, class Metric2>
-double MGC<recType1, Metric1, recType2, Metric2>::mean(const std::vector<double>& data)
+template <class recType1, class Metric1, class recType2, class Metric2, typename T>
+double MGC<recType1, Metric1, recType2, Metric2, T>::mean(const std::vector<double>& data)
 {
     double sum = 0;
     for (size_t i = 0; i < data.size(); ++i) {
@@ -459,8 +1354,8 @@ double MGC<recType1, Metric1, recType2, Metric2>::mean(const std::vector<double>
     return value;
 }
 
-template <class recType1, class Metric1, class recType2, class Metric2>
-double MGC<recType1, Metric1, recType2, Metric2>::variance(const std::vector<double>& data, const double mean)
+template <class recType1, class Metric1, class recType2, class Metric2, typename T>
+double MGC<recType1, Metric1, recType2, Metric2, T>::variance(const std::vector<double>& data, const double mean)
 {
     double sum = 0;
     for (size_t i = 0; i < data.size(); ++i) {
@@ -470,8 +1365,8 @@ double MGC<recType1, Metric1, recType2, Metric2>::variance(const std::vector<dou
     return sum;
 }
 
-template <class recType1, class Metric1, class recType2, class Metric2>
-std::vector<double> MGC<recType1, Metric1, recType2, Metric2>::icdf(
+template <class recType1, class Metric1, class recType2, class Metric2, typename T>
+std::vector<double> MGC<recType1, Metric1, recType2, Metric2, T>::icdf(
     const std::vector<double>& prob, const double mu, const double sigma)
 {
     std::vector<double> synth;
@@ -483,11 +1378,12 @@ std::vector<double> MGC<recType1, Metric1, recType2, Metric2>::icdf(
     return synth;
 }
 
-template <class recType1, class Metric1, class recType2, class Metric2>
-double MGC<recType1, Metric1, recType2, Metric2>::erfcinv(const double z)
+template <class recType1, class Metric1, class recType2, class Metric2, typename T>
+double MGC<recType1, Metric1, recType2, Metric2, T>::erfcinv(const double z)
 {
-    if ((z < 0) || (z > 2))
-        std::cout << "Argument outside range [0,2] in inverse erfc function (got p=%1%)." << std::endl;
+    if ((z < 0) || (z > 2)) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
 
     double p, q, s;
     if (z > 1) {
@@ -502,8 +1398,8 @@ double MGC<recType1, Metric1, recType2, Metric2>::erfcinv(const double z)
     return s * erfinv_imp(p, q);
 }
 
-template <class recType1, class Metric1, class recType2, class Metric2>
-double MGC<recType1, Metric1, recType2, Metric2>::erfinv_imp(const double p, const double q)
+template <class recType1, class Metric1, class recType2, class Metric2, typename T>
+double MGC<recType1, Metric1, recType2, Metric2, T>::erfinv_imp(const double p, const double q)
 {
     double result = 0;
 
@@ -596,8 +1492,8 @@ double MGC<recType1, Metric1, recType2, Metric2>::erfinv_imp(const double p, con
     return result;
 }
 
-template <class recType1, class Metric1, class recType2, class Metric2>
-double MGC<recType1, Metric1, recType2, Metric2>::polyeval(const std::vector<double>& poly, const double z)
+template <class recType1, class Metric1, class recType2, class Metric2, typename T>
+double MGC<recType1, Metric1, recType2, Metric2, T>::polyeval(const std::vector<double>& poly, const double z)
 {
     const int n = poly.size();
     double sum = poly[n - 1];
@@ -608,8 +1504,8 @@ double MGC<recType1, Metric1, recType2, Metric2>::polyeval(const std::vector<dou
     return sum;
 }
 
-template <class recType1, class Metric1, class recType2, class Metric2>
-double MGC<recType1, Metric1, recType2, Metric2>::peak2ems(const std::vector<double>& data)
+template <class recType1, class Metric1, class recType2, class Metric2, typename T>
+double MGC<recType1, Metric1, recType2, Metric2, T>::peak2ems(const std::vector<double>& data)
 {
     double maxAbs = -1;
     double rms = 0;
@@ -628,8 +1524,8 @@ double MGC<recType1, Metric1, recType2, Metric2>::peak2ems(const std::vector<dou
     return maxAbs / rms;
 }
 
-template <class recType1, class Metric1, class recType2, class Metric2>
-std::vector<double> MGC<recType1, Metric1, recType2, Metric2>::linspace(double a, double b, int n)
+template <class recType1, class Metric1, class recType2, class Metric2, typename T>
+std::vector<double> MGC<recType1, Metric1, recType2, Metric2, T>::linspace(double a, double b, int n)
 {
     std::vector<double> array;
     if (n > 1) {
@@ -646,4 +1542,54 @@ std::vector<double> MGC<recType1, Metric1, recType2, Metric2>::linspace(double a
     return array;
 }
 
+template <class recType1, class Metric1, class recType2, class Metric2, typename T>
+MGC_window<recType1, Metric1, recType2, Metric2, T>::MGC_window(size_t window, size_t threads_)
+    : threads(threads_)
+    , X_(window, window)
+    , Y_(window, window)
+    , RX_(window, window)
+    , RY_(window, window)
+{
+}
+
+template <class recType1, class Metric1, class recType2, class Metric2, typename T>
+void MGC_window<recType1, Metric1, recType2, Metric2, T>::push(const recType1& a, const recType2& b)
+{
+    if (X_.rows() == 0) {
+        return;
+    }
+    if (size() == X_.rows()) {
+        pop();
+    }
+    MGC_details::window_push<Metric1>(a_, a, X_, RX_, first_, threads);
+    MGC_details::window_push<Metric2>(b_, b, Y_, RY_, first_, threads);
+}
+
+template <class recType1, class Metric1, class recType2, class Metric2, typename T>
+void MGC_window<recType1, Metric1, recType2, Metric2, T>::pop()
+{
+    if (size() == 0) {
+        return;
+    }
+    MGC_details::window_pop(a_, X_, RX_, first_, threads);
+    MGC_details::window_pop(b_, Y_, RY_, first_, threads);
+    first_ = size() == 0 || first_ + 1 == X_.rows() ? 0 : first_ + 1;
+}
+
+template <class recType1, class Metric1, class recType2, class Metric2, typename T>
+double MGC_window<recType1, Metric1, recType2, Metric2, T>::operator()() const
+{
+    // no pair of samples, no correlation
+    if (size() < 2) {
+        return 0;
+    }
+
+    const MGC_details::RingView<blaze::DynamicMatrix<T>> X { X_, first_, size() };
+    const MGC_details::RingView<blaze::DynamicMatrix<T>> Y { Y_, first_, size() };
+    const MGC_details::RingView<blaze::DynamicMatrix<uint32_t>> RX { RX_, first_, size() };
+    const MGC_details::RingView<blaze::DynamicMatrix<uint32_t>> RY { RY_, first_, size() };
+
+    return MGC_direct(threads).ranked(X, RX, Y, RY);
+}
+
 }  // namespace metric
@@ -28,10 +28,13 @@ Copyright (c) PANDA Team
 #include "distance/k-structured/SSIM.hpp"
 #include "distance/k-structured/TWED.hpp"
 #include "distance/k-structured/EMD.hpp"
+#include "distance/k-structured/EMD_sinkhorn.hpp"
 #include "distance/k-structured/Edit.hpp"
 #include "distance/k-structured/kohonen_distance.hpp"
 
 #include "distance/k-related/L1.hpp"
+#include "distance/k-related/Pairwise.hpp"
+#include "distance/traits.hpp"
 #include "distance/k-random/VOI.hpp"
 
 #endif //_METRIC_DISTANCE_HPP
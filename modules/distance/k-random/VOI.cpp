@@ -9,8 +9,11 @@ Copyright (c) 2019 Panda Team
 #define _METRIC_DISTANCE_K_RANDOM_VOI_CPP
 
 #include <algorithm>
+#include <array>
 #include <cmath>
+#include <cstdint>
 #include <iostream>
+#include <numeric>
 #include <random>
 #include <unordered_set>
 #include <vector>
@@ -22,6 +25,7 @@ Copyright (c) 2019 Panda Team
 #include <boost/math/special_functions/gamma.hpp>
 
 #include "../../space/tree.hpp"
+#include "../../utils/parallel.hpp"
 #include "VOI.hpp"
 
 namespace metric {
@@ -88,6 +92,31 @@ namespace {
             }
         }
     }
+    // Xn gets the first dx coordinates of the records of XY
+    template <typename T>
+    void split(const std::vector<std::vector<T>>& XY, std::size_t dx, std::vector<std::vector<T>>& Xn)
+    {
+        Xn.resize(XY.size());
+        for (std::size_t i = 0; i < XY.size(); i++) {
+            Xn[i].assign(XY[i].begin(), XY[i].begin() + dx);
+        }
+    }
+
+    // sum of term(i) over [0, n), the per thread partial sums are added in a fixed order
+    template <typename T, typename Term>
+    T parallel_sum(std::size_t n, std::size_t threads, const Term& term)
+    {
+        std::vector<T> partial(thread_count(threads), T(0));
+        const std::size_t chunks = parallel_for(n, threads, [&](std::size_t begin, std::size_t end, std::size_t chunk) {
+            T sum = 0;
+            for (std::size_t i = begin; i < end; i++) {
+                sum += term(i);
+            }
+            partial[chunk] = sum;
+        });
+        return std::accumulate(partial.begin(), partial.begin() + chunks, T(0));
+    }
+
     template <typename T>
     std::vector<T> unique(const std::vector<T>& data)
     {
@@ -101,10 +130,235 @@ namespace {
 
 }  // namespace
 
+namespace VOI_details {
+
+    // records relabelled with dense symbol ids in [0, count)
+    struct Symbols {
+        std::vector<std::uint64_t> ids;
+        std::uint64_t count = 0;
+    };
+
+    // largest alphabet counted in a dense histogram without hashing
+    inline std::uint64_t dense_limit(std::size_t n) { return std::max<std::uint64_t>(std::uint64_t(1) << 16, n); }
+
+    inline std::uint64_t mix(std::uint64_t h)
+    {
+        // splitmix64 finalizer, spreads consecutive keys over the table
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebULL;
+        h ^= h >> 31;
+        return h;
+    }
+
+    /**
+     * @brief label items [begin, end) with dense ids using an open addressing hash table
+     *
+     * @param hash 64 bit hash of an item
+     * @param equal equality of two items
+     * @param ids output, ids[i] for every item i of the range
+     * @param reps output, first item of every id
+     */
+    template <typename Hash, typename Equal>
+    void label(std::size_t begin, std::size_t end, const Hash& hash, const Equal& equal, std::uint64_t* ids,
+        std::vector<std::size_t>& reps)
+    {
+        constexpr std::uint64_t empty = ~std::uint64_t(0);
+        std::size_t capacity = 16;
+        while (capacity < 2 * (end - begin)) {
+            capacity *= 2;
+        }
+        const std::size_t mask = capacity - 1;
+        std::vector<std::uint64_t> slot_id(capacity, empty);
+        std::vector<std::uint64_t> slot_hash(capacity);
+        for (std::size_t i = begin; i < end; i++) {
+            const std::uint64_t h = hash(i);
+            std::size_t s = h & mask;
+            while (slot_id[s] != empty && !(slot_hash[s] == h && equal(reps[slot_id[s]], i))) {
+                s = (s + 1) & mask;
+            }
+            if (slot_id[s] == empty) {
+                slot_id[s] = reps.size();
+                slot_hash[s] = h;
+                reps.push_back(i);
+            }
+            ids[i] = slot_id[s];
+        }
+    }
+
+    /**
+     * @brief label n items with dense ids, chunks are labelled in parallel and their labels merged afterwards
+     */
+    template <typename Hash, typename Equal>
+    Symbols label(std::size_t n, std::size_t threads, const Hash& hash, const Equal& equal)
+    {
+        Symbols result;
+        result.ids.resize(n);
+        std::vector<std::vector<std::size_t>> reps(thread_count(threads));
+        const std::size_t chunks = parallel_for(n, threads, [&](std::size_t begin, std::size_t end, std::size_t chunk) {
+            label(begin, end, hash, equal, result.ids.data(), reps[chunk]);
+        });
+        if (chunks == 1) {
+            result.count = reps[0].size();
+            return result;
+        }
+
+        // the representatives of all chunks are labelled once more to find the global ids
+        std::vector<std::size_t> all_reps;
+        std::vector<std::size_t> offsets(chunks + 1, 0);
+        for (std::size_t chunk = 0; chunk < chunks; chunk++) {
+            all_reps.insert(all_reps.end(), reps[chunk].begin(), reps[chunk].end());
+            offsets[chunk + 1] = all_reps.size();
+        }
+        std::vector<std::uint64_t> global(all_reps.size());
+        std::vector<std::size_t> global_reps;
+        label(
+            0, all_reps.size(), [&](std::size_t r) { return hash(all_reps[r]); },
+            [&](std::size_t r1, std::size_t r2) { return equal(all_reps[r1], all_reps[r2]); }, global.data(),
+            global_reps);
+        result.count = global_reps.size();
+        parallel_for(n, threads, [&](std::size_t begin, std::size_t end, std::size_t chunk) {
+            for (std::size_t i = begin; i < end; i++) {
+                result.ids[i] = global[offsets[chunk] + result.ids[i]];
+            }
+        });
+        return result;
+    }
+
+    /**
+     * @brief symbols of discrete records, records are used directly as mixed radix codes when their alphabet is small
+     */
+    template <typename Records>
+    Symbols symbols(const Records& data, std::size_t threads)
+    {
+        const std::size_t n = data.size();
+        const std::size_t d = data[0].size();
+        bool same_size = true;
+        std::vector<long long> lo(data[0].begin(), data[0].end());
+        std::vector<long long> hi(lo);
+        for (const auto& record : data) {
+            if (record.size() != d) {
+                same_size = false;
+                break;
+            }
+            std::size_t j = 0;
+            for (auto v : record) {
+                lo[j] = std::min<long long>(lo[j], v);
+                hi[j] = std::max<long long>(hi[j], v);
+                ++j;
+            }
+        }
+        double alphabet = 1;
+        for (std::size_t j = 0; same_size && j < d; j++) {
+            alphabet *= double(hi[j] - lo[j] + 1);
+        }
+
+        if (same_size && alphabet <= double(dense_limit(n))) {
+            Symbols result;
+            result.ids.resize(n);
+            result.count = std::uint64_t(alphabet);
+            parallel_for(n, threads, [&](std::size_t begin, std::size_t end, std::size_t) {
+                for (std::size_t i = begin; i < end; i++) {
+                    std::uint64_t code = 0;
+                    std::size_t j = 0;
+                    for (auto v : data[i]) {
+                        code = code * std::uint64_t(hi[j] - lo[j] + 1) + std::uint64_t(v - lo[j]);
+                        ++j;
+                    }
+                    result.ids[i] = code;
+                }
+            });
+            return result;
+        }
+        return label(
+            n, threads,
+            [&data](std::size_t i) { return mix(boost::hash_range(data[i].begin(), data[i].end())); },
+            [&data](std::size_t i, std::size_t j) {
+                return data[i].size() == data[j].size() && std::equal(data[i].begin(), data[i].end(), data[j].begin());
+            });
+    }
+
+    /// symbols of the joint records (x_i, y_i)
+    inline Symbols joint_symbols(const Symbols& x, const Symbols& y, std::size_t threads)
+    {
+        const std::size_t n = x.ids.size();
+        if (double(x.count) * double(y.count) <= double(dense_limit(n))) {
+            Symbols result;
+            result.ids.resize(n);
+            result.count = x.count * y.count;
+            parallel_for(n, threads, [&](std::size_t begin, std::size_t end, std::size_t) {
+                for (std::size_t i = begin; i < end; i++) {
+                    result.ids[i] = x.ids[i] * y.count + y.ids[i];
+                }
+            });
+            return result;
+        }
+        return label(
+            n, threads, [&](std::size_t i) { return mix(x.ids[i] * y.count + y.ids[i]); },
+            [&](std::size_t i, std::size_t j) { return x.ids[i] == x.ids[j] && y.ids[i] == y.ids[j]; });
+    }
+
+    /// plug-in entropy of the symbol frequencies, histograms of the threads are reduced in a fixed order
+    template <typename L>
+    double entropy(const Symbols& symbols, L logbase, std::size_t threads)
+    {
+        const std::size_t n = symbols.ids.size();
+        std::vector<std::vector<std::size_t>> partial(thread_count(threads));
+        const std::size_t chunks = parallel_for(n, threads, [&](std::size_t begin, std::size_t end, std::size_t chunk) {
+            partial[chunk].assign(symbols.count, 0);
+            for (std::size_t i = begin; i < end; i++) {
+                ++partial[chunk][symbols.ids[i]];
+            }
+        });
+        double sum = 0;
+        for (std::uint64_t s = 0; s < symbols.count; s++) {
+            std::size_t count = 0;
+            for (std::size_t chunk = 0; chunk < chunks; chunk++) {
+                count += partial[chunk][s];
+            }
+            if (count > 0) {
+                const double p = double(count) / n;
+                sum -= p * std::log(p);
+            }
+        }
+        return sum / std::log(double(logbase));
+    }
+
+    /// entropies of a, b and of the joint records (a_i, b_i)
+    template <typename Records, typename L>
+    std::array<double, 3> entropies(const Records& a, const Records& b, L logbase, std::size_t threads)
+    {
+        if (a.empty() || a.size() != b.size()) {
+            return { 0, 0, 0 };
+        }
+        const Symbols x = symbols(a, threads);
+        const Symbols y = symbols(b, threads);
+        const Symbols xy = joint_symbols(x, y, threads);
+        return { entropy(x, logbase, threads), entropy(y, logbase, threads), entropy(xy, logbase, threads) };
+    }
+
+}  // namespace VOI_details
+
+
+
+template <typename Container, typename Metric, typename L>
+double entropy(const std::vector<Container>& data, std::size_t k, L logbase, Metric metric, std::size_t threads)
+{
+    if (data.empty() || data[0].empty()) {
+        return 0;
+    }
+    if (data.size() < k + 1)
+        throw std::invalid_argument("number of points in dataset must be larger than k");
+
+    //add_noise(data); // TODO test
+    metric::Tree<Container, Metric> tree(data, -1, metric);
+    return entropy(data, tree, k, logbase, metric, threads);
+}
 
 template <typename Container, typename Metric, typename L>
-double entropy(
-    std::vector<Container> data, std::size_t k, L logbase, Metric metric)
+double entropy(const std::vector<Container>& data, const Tree<Container, Metric>& tree, std::size_t k, L logbase,
+    const Metric& metric, std::size_t threads)
 {
     using T = typename Container::value_type;
 
@@ -129,22 +383,30 @@ double entropy(
         cb = cb + d * log(logbase, std::tgamma(1 + 1 / p)) - log(logbase, std::tgamma(1 + d / p));
     }
 
-    //add_noise(data); // TODO test
-    metric::Tree<Container, Metric> tree(data, -1, metric);
     double entropyEstimate = boost::math::digamma(N) - boost::math::digamma(k) + cb + d * log(logbase, two);
-    for (std::size_t i = 0; i < N; i++) {
+    entropyEstimate += parallel_sum<double>(data.size(), threads, [&](std::size_t i) {
         auto res = tree.knn(data[i], k + 1);
-        entropyEstimate += d / N * log(logbase, res.back().second);
-    }
+        return d / N * log(logbase, res.back().second);
+    });
     return entropyEstimate;
 }
 
 // Kozachenko-Leonenko estimator based on https://hal.archives-ouvertes.fr/hal-00331300/document (Shannon diff. entropy,
 // q = 1)
 
+/**
+ * @brief Kozachenko-Leonenko entropy estimator on a tree built from data
+ *
+ * @param data data records
+ * @param tree tree built from data
+ * @param k number of neighbours
+ * @param logbase base of the logarithm
+ * @param threads number of threads running the neighbour queries, 0 means one per hardware thread
+ * @return value of entropy estimation of the data
+ */
 template <typename T, typename Metric = metric::Euclidian<T>, typename L = T>  // TODO check if L = T is correct
-typename std::enable_if<!std::is_integral<T>::value, T>::type entropy_kl(
-    std::vector<std::vector<T>> data, std::size_t k = 3, L logbase = 2, Metric metric = Metric())
+typename std::enable_if<!std::is_integral<T>::value, T>::type entropy_kl(const std::vector<std::vector<T>>& data,
+    const Tree<std::vector<T>, Metric>& tree, std::size_t k = 3, L logbase = 2, std::size_t threads = 1)
 {
     if (data.empty() || data[0].empty())
         return 0;
@@ -153,23 +415,33 @@ typename std::enable_if<!std::is_integral<T>::value, T>::type entropy_kl(
     if constexpr (!std::is_same<Metric, typename metric::Euclidian<T>>::value)
         throw std::logic_error("entropy function is now implemented only for Euclidean distance");
 
-    metric::Tree<std::vector<T>, Metric> tree(data, -1, metric);
-
     size_t N = data.size();
     size_t m = data[0].size();
     T two = 2.0;  // this is in order to make types match the log template function
-    T sum = 0;
     auto Pi = boost::math::constants::pi<T>();
     T half_m = m / two;
     auto coeff = (N - 1) * exp(-boost::math::digamma(k + 1)) * std::pow(Pi, half_m) / boost::math::tgamma(half_m + 1);
 
-    for (std::size_t i = 0; i < N; i++) {
+    return parallel_sum<T>(N, threads, [&](std::size_t i) {
         auto neighbors = tree.knn(data[i], k + 1);
         auto ro = neighbors.back().second;
-        sum = sum + log(logbase, coeff * std::pow(ro, m));
-    }
+        return log(logbase, coeff * std::pow(ro, m));
+    });
+}
+
+template <typename T, typename Metric = metric::Euclidian<T>, typename L = T>  // TODO check if L = T is correct
+typename std::enable_if<!std::is_integral<T>::value, T>::type entropy_kl(const std::vector<std::vector<T>>& data,
+    std::size_t k = 3, L logbase = 2, Metric metric = Metric(), std::size_t threads = 1)
+{
+    if (data.empty() || data[0].empty())
+        return 0;
+    if (data.size() < k + 1)
+        throw std::invalid_argument("number of points in dataset must be larger than k");
+    if constexpr (!std::is_same<Metric, typename metric::Euclidian<T>>::value)
+        throw std::logic_error("entropy function is now implemented only for Euclidean distance");
 
-    return sum;
+    metric::Tree<std::vector<T>, Metric> tree(data, -1, metric);
+    return entropy_kl<T, Metric, L>(data, tree, k, logbase, threads);
 }
 
 template <typename T>
@@ -190,20 +462,22 @@ std::pair<std::vector<double>, std::vector<std::vector<T>>> pluginEstimator(cons
 }
 
 template <typename T, typename Metric>
-typename std::enable_if<!std::is_integral<T>::value, T>::type mutualInformation(
-    const std::vector<std::vector<T>>& Xc, const std::vector<std::vector<T>>& Yc, int k, Metric metric, int version)
+typename std::enable_if<!std::is_integral<T>::value, T>::type mutualInformation(const std::vector<std::vector<T>>& Xc,
+    const std::vector<std::vector<T>>& Yc, int k, Metric metric, int version, std::size_t threads)
 {
     T N = Xc.size();
 
     if (N < k + 1 || Yc.size() < k + 1)
         throw std::invalid_argument("number of points in dataset must be larger than k");
+    if (version != 1 && version != 2)
+        throw std::runtime_error("this version not allowed");
 
-    auto X = Xc;
-    auto Y = Yc;
-    add_noise(X);
-    add_noise(Y);
+    // the noise is added to the joint records, the noisy X is read back from them instead of copying the inputs
     std::vector<std::vector<T>> XY;
-    combine(X, Y, XY);
+    combine(Xc, Yc, XY);
+    add_noise(XY);
+    std::vector<std::vector<T>> X;
+    split(XY, Xc[0].size(), X);
     metric::Tree<std::vector<T>, Metric> tree(XY, -1, metric);
     auto entropyEstimate = boost::math::digamma(k) + boost::math::digamma(N);
     if (version == 2) {
@@ -212,7 +486,7 @@ typename std::enable_if<!std::is_integral<T>::value, T>::type mutualInformation(
 
     metric::Tree<std::vector<T>, Metric> xTree(X, -1, metric);
 
-    for (std::size_t i = 0; i < N; i++) {
+    entropyEstimate -= parallel_sum<double>(XY.size(), threads, [&](std::size_t i) {
         auto res = tree.knn(XY[i], k + 1);
         auto neighbor = res.back().first;
         auto dist = res.back().second;
@@ -231,24 +505,28 @@ typename std::enable_if<!std::is_integral<T>::value, T>::type mutualInformation(
                 // logic without updating Tree
             auto rnn_set = xTree.rnn(X[i], ex_eps);
             nx = rnn_set.size();  // replaced ex by ex_eps by Max F
-        } else {
-            throw std::runtime_error("this version not allowed");
         }
-        entropyEstimate -= 1.0 / N * boost::math::digamma(static_cast<double>(nx));
-    }
+        return 1.0 / N * boost::math::digamma(static_cast<double>(nx));
+    });
     return entropyEstimate;
 }
 
+template <typename T, typename L>
+typename std::enable_if<std::is_integral<T>::value, double>::type discrete_entropy(
+    const std::vector<std::vector<T>>& data, L logbase, std::size_t threads)
+{
+    if (data.empty()) {
+        return 0;
+    }
+    return VOI_details::entropy(VOI_details::symbols(data, threads), logbase, threads);
+}
+
 template <typename T>
-typename std::enable_if<std::is_integral<T>::value, T>::type mutualInformation(
-    const std::vector<std::vector<T>>& Xc, const std::vector<std::vector<T>>& Yc, T logbase)
+typename std::enable_if<std::is_integral<T>::value, double>::type mutualInformation(
+    const std::vector<std::vector<T>>& Xc, const std::vector<std::vector<T>>& Yc, double logbase, std::size_t threads)
 {
-    std::vector<std::vector<T>> XY;
-    combine(Xc, Yc, XY);
-    return entropy<T>(Xc, logbase)
-        + entropy<T>(Yc,
-            logbase)  // entropy overload for integers is not implemented yet
-        - entropy<T>(XY, logbase);
+    const auto h = VOI_details::entropies(Xc, Yc, logbase, threads);
+    return h[0] + h[1] - h[2];
 }
 
 template <typename T, typename Metric>
@@ -270,27 +548,66 @@ typename std::enable_if<!std::is_integral<T>::value, T>::type variationOfInforma
 
 template <typename V>
 template <template <class, class> class Container, class Allocator_inner, class Allocator_outer, class El>
-typename std::enable_if<!std::is_integral<El>::value, V>::type VOI<V>::operator()(
-    const Container<Container<El, Allocator_inner>, Allocator_outer>& a,
+V VOI<V>::operator()(const Container<Container<El, Allocator_inner>, Allocator_outer>& a,
     const Container<Container<El, Allocator_inner>, Allocator_outer>& b) const
+{
+    if constexpr (std::is_integral<El>::value) {
+        // H(a) + H(b) - 2 I(a, b) = 2 H(a, b) - H(a) - H(b)
+        const auto h = VOI_details::entropies(a, b, logbase, threads);
+        return 2 * h[2] - h[0] - h[1];
+    } else {
+        using Cheb = metric::Chebyshev<El>;
+        return entropy<std::vector<El>, Cheb>(a, k, logbase, Cheb(), threads)
+            + entropy<std::vector<El>, Cheb>(b, k, logbase, Cheb(), threads)
+            - 2 * mutualInformation<El>(a, b, k, Cheb(), 2, threads);
+    }
+}
+
+template <typename V>
+template <typename El>
+typename std::enable_if<!std::is_integral<El>::value, V>::type VOI<V>::operator()(const std::vector<std::vector<El>>& a,
+    const std::vector<std::vector<El>>& b, const Tree<std::vector<El>, Chebyshev<El>>& tree_a,
+    const Tree<std::vector<El>, Chebyshev<El>>& tree_b) const
 {
     using Cheb = metric::Chebyshev<El>;
-    return entropy<std::vector<El>, Cheb>(a, k, logbase, Cheb()) + entropy<std::vector<El>, Cheb>(b, k, logbase, Cheb())
-        - 2 * mutualInformation<El>(a, b, k);
+    return entropy(a, tree_a, k, logbase, Cheb(), threads) + entropy(b, tree_b, k, logbase, Cheb(), threads)
+        - 2 * mutualInformation<El>(a, b, k, Cheb(), 2, threads);
 }
 
 template <typename V>
 template <template <class, class> class Container, class Allocator_inner, class Allocator_outer, class El>
-typename std::enable_if<!std::is_integral<El>::value, V>::type VOI_normalized<V>::operator()(
-    const Container<Container<El, Allocator_inner>, Allocator_outer>& a,
+V VOI_normalized<V>::operator()(const Container<Container<El, Allocator_inner>, Allocator_outer>& a,
     const Container<Container<El, Allocator_inner>, Allocator_outer>& b) const
+{
+    if constexpr (std::is_integral<El>::value) {
+        // 1 - I(a, b) / (H(a) + H(b) - I(a, b)) = 1 - I(a, b) / H(a, b)
+        const auto h = VOI_details::entropies(a, b, this->logbase, this->threads);
+        if (h[2] == 0) {
+            return 0;  // both are constant
+        }
+        return 1 - (h[0] + h[1] - h[2]) / h[2];
+    } else {
+        using Cheb = metric::Chebyshev<El>;
+        auto mi = mutualInformation<El>(a, b, this->k, Cheb(), 2, this->threads);
+        return 1
+            - (mi
+                / (entropy<std::vector<El>, Cheb>(a, this->k, this->logbase, Cheb(), this->threads)
+                    + entropy<std::vector<El>, Cheb>(b, this->k, this->logbase, Cheb(), this->threads) - mi));
+    }
+}
+
+template <typename V>
+template <typename El>
+typename std::enable_if<!std::is_integral<El>::value, V>::type VOI_normalized<V>::operator()(
+    const std::vector<std::vector<El>>& a, const std::vector<std::vector<El>>& b,
+    const Tree<std::vector<El>, Chebyshev<El>>& tree_a, const Tree<std::vector<El>, Chebyshev<El>>& tree_b) const
 {
     using Cheb = metric::Chebyshev<El>;
-    auto mi = mutualInformation<El>(a, b, this->k);
+    auto mi = mutualInformation<El>(a, b, this->k, Cheb(), 2, this->threads);
     return 1
         - (mi
-            / (entropy<std::vector<El>, Cheb>(a, this->k, this->logbase, Cheb())
-                + entropy<std::vector<El>, Cheb>(b, this->k, this->logbase, Cheb()) - mi));
+            / (entropy(a, tree_a, this->k, this->logbase, Cheb(), this->threads)
+                + entropy(b, tree_b, this->k, this->logbase, Cheb(), this->threads) - mi));
 }
 
 // VOI based on Kozachenko-Leonenko entropy estimator
@@ -303,7 +620,22 @@ typename std::enable_if<!std::is_integral<El>::value, V>::type VOI_kl<V>::operat
 {
     std::vector<std::vector<El>> ab;
     combine(a, b, ab);
-    return 2 * entropy_kl(ab) - entropy_kl(a) - entropy_kl(b);
+    using Eucl = metric::Euclidian<El>;
+    return 2 * entropy_kl<El>(ab, 3, El(2), Eucl(), threads) - entropy_kl<El>(a, 3, El(2), Eucl(), threads)
+        - entropy_kl<El>(b, 3, El(2), Eucl(), threads);
+}
+
+template <typename V>
+template <typename El>
+typename std::enable_if<!std::is_integral<El>::value, V>::type VOI_kl<V>::operator()(
+    const std::vector<std::vector<El>>& a, const std::vector<std::vector<El>>& b,
+    const Tree<std::vector<El>, Euclidian<El>>& tree_a, const Tree<std::vector<El>, Euclidian<El>>& tree_b) const
+{
+    std::vector<std::vector<El>> ab;
+    combine(a, b, ab);
+    using Eucl = metric::Euclidian<El>;
+    return 2 * entropy_kl<El>(ab, 3, El(2), Eucl(), threads) - entropy_kl<El>(a, tree_a, 3, El(2), threads)
+        - entropy_kl<El>(b, tree_b, 3, El(2), threads);
 }
 
 template <typename V>
@@ -312,11 +644,28 @@ typename std::enable_if<!std::is_integral<El>::value, V>::type VOI_normalized_kl
     const Container<Container<El, Allocator_inner>, Allocator_outer>& a,
     const Container<Container<El, Allocator_inner>, Allocator_outer>& b) const
 {
-    auto entropy_a = entropy_kl(a);
-    auto entropy_b = entropy_kl(b);
+    using Eucl = metric::Euclidian<El>;
+    auto entropy_a = entropy_kl<El>(a, 3, El(2), Eucl(), this->threads);
+    auto entropy_b = entropy_kl<El>(b, 3, El(2), Eucl(), this->threads);
+    std::vector<std::vector<El>> ab;
+    combine(a, b, ab);
+    auto joint_entropy = entropy_kl<El>(ab, 3, El(2), Eucl(), this->threads);
+    auto mi = entropy_a + entropy_b - joint_entropy;
+    return 1 - (mi / (entropy_a + entropy_b - mi));
+}
+
+template <typename V>
+template <typename El>
+typename std::enable_if<!std::is_integral<El>::value, V>::type VOI_normalized_kl<V>::operator()(
+    const std::vector<std::vector<El>>& a, const std::vector<std::vector<El>>& b,
+    const Tree<std::vector<El>, Euclidian<El>>& tree_a, const Tree<std::vector<El>, Euclidian<El>>& tree_b) const
+{
+    using Eucl = metric::Euclidian<El>;
+    auto entropy_a = entropy_kl<El>(a, tree_a, 3, El(2), this->threads);
+    auto entropy_b = entropy_kl<El>(b, tree_b, 3, El(2), this->threads);
     std::vector<std::vector<El>> ab;
     combine(a, b, ab);
-    auto joint_entropy = entropy_kl(ab);
+    auto joint_entropy = entropy_kl<El>(ab, 3, El(2), Eucl(), this->threads);
     auto mi = entropy_a + entropy_b - joint_entropy;
     return 1 - (mi / (entropy_a + entropy_b - mi));
 }
@@ -15,6 +15,9 @@ Copyright (c) 2019 Panda Team
 
 namespace metric {
 
+template <class recType, class Metric>
+class Tree;
+
 /**
  * @brief Continuous entropy estimator
  *
@@ -22,11 +25,27 @@ namespace metric {
  * @param k
  * @param logbase
  * @param metric
+ * @param threads number of threads running the neighbour queries, 0 means one per hardware thread
  * @return value of entropy estimation of the data 
  */
 template <typename Container, typename Metric = metric::Euclidian<typename Container::value_type>, typename L = double>
-double entropy(
-    std::vector<Container> data, std::size_t k = 3, L logbase = 2, Metric metric = Metric());
+double entropy(const std::vector<Container>& data, std::size_t k = 3, L logbase = 2, Metric metric = Metric(),
+    std::size_t threads = 1);
+
+/**
+ * @brief Continuous entropy estimator on a tree already built from data
+ *
+ * @param data
+ * @param tree tree built from data with metric, it can be reused between estimations
+ * @param k
+ * @param logbase
+ * @param metric
+ * @param threads number of threads running the neighbour queries, 0 means one per hardware thread
+ * @return value of entropy estimation of the data
+ */
+template <typename Container, typename Metric, typename L = double>
+double entropy(const std::vector<Container>& data, const Tree<Container, Metric>& tree, std::size_t k = 3,
+    L logbase = 2, const Metric& metric = Metric(), std::size_t threads = 1);
 
 /**
  * @brief
@@ -45,15 +64,42 @@ std::pair<std::vector<double>, std::vector<std::vector<T>>> pluginEstimator(cons
  * @param k
  * @param metric
  * @param version
+ * @param threads number of threads running the neighbour queries, 0 means one per hardware thread
  * @return
  */
 template <typename T, typename Metric = metric::Chebyshev<T>>
 typename std::enable_if<!std::is_integral<T>::value, T>::type mutualInformation(const std::vector<std::vector<T>>& Xc,
-    const std::vector<std::vector<T>>& Yc, int k = 3, Metric metric = Metric(), int version = 2);
+    const std::vector<std::vector<T>>& Yc, int k = 3, Metric metric = Metric(), int version = 2,
+    std::size_t threads = 1);
+
+/**
+ * @brief Plug-in entropy estimator for discrete data, every distinct record is one symbol
+ *
+ * @details Small alphabets are counted in a dense histogram, other records are labelled through a hash table. Both
+ * are built in parallel and reduced at the end.
+ *
+ * @param data records of integral values
+ * @param logbase base of the logarithm
+ * @param threads number of threads, 0 means one per hardware thread
+ * @return entropy of the empirical distribution of the records
+ */
+template <typename T, typename L = double>
+typename std::enable_if<std::is_integral<T>::value, double>::type discrete_entropy(
+    const std::vector<std::vector<T>>& data, L logbase = 2, std::size_t threads = 1);
 
+/**
+ * @brief Mutual information of discrete data from the counts of the records and of the joint records
+ *
+ * @param Xc
+ * @param Yc
+ * @param logbase
+ * @param threads number of threads, 0 means one per hardware thread
+ * @return
+ */
 template <typename T>
-typename std::enable_if<std::is_integral<T>::value, T>::type mutualInformation(
-    const std::vector<std::vector<T>>& Xc, const std::vector<std::vector<T>>& Yc, T logbase = 2.0);
+typename std::enable_if<std::is_integral<T>::value, double>::type mutualInformation(
+    const std::vector<std::vector<T>>& Xc, const std::vector<std::vector<T>>& Yc, double logbase = 2.0,
+    std::size_t threads = 1);
 
 /**
  * @brief
@@ -92,31 +138,49 @@ struct VOI {
 
     int k = 3;
     V logbase = 2;
+    std::size_t threads = 1;
 
     /**
      * @brief Construct a new VOI object
      *
      * @param k_
      * @param logbase_
+     * @param threads_ number of threads running the neighbour queries, 0 means one per hardware thread
      */
-    explicit VOI(int k_ = 3, V logbase_ = 2)
+    explicit VOI(int k_ = 3, V logbase_ = 2, std::size_t threads_ = 1)
         : k(k_)
         , logbase(logbase_)
+        , threads(threads_)
     {
     }
 
     /**
      * @brief calculate variation of information between two containers
      *
+     * @details integral values are treated as discrete symbols and counted, real values use the kNN estimators
+     *
      * @param a first container
      * @param b second container
      * @return variation of information between a and b
      */
     template <template <class, class> class Container, class Allocator_inner, class Allocator_outer, class El>
-    typename std::enable_if<!std::is_integral<El>::value, V>::type  // only real values are accepted
-    operator()(const Container<Container<El, Allocator_inner>, Allocator_outer>& a,
+    V operator()(const Container<Container<El, Allocator_inner>, Allocator_outer>& a,
         const Container<Container<El, Allocator_inner>, Allocator_outer>& b) const;
 
+    /**
+     * @brief calculate the value with trees already built from a and b, so that they can be reused between pairs
+     *
+     * @param a first container
+     * @param b second container
+     * @param tree_a tree built from a
+     * @param tree_b tree built from b
+     * @return value for a and b
+     */
+    template <typename El>
+    typename std::enable_if<!std::is_integral<El>::value, V>::type operator()(const std::vector<std::vector<El>>& a,
+        const std::vector<std::vector<El>>& b, const Tree<std::vector<El>, Chebyshev<El>>& tree_a,
+        const Tree<std::vector<El>, Chebyshev<El>>& tree_b) const;
+
     // TODO add support of 1D random values passed in simple containers
 };
 // deduction guide for VOI
@@ -136,24 +200,40 @@ struct VOI_normalized : VOI<V> {
      *
      * @param k_
      * @param logbase_
+     * @param threads_ number of threads running the neighbour queries, 0 means one per hardware thread
      */
-    explicit VOI_normalized(int k_ = 3, V logbase_ = 2)
-        : VOI<V>(k_, logbase_)
+    explicit VOI_normalized(int k_ = 3, V logbase_ = 2, std::size_t threads_ = 1)
+        : VOI<V>(k_, logbase_, threads_)
     {
     }
 
     /**
      * @brief Calculate Variation of Information 
      *
+     * @details integral values are treated as discrete symbols and counted, real values use the kNN estimators
+     *
      * @param a first container
      * @param b second container
      * @return varition of information between a and b
      */
     template <template <class, class> class Container, class Allocator_inner, class Allocator_outer, class El>
-    typename std::enable_if<!std::is_integral<El>::value, V>::type  // only real values are accepted
-    operator()(const Container<Container<El, Allocator_inner>, Allocator_outer>& a,
+    V operator()(const Container<Container<El, Allocator_inner>, Allocator_outer>& a,
         const Container<Container<El, Allocator_inner>, Allocator_outer>& b) const;
 
+    /**
+     * @brief calculate the value with trees already built from a and b, so that they can be reused between pairs
+     *
+     * @param a first container
+     * @param b second container
+     * @param tree_a tree built from a
+     * @param tree_b tree built from b
+     * @return value for a and b
+     */
+    template <typename El>
+    typename std::enable_if<!std::is_integral<El>::value, V>::type operator()(const std::vector<std::vector<El>>& a,
+        const std::vector<std::vector<El>>& b, const Tree<std::vector<El>, Chebyshev<El>>& tree_a,
+        const Tree<std::vector<El>, Chebyshev<El>>& tree_b) const;
+
     // TODO add support of 1D random values passed in simple containers
 };
 
@@ -172,16 +252,19 @@ struct VOI_kl {
 
     int k = 3;
     V logbase = 2;
+    std::size_t threads = 1;
 
     /**
      * @brief Construct a new VOI_kl object
      *
      * @param k_
      * @param logbase_
+     * @param threads_ number of threads running the neighbour queries, 0 means one per hardware thread
      */
-    explicit VOI_kl(int k_ = 3, V logbase_ = 2)
+    explicit VOI_kl(int k_ = 3, V logbase_ = 2, std::size_t threads_ = 1)
         : k(k_)
         , logbase(logbase_)
+        , threads(threads_)
     {
     }
 
@@ -197,6 +280,20 @@ struct VOI_kl {
     operator()(const Container<Container<El, Allocator_inner>, Allocator_outer>& a,
         const Container<Container<El, Allocator_inner>, Allocator_outer>& b) const;
 
+    /**
+     * @brief calculate the value with trees already built from a and b, so that they can be reused between pairs
+     *
+     * @param a first container
+     * @param b second container
+     * @param tree_a tree built from a
+     * @param tree_b tree built from b
+     * @return value for a and b
+     */
+    template <typename El>
+    typename std::enable_if<!std::is_integral<El>::value, V>::type operator()(const std::vector<std::vector<El>>& a,
+        const std::vector<std::vector<El>>& b, const Tree<std::vector<El>, Euclidian<El>>& tree_a,
+        const Tree<std::vector<El>, Euclidian<El>>& tree_b) const;
+
     // TODO add support of 1D random values passed in simple containers
 };
 
@@ -215,9 +312,10 @@ struct VOI_normalized_kl : VOI_kl<V> {
      *
      * @param k_
      * @param logbase_
+     * @param threads_ number of threads running the neighbour queries, 0 means one per hardware thread
      */
-    explicit VOI_normalized_kl(int k_ = 3, V logbase_ = 2)
-        : VOI_kl<V>(k_, logbase_)
+    explicit VOI_normalized_kl(int k_ = 3, V logbase_ = 2, std::size_t threads_ = 1)
+        : VOI_kl<V>(k_, logbase_, threads_)
     {
     }
 
@@ -233,6 +331,20 @@ struct VOI_normalized_kl : VOI_kl<V> {
     operator()(const Container<Container<El, Allocator_inner>, Allocator_outer>& a,
         const Container<Container<El, Allocator_inner>, Allocator_outer>& b) const;
 
+    /**
+     * @brief calculate the value with trees already built from a and b, so that they can be reused between pairs
+     *
+     * @param a first container
+     * @param b second container
+     * @param tree_a tree built from a
+     * @param tree_b tree built from b
+     * @return value for a and b
+     */
+    template <typename El>
+    typename std::enable_if<!std::is_integral<El>::value, V>::type operator()(const std::vector<std::vector<El>>& a,
+        const std::vector<std::vector<El>>& b, const Tree<std::vector<El>, Euclidian<El>>& tree_a,
+        const Tree<std::vector<El>, Euclidian<El>>& tree_b) const;
+
     // TODO add support of 1D random values passed in simple containers
 };
 
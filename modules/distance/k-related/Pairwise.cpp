@@ -0,0 +1,236 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (c) 2020 Panda Team
+*/
+#ifndef _METRIC_DISTANCE_K_RELATED_PAIRWISE_CPP
+#define _METRIC_DISTANCE_K_RELATED_PAIRWISE_CPP
+
+#include "Pairwise.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+
+namespace metric {
+
+namespace pairwise_details {
+
+    // number of records per side of a block in the generic path, chosen to keep both blocks in L2 cache
+    constexpr std::size_t block_size = 64;
+
+    // pairs with a squared distance below this fraction of their squared norms are measured again from the records,
+    // so that the Gram matrix identity keeps a relative error of about 1024 epsilon
+    constexpr double exact_fraction = 1.0 / 1024;
+
+    // metrics which can be evaluated from the Gram matrix of the records
+    template <typename Metric>
+    struct is_gram_metric : std::false_type {
+    };
+    template <typename V>
+    struct is_gram_metric<Euclidian<V>> : std::true_type {
+    };
+    template <typename V>
+    struct is_gram_metric<Cosine<V>> : std::true_type {
+    };
+
+    // records that can be packed into a dense matrix row
+    template <typename Record, typename = void>
+    struct is_packable : std::false_type {
+    };
+    template <typename Record>
+    struct is_packable<Record, std::void_t<decltype(std::size(std::declval<const Record&>())),
+                                   decltype(*std::begin(std::declval<const Record&>()))>>
+        : std::is_arithmetic<std::decay_t<decltype(*std::begin(std::declval<const Record&>()))>> {
+    };
+
+    // copy a set of equally sized records into the rows of M, returns false if the records differ in size
+    template <typename V, typename Record>
+    bool pack(const std::vector<Record>& records, blaze::DynamicMatrix<V>& M)
+    {
+        const std::size_t dim = records.empty() ? 0 : std::size(records[0]);
+        for (const auto& r : records) {
+            if (std::size(r) != dim) {
+                return false;
+            }
+        }
+        M.resize(records.size(), dim, false);
+        for (std::size_t i = 0; i < records.size(); ++i) {
+            std::size_t j = 0;
+            for (auto it = std::begin(records[i]); it != std::end(records[i]); ++it, ++j) {
+                M(i, j) = *it;
+            }
+        }
+        return true;
+    }
+
+    template <typename V, typename MA, typename MB>
+    blaze::DynamicMatrix<V> from_gram(const Euclidian<V>&, const MA& A, const MB& B)
+    {
+        blaze::DynamicMatrix<V> D = A * blaze::trans(B);
+        const blaze::DynamicVector<V> normA = blaze::sum<blaze::rowwise>(A % A);
+        const blaze::DynamicVector<V> normB = blaze::sum<blaze::rowwise>(B % B);
+        for (std::size_t i = 0; i < D.rows(); ++i) {
+            for (std::size_t j = 0; j < D.columns(); ++j) {
+                const V d2 = normA[i] + normB[j] - 2 * D(i, j);
+                if (d2 > V(exact_fraction) * (normA[i] + normB[j])) {
+                    D(i, j) = std::sqrt(d2);
+                } else {
+                    // near duplicates, where the identity cancels
+                    D(i, j) = std::sqrt(blaze::sqrNorm(blaze::row(A, i) - blaze::row(B, j)));
+                }
+            }
+        }
+        return D;
+    }
+
+    template <typename V, typename MA, typename MB>
+    blaze::DynamicMatrix<V> from_gram(const Cosine<V>&, const MA& A, const MB& B)
+    {
+        blaze::DynamicMatrix<V> D = A * blaze::trans(B);
+        const blaze::DynamicVector<V> normA = blaze::sqrt(blaze::sum<blaze::rowwise>(A % A));
+        const blaze::DynamicVector<V> normB = blaze::sqrt(blaze::sum<blaze::rowwise>(B % B));
+        for (std::size_t i = 0; i < D.rows(); ++i) {
+            for (std::size_t j = 0; j < D.columns(); ++j) {
+                D(i, j) = D(i, j) / (normA[i] * normB[j]);
+            }
+        }
+        return D;
+    }
+
+    template <typename V, typename Q, typename MB>
+    blaze::DynamicVector<V> from_inner_products(const Euclidian<V>&, const Q& q, const MB& B)
+    {
+        blaze::DynamicVector<V> d = B * q;
+        const V normQ = blaze::sqrNorm(q);
+        const blaze::DynamicVector<V> normB = blaze::sum<blaze::rowwise>(B % B);
+        for (std::size_t j = 0; j < d.size(); ++j) {
+            const V d2 = normQ + normB[j] - 2 * d[j];
+            if (d2 > V(exact_fraction) * (normQ + normB[j])) {
+                d[j] = std::sqrt(d2);
+            } else {
+                d[j] = std::sqrt(blaze::sqrNorm(blaze::trans(q) - blaze::row(B, j)));
+            }
+        }
+        return d;
+    }
+
+    template <typename V, typename Q, typename MB>
+    blaze::DynamicVector<V> from_inner_products(const Cosine<V>&, const Q& q, const MB& B)
+    {
+        blaze::DynamicVector<V> d = B * q;
+        const V normQ = std::sqrt(blaze::sqrNorm(q));
+        const blaze::DynamicVector<V> normB = blaze::sqrt(blaze::sum<blaze::rowwise>(B % B));
+        for (std::size_t j = 0; j < d.size(); ++j) {
+            d[j] = d[j] / (normQ * normB[j]);
+        }
+        return d;
+    }
+
+    // generic path: every pair is passed to the metric, the iteration is tiled to reuse records from cache
+    template <typename D, typename Metric, typename GetA, typename GetB>
+    blaze::DynamicMatrix<D> blocked(
+        const Metric& metric, std::size_t rows, std::size_t cols, const GetA& getA, const GetB& getB)
+    {
+        blaze::DynamicMatrix<D> result(rows, cols);
+        for (std::size_t ib = 0; ib < rows; ib += block_size) {
+            const std::size_t ie = std::min(ib + block_size, rows);
+            for (std::size_t jb = 0; jb < cols; jb += block_size) {
+                const std::size_t je = std::min(jb + block_size, cols);
+                for (std::size_t i = ib; i < ie; ++i) {
+                    for (std::size_t j = jb; j < je; ++j) {
+                        result(i, j) = metric(getA(i), getB(j));
+                    }
+                }
+            }
+        }
+        return result;
+    }
+
+}  // namespace pairwise_details
+
+template <typename Metric, typename T, bool SO>
+auto pairwise(const Metric& metric, const blaze::DynamicMatrix<T, SO>& A, const blaze::DynamicMatrix<T, SO>& B)
+    -> blaze::DynamicMatrix<pairwise_details::distance_t<Metric, pairwise_details::row_t<T, SO>>>
+{
+    using D = pairwise_details::distance_t<Metric, pairwise_details::row_t<T, SO>>;
+    if constexpr (pairwise_details::is_gram_metric<Metric>::value) {
+        if constexpr (std::is_same<T, D>::value) {
+            return pairwise_details::from_gram(metric, A, B);
+        } else {
+            const blaze::DynamicMatrix<D> Ad(A);
+            const blaze::DynamicMatrix<D> Bd(B);
+            return pairwise_details::from_gram(metric, Ad, Bd);
+        }
+    } else {
+        return pairwise_details::blocked<D>(
+            metric, A.rows(), B.rows(), [&A](std::size_t i) { return blaze::row(A, i); },
+            [&B](std::size_t j) { return blaze::row(B, j); });
+    }
+}
+
+template <typename Metric, typename Record>
+auto pairwise(const Metric& metric, const std::vector<Record>& A, const std::vector<Record>& B)
+    -> blaze::DynamicMatrix<pairwise_details::distance_t<Metric, Record>>
+{
+    using D = pairwise_details::distance_t<Metric, Record>;
+    if constexpr (pairwise_details::is_gram_metric<Metric>::value && pairwise_details::is_packable<Record>::value) {
+        blaze::DynamicMatrix<D> Ad, Bd;
+        if (pairwise_details::pack(A, Ad) && pairwise_details::pack(B, Bd) && Ad.columns() == Bd.columns()) {
+            return pairwise_details::from_gram(metric, Ad, Bd);
+        }
+    }
+    return pairwise_details::blocked<D>(
+        metric, A.size(), B.size(), [&A](std::size_t i) -> const Record& { return A[i]; },
+        [&B](std::size_t j) -> const Record& { return B[j]; });
+}
+
+template <typename Metric, typename T, bool SO, bool TF>
+auto one_to_many(const Metric& metric, const blaze::DynamicVector<T, TF>& q, const blaze::DynamicMatrix<T, SO>& B)
+    -> blaze::DynamicVector<pairwise_details::distance_t<Metric, pairwise_details::row_t<T, SO>>>
+{
+    using D = pairwise_details::distance_t<Metric, pairwise_details::row_t<T, SO>>;
+    if constexpr (pairwise_details::is_gram_metric<Metric>::value) {
+        blaze::DynamicVector<D, blaze::columnVector> qd(q.size());
+        for (std::size_t j = 0; j < q.size(); ++j) {
+            qd[j] = q[j];
+        }
+        if constexpr (std::is_same<T, D>::value) {
+            return pairwise_details::from_inner_products(metric, qd, B);
+        } else {
+            const blaze::DynamicMatrix<D> Bd(B);
+            return pairwise_details::from_inner_products(metric, qd, Bd);
+        }
+    } else {
+        // the query is stored as a one row matrix, so that it has the same type as the rows of B
+        blaze::DynamicMatrix<T, SO> Q(1, q.size());
+        for (std::size_t j = 0; j < q.size(); ++j) {
+            Q(0, j) = q[j];
+        }
+        const auto& Qc = Q;
+        const auto qrow = blaze::row(Qc, 0);
+        blaze::DynamicVector<D> result(B.rows());
+        for (std::size_t j = 0; j < B.rows(); ++j) {
+            result[j] = metric(qrow, blaze::row(B, j));
+        }
+        return result;
+    }
+}
+
+template <typename Metric, typename Record>
+auto one_to_many(const Metric& metric, const Record& q, const std::vector<Record>& B)
+    -> blaze::DynamicVector<pairwise_details::distance_t<Metric, Record>>
+{
+    // packing B costs as much as a direct evaluation, so records are always passed to the metric directly
+    blaze::DynamicVector<pairwise_details::distance_t<Metric, Record>> result(B.size());
+    for (std::size_t j = 0; j < B.size(); ++j) {
+        result[j] = metric(q, B[j]);
+    }
+    return result;
+}
+
+}  // namespace metric
+
+#endif
@@ -0,0 +1,85 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (c) 2020 Panda Team
+*/
+#ifndef _METRIC_DISTANCE_K_RELATED_PAIRWISE_HPP
+#define _METRIC_DISTANCE_K_RELATED_PAIRWISE_HPP
+
+#include "../../../3rdparty/blaze/Math.h"
+#include "Standards.hpp"
+
+#include <type_traits>
+#include <vector>
+
+namespace metric {
+
+namespace pairwise_details {
+    template <typename Metric, typename Record>
+    using distance_t = typename std::invoke_result<Metric, const Record&, const Record&>::type;
+
+    template <typename T, bool SO>
+    using row_t = decltype(blaze::row(std::declval<const blaze::DynamicMatrix<T, SO>&>(), 0));
+}  // namespace pairwise_details
+
+/**
+ * @brief Calculate all distances between the rows of A and the rows of B
+ *
+ * @details For Euclidian and Cosine the block is computed from the Gram matrix A * trans(B) (BLAS GEMM when blaze is
+ * configured with BLAS) using the identity |a-b|^2 = |a|^2 + |b|^2 - 2ab; every other metric is evaluated pair by
+ * pair in cache sized blocks. The Gram matrix identity cancels for almost identical records, so pairs whose squared
+ * distance is below 1/1024 of their squared norms are measured again from the records; the other distances have a
+ * relative error of about 1024 epsilon.
+ *
+ * @param metric metric object
+ * @param A matrix with one record per row
+ * @param B matrix with one record per row
+ * @return A.rows() x B.rows() matrix of distances
+ */
+template <typename Metric, typename T, bool SO>
+auto pairwise(const Metric& metric, const blaze::DynamicMatrix<T, SO>& A, const blaze::DynamicMatrix<T, SO>& B)
+    -> blaze::DynamicMatrix<pairwise_details::distance_t<Metric, pairwise_details::row_t<T, SO>>>;
+
+/**
+ * @brief Calculate all distances between the records of A and the records of B
+ *
+ * @param metric metric object
+ * @param A vector of records
+ * @param B vector of records
+ * @return A.size() x B.size() matrix of distances
+ */
+template <typename Metric, typename Record>
+auto pairwise(const Metric& metric, const std::vector<Record>& A, const std::vector<Record>& B)
+    -> blaze::DynamicMatrix<pairwise_details::distance_t<Metric, Record>>;
+
+/**
+ * @brief Calculate distances between the query record q and all rows of B
+ *
+ * @param metric metric object
+ * @param q query record
+ * @param B matrix with one record per row
+ * @return vector of B.rows() distances
+ */
+template <typename Metric, typename T, bool SO, bool TF>
+auto one_to_many(const Metric& metric, const blaze::DynamicVector<T, TF>& q, const blaze::DynamicMatrix<T, SO>& B)
+    -> blaze::DynamicVector<pairwise_details::distance_t<Metric, pairwise_details::row_t<T, SO>>>;
+
+/**
+ * @brief Calculate distances between the query record q and all records of B
+ *
+ * @param metric metric object
+ * @param q query record
+ * @param B vector of records
+ * @return vector of B.size() distances
+ */
+template <typename Metric, typename Record>
+auto one_to_many(const Metric& metric, const Record& q, const std::vector<Record>& B)
+    -> blaze::DynamicVector<pairwise_details::distance_t<Metric, Record>>;
+
+}  // namespace metric
+
+#include "Pairwise.cpp"
+
+#endif  // Header Guard
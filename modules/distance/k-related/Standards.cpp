@@ -10,10 +10,130 @@ Copyright (c) 2018 Michael Welsch
 
 #include "Standards.hpp"
 
+#include <algorithm>
 #include <cmath>
 
 namespace metric {
 
+namespace standards_details {
+
+    // number of elements of containers whose size is part of the type, 0 for the others
+    template <typename Container>
+    struct fixed_size : std::integral_constant<std::size_t, 0> {
+    };
+
+    template <typename T, std::size_t N>
+    struct fixed_size<std::array<T, N>> : std::integral_constant<std::size_t, N> {
+    };
+
+    // fixed sizes up to this length are unrolled completely, longer ones are left to the compiler
+    constexpr std::size_t unroll_limit = 64;
+
+    template <typename Container, typename Op, std::size_t... I>
+    void for_each_pair(const Container& a, const Container& b, const Op& op, std::index_sequence<I...>)
+    {
+        (op(a[I], b[I]), ...);
+    }
+
+    /**
+     * @brief call op(a[i], b[i]) for every index of a fixed size container, in order
+     */
+    template <typename Container, typename Op>
+    void for_each_pair(const Container& a, const Container& b, const Op& op)
+    {
+        constexpr std::size_t N = fixed_size<Container>::value;
+        if constexpr (N <= unroll_limit) {
+            for_each_pair(a, b, op, std::make_index_sequence<N>());
+        } else {
+            for (std::size_t i = 0; i < N; ++i) {
+                op(a[i], b[i]);
+            }
+        }
+    }
+
+    /**
+     * @brief call op(x, y) for the values of a and b at every index where a or b is nonzero, in index order
+     *
+     * @details Both vectors are blaze sparse vectors, or one is sparse and the other dense; then every element of
+     * the dense one is visited.
+     */
+    template <typename A, typename B, typename Op>
+    void for_each_nonzero_pair(const A& a, const B& b, const Op& op)
+    {
+        if constexpr (blaze::IsSparseVector_v<A> && blaze::IsSparseVector_v<B>) {
+            using T = typename A::ElementType;
+            using U = typename B::ElementType;
+            auto ia = a.begin();
+            auto ib = b.begin();
+            while (ia != a.end() && ib != b.end()) {
+                if (ia->index() < ib->index()) {
+                    op(ia->value(), U(0));
+                    ++ia;
+                } else if (ib->index() < ia->index()) {
+                    op(T(0), ib->value());
+                    ++ib;
+                } else {
+                    op(ia->value(), ib->value());
+                    ++ia;
+                    ++ib;
+                }
+            }
+            for (; ia != a.end(); ++ia) {
+                op(ia->value(), U(0));
+            }
+            for (; ib != b.end(); ++ib) {
+                op(T(0), ib->value());
+            }
+        } else if constexpr (blaze::IsSparseVector_v<A>) {
+            using T = typename A::ElementType;
+            auto ia = a.begin();
+            for (std::size_t i = 0; i < b.size(); ++i) {
+                if (ia != a.end() && ia->index() == i) {
+                    op(ia->value(), b[i]);
+                    ++ia;
+                } else {
+                    op(T(0), b[i]);
+                }
+            }
+        } else {
+            for_each_nonzero_pair(b, a, [&op](auto y, auto x) { op(x, y); });
+        }
+    }
+
+    // call op for the entries of two dense records in order; when their lengths differ, the missing entries of the
+    // shorter record are 0 as in for_each_nonzero_pair
+    template <typename Container, typename Op>
+    void for_each_dense_pair(const Container& a, const Container& b, const Op& op)
+    {
+        auto it1 = a.begin();
+        auto it2 = b.begin();
+        for (; it1 != a.end() && it2 != b.end(); ++it1, ++it2) {
+            op(*it1, *it2);
+        }
+        for (; it1 != a.end(); ++it1) {
+            op(*it1, std::decay_t<decltype(*it1)>(0));
+        }
+        for (; it2 != b.end(); ++it2) {
+            op(std::decay_t<decltype(*it2)>(0), *it2);
+        }
+    }
+
+    // x^P for a positive integer P by repeated squaring
+    template <int P, typename T>
+    T integer_power(T x)
+    {
+        if constexpr (P == 1) {
+            return x;
+        } else if constexpr (P % 2 == 0) {
+            const T half = integer_power<P / 2>(x);
+            return half * half;
+        } else {
+            return x * integer_power<P - 1>(x);
+        }
+    }
+
+}  // namespace standards_details
+
 template <typename V>
 template <typename Container>
 auto Euclidian<V>::operator()(const Container& a, const Container& b) const ->
@@ -21,12 +141,51 @@ auto Euclidian<V>::operator()(const Container& a, const Container& b) const ->
 {
     static_assert(std::is_floating_point<value_type>::value, "T must be a float type");
     distance_type sum = 0;
-    for (auto it1 = a.begin(), it2 = b.begin(); it1 != a.end() && it2 != b.end(); ++it1, ++it2) {
-        sum += (*it1 - *it2) * (*it1 - *it2);
+    auto add = [&sum](auto x, auto y) { sum += (x - y) * (x - y); };
+    if constexpr (standards_details::fixed_size<Container>::value > 0) {
+        standards_details::for_each_pair(a, b, add);
+    } else if constexpr (blaze::IsSparseVector_v<Container>) {
+        standards_details::for_each_nonzero_pair(a, b, add);
+    } else {
+        for (auto it1 = a.begin(), it2 = b.begin(); it1 != a.end() && it2 != b.end(); ++it1, ++it2) {
+            sum += (*it1 - *it2) * (*it1 - *it2);
+        }
     }
     return std::sqrt(sum);
 }
 
+template <typename V>
+template <typename Container>
+auto Euclidian<V>::operator()(const Container& a, const Container& b, distance_type upper_bound) const ->
+    typename std::enable_if<!std::is_same<Container, V>::value, distance_type>::type
+{
+    static_assert(std::is_floating_point<value_type>::value, "T must be a float type");
+    if constexpr (blaze::IsSparseVector_v<Container>) {
+        return (*this)(a, b);
+    } else {
+        const distance_type bound = upper_bound * upper_bound;
+        distance_type sum = 0;
+        for (auto it1 = a.begin(), it2 = b.begin(); it1 != a.end() && it2 != b.end(); ++it1, ++it2) {
+            sum += (*it1 - *it2) * (*it1 - *it2);
+            if (sum > bound) {
+                break;
+            }
+        }
+        return std::sqrt(sum);
+    }
+}
+
+template <typename V>
+template <typename A, typename B>
+auto Euclidian<V>::operator()(const A& a, const B& b) const ->
+    typename std::enable_if<blaze::IsSparseVector_v<A> != blaze::IsSparseVector_v<B>, distance_type>::type
+{
+    static_assert(std::is_floating_point<value_type>::value, "T must be a float type");
+    distance_type sum = 0;
+    standards_details::for_each_nonzero_pair(a, b, [&sum](auto x, auto y) { sum += (x - y) * (x - y); });
+    return std::sqrt(sum);
+}
+
 template <typename V>
 auto Euclidian<V>::operator()(const V& a, const V& b) const -> distance_type
 {
@@ -42,9 +201,7 @@ auto Euclidian_thresholded<V>::operator()(const Container& a, const Container& b
 {
     static_assert(std::is_floating_point<value_type>::value, "T must be a float type");
     distance_type sum = 0;
-    for (auto it1 = a.begin(), it2 = b.begin(); it1 != a.end() || it2 != b.end(); ++it1, ++it2) {
-        sum += (*it1 - *it2) * (*it1 - *it2);
-    }
+    standards_details::for_each_dense_pair(a, b, [&sum](auto x, auto y) { sum += (x - y) * (x - y); });
     return std::min(thres, value_type(factor * sqrt(sum)));
 }
 
@@ -54,22 +211,87 @@ auto Manhatten<V>::operator()(const Container& a, const Container& b) const -> d
 {
     static_assert(std::is_floating_point<value_type>::value, "T must be a float type");
     distance_type sum = 0;
-    for (auto it1 = a.begin(), it2 = b.begin(); it1 != a.end() || it2 != b.end(); ++it1, ++it2) {
-        sum += std::abs(*it1 - *it2);
+    auto add = [&sum](auto x, auto y) { sum += std::abs(x - y); };
+    if constexpr (standards_details::fixed_size<Container>::value > 0) {
+        standards_details::for_each_pair(a, b, add);
+    } else if constexpr (blaze::IsSparseVector_v<Container>) {
+        standards_details::for_each_nonzero_pair(a, b, add);
+    } else {
+        standards_details::for_each_dense_pair(a, b, add);
     }
     return sum;
 }
 
 template <typename V>
 template <typename Container>
-auto P_norm<V>::operator()(const Container& a, const Container& b) const -> distance_type
+auto Manhatten<V>::operator()(const Container& a, const Container& b, distance_type upper_bound) const
+    -> distance_type
+{
+    static_assert(std::is_floating_point<value_type>::value, "T must be a float type");
+    if constexpr (blaze::IsSparseVector_v<Container>) {
+        return (*this)(a, b);
+    } else {
+        distance_type sum = 0;
+        auto it1 = a.begin();
+        auto it2 = b.begin();
+        for (; it1 != a.end() && it2 != b.end() && sum <= upper_bound; ++it1, ++it2) {
+            sum += std::abs(*it1 - *it2);
+        }
+        // the missing entries of the shorter record are 0
+        for (; it1 != a.end() && sum <= upper_bound; ++it1) {
+            sum += std::abs(*it1);
+        }
+        for (; it2 != b.end() && sum <= upper_bound; ++it2) {
+            sum += std::abs(*it2);
+        }
+        return sum;
+    }
+}
+
+template <typename V>
+template <typename A, typename B>
+auto Manhatten<V>::operator()(const A& a, const B& b) const ->
+    typename std::enable_if<blaze::IsSparseVector_v<A> != blaze::IsSparseVector_v<B>, distance_type>::type
+{
+    static_assert(std::is_floating_point<value_type>::value, "T must be a float type");
+    distance_type sum = 0;
+    standards_details::for_each_nonzero_pair(a, b, [&sum](auto x, auto y) { sum += std::abs(x - y); });
+    return sum;
+}
+
+template <typename V, int P>
+template <typename Container>
+auto P_norm<V, P>::operator()(const Container& a, const Container& b) const -> distance_type
 {
     static_assert(std::is_floating_point<value_type>::value, "T must be a float type");
     distance_type sum = 0;
-    for (auto it1 = a.begin(), it2 = b.begin(); it1 != a.end() || it2 != b.end(); ++it1, ++it2) {
-        sum += std::pow(std::abs(*it1 - *it2), p);
+    auto add = [this, &sum](auto x, auto y) {
+        const distance_type difference = std::abs(x - y);
+        if constexpr (P == P_norm_runtime) {
+            sum += std::pow(difference, p);
+        } else if constexpr (P == P_norm_infinity) {
+            sum = std::max(sum, difference);
+        } else {
+            sum += standards_details::integer_power<P>(difference);
+        }
+    };
+    if constexpr (standards_details::fixed_size<Container>::value > 0) {
+        standards_details::for_each_pair(a, b, add);
+    } else {
+        standards_details::for_each_dense_pair(a, b, add);
+    }
+
+    if constexpr (P == P_norm_runtime) {
+        return std::pow(sum, 1 / p);
+    } else if constexpr (P == P_norm_infinity || P == 1) {
+        return sum;
+    } else if constexpr (P == 2) {
+        return std::sqrt(sum);
+    } else if constexpr (P == 3) {
+        return std::cbrt(sum);
+    } else {
+        return std::pow(sum, distance_type(1) / P);
     }
-    return std::pow(sum, 1 / p);
 }
 
 template <typename V>
@@ -77,23 +299,51 @@ template <typename Container>
 auto Cosine<V>::operator()(const Container& A, const Container& B) const -> distance_type
 {
     value_type dot = 0, denom_a = 0, denom_b = 0;
-    for (auto it1 = A.begin(), it2 = B.begin(); it1 != A.end() || it2 != B.end(); ++it1, ++it2) {
-        dot += *it1 * *it2;
-        denom_a += *it1 * *it1;
-        denom_b += *it2 * *it2;
+    auto add = [&](auto a, auto b) {
+        dot += a * b;
+        denom_a += a * a;
+        denom_b += b * b;
+    };
+    if constexpr (standards_details::fixed_size<Container>::value > 0) {
+        standards_details::for_each_pair(A, B, add);
+    } else if constexpr (blaze::IsSparseVector_v<Container>) {
+        standards_details::for_each_nonzero_pair(A, B, add);
+    } else {
+        standards_details::for_each_dense_pair(A, B, add);
     }
     return dot / (std::sqrt(denom_a) * std::sqrt(denom_b));
 }
 
+template <typename V>
+template <typename A, typename B>
+auto Cosine<V>::operator()(const A& a, const B& b) const ->
+    typename std::enable_if<blaze::IsSparseVector_v<A> != blaze::IsSparseVector_v<B>, distance_type>::type
+{
+    value_type dot = 0, denom_a = 0, denom_b = 0;
+    standards_details::for_each_nonzero_pair(a, b, [&](auto x, auto y) {
+        dot += x * y;
+        denom_a += x * x;
+        denom_b += y * y;
+    });
+    return dot / (std::sqrt(denom_a) * std::sqrt(denom_b));
+}
+
 template <typename V>
 template <typename Container>
 V Chebyshev<V>::operator()(const Container& lhs, const Container& rhs) const
 {
     distance_type res = 0;
-    for (std::size_t i = 0; i < lhs.size(); i++) {
-        auto m = std::abs(lhs[i] - rhs[i]);
+    auto update = [&res](auto l, auto r) {
+        auto m = std::abs(l - r);
         if (m > res)
             res = m;
+    };
+    if constexpr (standards_details::fixed_size<Container>::value > 0) {
+        standards_details::for_each_pair(lhs, rhs, update);
+    } else {
+        for (std::size_t i = 0; i < lhs.size(); i++) {
+            update(lhs[i], rhs[i]);
+        }
     }
     return res;
 }
@@ -8,12 +8,33 @@ Copyright (c) 2018 Michael Welsch
 #ifndef _METRIC_DISTANCE_K_RELATED_STANDARDS_HPP
 #define _METRIC_DISTANCE_K_RELATED_STANDARDS_HPP
 
+#include "../../../3rdparty/blaze/math/typetraits/IsSparseVector.h"
+
+#include <array>
+#include <cstddef>
+#include <limits>
+#include <type_traits>
+#include <utility>
+
 namespace metric {
 
+/**
+ * @brief Exponent of P_norm given at run time, through the constructor
+ */
+constexpr int P_norm_runtime = 0;
+
+/**
+ * @brief Exponent of P_norm for the maximum norm, p = infinity
+ */
+constexpr int P_norm_infinity = -1;
+
 /**
  * @class Euclidian
  * 
  * @brief Euclidian (L2) Metric
+ *
+ * @details Records whose size is part of the type (std::array) get unrolled kernels, blaze sparse vectors are
+ * compared by merging their nonzero index lists, as in Manhatten and Cosine.
  */
 template <typename V = double>
 struct Euclidian {
@@ -33,6 +54,30 @@ struct Euclidian {
     typename std::enable_if<!std::is_same<Container, V>::value, distance_type>::type operator()(
         const Container& a, const Container& b) const;
 
+    /**
+     * @brief Calculate Euclidian distance in R^n, abandoning as soon as it exceeds upper_bound
+     *
+     * @param a first vector
+     * @param b second vector
+     * @param upper_bound largest distance of interest
+     * @return euclidian distance between a and b if it does not exceed upper_bound, otherwise some value not
+     * smaller than upper_bound
+     */
+    template <typename Container>
+    typename std::enable_if<!std::is_same<Container, V>::value, distance_type>::type operator()(
+        const Container& a, const Container& b, distance_type upper_bound) const;
+
+    /**
+     * @brief Calculate Euclidian distance between a sparse and a dense vector
+     *
+     * @param a first vector, blaze sparse or dense
+     * @param b second vector, dense if a is sparse and sparse otherwise
+     * @return euclidian distance between a and b
+     */
+    template <typename A, typename B>
+    typename std::enable_if<blaze::IsSparseVector_v<A> != blaze::IsSparseVector_v<B>, distance_type>::type
+    operator()(const A& a, const B& b) const;
+
     /**
      * @brief Calculate Euclidian distance in R
      *
@@ -67,6 +112,29 @@ struct Manhatten {
 
     template <typename Container>
     distance_type operator()(const Container& a, const Container& b) const;
+
+    /**
+     * @brief Calculate Manhatten distance in R^n, abandoning as soon as it exceeds upper_bound
+     *
+     * @param a first vector
+     * @param b second vector
+     * @param upper_bound largest distance of interest
+     * @return Manhatten distance between a and b if it does not exceed upper_bound, otherwise some value not
+     * smaller than upper_bound
+     */
+    template <typename Container>
+    distance_type operator()(const Container& a, const Container& b, distance_type upper_bound) const;
+
+    /**
+     * @brief Calculate Manhatten distance between a sparse and a dense vector
+     *
+     * @param a first vector, blaze sparse or dense
+     * @param b second vector, dense if a is sparse and sparse otherwise
+     * @return Manhatten distance between a and b
+     */
+    template <typename A, typename B>
+    typename std::enable_if<blaze::IsSparseVector_v<A> != blaze::IsSparseVector_v<B>, distance_type>::type
+    operator()(const A& a, const B& b) const;
 };
 
 /**
@@ -74,9 +142,14 @@ struct Manhatten {
  * 
  * @brief Minkowski (L general) Metric
  *
+ * @details With P = P_norm_runtime the exponent is given to the constructor. A positive P fixes an integer exponent
+ * at compile time: the powers are products, p = 1, 2 and 3 end with no root, a square root and a cube root, and
+ * P_norm_infinity is the maximum norm. For a compile time exponent p holds the exponent and is not meant to be set.
  */
-template <typename V = double>
+template <typename V = double, int P = P_norm_runtime>
 struct P_norm {
+    static_assert(P >= P_norm_infinity, "P must be P_norm_runtime, P_norm_infinity or a positive exponent");
+
     using value_type = V;
     using distance_type = value_type;
 
@@ -86,7 +159,7 @@ struct P_norm {
      *
      * @param p_
      */
-    explicit P_norm(const value_type& p_ = 1)
+    explicit P_norm(const value_type& p_ = default_p())
         : p(p_)
     {
     }
@@ -101,7 +174,19 @@ struct P_norm {
     template <typename Container>
     distance_type operator()(const Container& a, const Container& b) const;
 
-    value_type p = 1;
+    value_type p = default_p();
+
+private:
+    static constexpr value_type default_p()
+    {
+        if constexpr (P == P_norm_infinity) {
+            return std::numeric_limits<value_type>::infinity();
+        } else if constexpr (P == P_norm_runtime) {
+            return 1;
+        } else {
+            return P;
+        }
+    }
 };
 
 /**
@@ -148,6 +233,8 @@ struct Euclidian_thresholded {
  *
  * @brief Cosine similarity
  *
+ * @details For blaze sparse vectors the dot product and both norms are accumulated in one merge of the nonzero
+ * index lists, so the cost grows with the number of nonzeros rather than with the dimension.
  */
 
 template <typename V = double>
@@ -164,6 +251,17 @@ struct Cosine {
      */
     template <typename Container>
     distance_type operator()(const Container& a, const Container& b) const;
+
+    /**
+     * @brief calculate cosine similariy between a sparse and a dense vector
+     *
+     * @param a first vector, blaze sparse or dense
+     * @param b second vector, dense if a is sparse and sparse otherwise
+     * @return cosine similarity between a and b
+     */
+    template <typename A, typename B>
+    typename std::enable_if<blaze::IsSparseVector_v<A> != blaze::IsSparseVector_v<B>, distance_type>::type
+    operator()(const A& a, const B& b) const;
 };
 
 /**
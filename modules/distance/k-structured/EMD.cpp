@@ -8,6 +8,7 @@ Copyright (c) 2018 Michael Welsch
 #ifndef _METRIC_DISTANCE_K_STRUCTURED_EMD_CPP
 #define _METRIC_DISTANCE_K_STRUCTURED_EMD_CPP
 #include "EMD.hpp"
+#include "../../utils/parallel.hpp"
 
 /*Fast and Robust Earth Mover's Distances
   Ofir Pele, Michael Werman
@@ -20,10 +21,16 @@ Copyright (c) 2018 Michael Welsch
 #include <set>
 // #include <limits>
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <iostream>
+#include <cstdint>
 #include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <numeric>
+#include <stdexcept>
 #include <type_traits>
 #include <utility>
 #include <vector>
@@ -641,6 +648,270 @@ namespace EMD_details {
         }
     }
 
+    /// square cost matrix in contiguous row major storage
+    template <typename T>
+    struct cost_matrix {
+        cost_matrix() = default;
+
+        explicit cost_matrix(const std::vector<std::vector<T>>& C)
+            : N(C.size())
+            , data(N * N)
+        {
+            for (size_t i = 0; i < N; ++i) {
+                assert(C[i].size() == N);  // non-square matrices are not supported by the solver
+                std::copy(C[i].begin(), C[i].end(), data.begin() + i * N);
+            }
+        }
+
+        size_t size() const { return N; }
+
+        T operator()(size_t i, size_t j) const { return data[i * N + j]; }
+
+        size_t N = 0;
+        std::vector<T> data;
+    };
+
+    /// integer costs used by the solver for floating point cost matrices, 32 bits hold costs up to MULT_FACTOR
+    struct quantized_costs {
+        cost_matrix<std::int32_t> C;
+        double maxC = 0;
+        double normFactor = 1;
+    };
+
+    template <typename T>
+    quantized_costs quantize_costs(const cost_matrix<T>& C, double MULT_FACTOR)
+    {
+        const size_t N = C.size();
+        quantized_costs result;
+        result.maxC = N > 0 ? C(0, 0) : 0;
+        for (size_t i = 0; i < N; ++i) {
+            for (size_t j = 0; j < N; ++j) {
+                if (C(i, j) > result.maxC)
+                    result.maxC = C(i, j);
+            }
+        }
+        result.normFactor = MULT_FACTOR / result.maxC;
+        result.C.N = N;
+        result.C.data.resize(N * N);
+        for (size_t k = 0; k < N * N; ++k) {
+            result.C.data[k] = static_cast<std::int32_t>(floor(C.data[k] * result.normFactor + 0.5));
+        }
+        return result;
+    }
+
+    /**
+     * @brief immutable ground distance matrix together with the structure detected in it at construction
+     *
+     * @details uniform: zero diagonal and one cost t between all distinct bins, e.g. the grids of
+     * ground_distance_matrix_of_2dgrid with the default thresholded metric. EMD then has the closed form
+     * t * min(mass left after the 0-cost pre-flow) + extra mass penalty.
+     * line: C[i][j] = |x_i - x_j| for nondecreasing bin positions x_i, i.e. 1-D histograms. For equal total masses
+     * EMD is the sum of |cumsum(P - Q)_k| * (x_{k+1} - x_k).
+     * general: everything else goes to the min-cost-flow solver. Integral costs are kept as they are, floating point
+     * costs only in the 32 bit integer form the solver works with.
+     */
+    template <typename T>
+    struct ground_matrix {
+        enum class structure { general, uniform, line };
+
+        // must hold: 2^(sizeof(long long) * 8) >= MULT_FACTOR^2
+        static constexpr double MULT_FACTOR = 1000000;
+
+        explicit ground_matrix(const std::vector<std::vector<T>>& C)
+            : N(C.size())
+        {
+            // the solver and the structure detection below read C as N x N
+            for (const auto& row : C) {
+                if (row.size() != N) {
+                    throw std::invalid_argument("EMD: the ground distance matrix must be square");
+                }
+            }
+            for (size_t i = 0; i < N; ++i) {
+                for (size_t j = 0; j < N; ++j) {
+                    if (C[i][j] > maxC)
+                        maxC = C[i][j];
+                }
+            }
+            if constexpr (std::is_floating_point<T>::value) {
+                quantized = quantize_costs(cost_matrix<T>(C), MULT_FACTOR);
+            } else {
+                costs = cost_matrix<T>(C);
+            }
+            if (N < 2) {
+                return;
+            }
+
+            bool zero_diagonal = true;
+            bool uniform = true;
+            bool line = true;
+            const T t = C[0][1];
+            // positions are read from the first row, rounding of the caller may differ by a few ulps
+            const T tolerance = std::is_floating_point<T>::value ? T(maxC * 1e-9) : T(0);
+            positions.assign(C[0].begin(), C[0].end());
+            for (size_t i = 0; i < N && zero_diagonal; ++i) {
+                if (i > 0 && positions[i] < positions[i - 1]) {
+                    line = false;
+                }
+                for (size_t j = 0; j < N; ++j) {
+                    if (i == j) {
+                        zero_diagonal = C[i][j] == 0;
+                        continue;
+                    }
+                    uniform = uniform && C[i][j] == t;
+                    const T d = positions[i] > positions[j] ? positions[i] - positions[j] : positions[j] - positions[i];
+                    line = line && (C[i][j] > d ? C[i][j] - d : d - C[i][j]) <= tolerance;
+                }
+            }
+            if (zero_diagonal && uniform) {
+                kind = structure::uniform;
+                uniform_cost = t;
+            } else if (zero_diagonal && line) {
+                kind = structure::line;
+            }
+            if (kind != structure::line) {
+                positions.clear();
+            }
+        }
+
+        size_t N;
+        T maxC = 0;
+        structure kind = structure::general;
+        T uniform_cost = 0;
+        std::vector<T> positions;  // bin coordinates of a line matrix
+        cost_matrix<T> costs;  // integral T only
+        quantized_costs quantized;  // floating point T only
+    };
+
+    /// closed form EMD for a uniform ground matrix
+    template <typename T, typename Container>
+    T uniform_emd(const ground_matrix<T>& ground, const Container& P, const Container& Q, T extra_mass_penalty)
+    {
+        // mass that is left at a bin after the 0-cost pre-flow has to travel at cost t
+        T sum_P = 0;
+        T sum_Q = 0;
+        for (size_t i = 0; i < ground.N; ++i) {
+            if (P[i] < Q[i]) {
+                sum_Q += Q[i] - P[i];
+            } else {
+                sum_P += P[i] - Q[i];
+            }
+        }
+        if (extra_mass_penalty == -1)
+            extra_mass_penalty = ground.maxC;
+        const T abs_diff_sum_P_sum_Q = sum_P > sum_Q ? sum_P - sum_Q : sum_Q - sum_P;
+        return ground.uniform_cost * std::min(sum_P, sum_Q) + abs_diff_sum_P_sum_Q * extra_mass_penalty;
+    }
+
+    /// true if both histograms carry the same mass, so that the line closed form applies
+    template <typename T, typename Container>
+    bool equal_mass(const Container& P, const Container& Q, size_t N)
+    {
+        T sum_P = 0;
+        T sum_Q = 0;
+        for (size_t i = 0; i < N; ++i) {
+            sum_P += P[i];
+            sum_Q += Q[i];
+        }
+        if constexpr (std::is_floating_point<T>::value) {
+            return std::abs(sum_P - sum_Q) <= T(1e-12) * std::max(std::abs(sum_P), std::abs(sum_Q));
+        } else {
+            return sum_P == sum_Q;
+        }
+    }
+
+    /// closed form EMD for a line ground matrix and histograms of equal mass
+    template <typename T, typename Container>
+    T line_emd(const ground_matrix<T>& ground, const Container& P, const Container& Q)
+    {
+        const auto& x = ground.positions;
+        T cum = 0;
+        T dist = 0;
+        for (size_t k = 0; k + 1 < x.size(); ++k) {
+            cum += P[k];
+            cum -= Q[k];
+            dist += (cum < 0 ? -cum : cum) * (x[k + 1] - x[k]);
+        }
+        return dist;
+    }
+
+    /// default ground distance |i - j|, saturated at half of the largest possible distance
+    template <typename T>
+    std::vector<std::vector<T>> default_ground_matrix(std::size_t rows, std::size_t cols)
+    {
+        std::vector<std::vector<T>> matrix(rows, std::vector<T>(cols, 0));
+        if (rows == 1 && cols == 1) {
+            matrix[0][0] = 1;
+            return matrix;
+        }
+        int t = std::min(rows, cols) / 2;  // by default, ground distance saturates at the half of maximum distance possible
+
+        for (size_t i = 0; i < rows; i++) {
+            for (size_t j = 0; j < cols; j++) {
+                matrix[i][j] = std::min(t,
+                    std::abs((int)(i - j)));  // non-square matrix is supported here, BUT IS NOT SUPPORTED IN THE EMD IMPL
+            }
+        }
+        return matrix;
+    }
+
+    /// shared default ground matrices of EMD objects constructed without a cost matrix, one per histogram size.
+    /// A matrix lives as long as an EMD or batch holds it, or while its size is among the last few sizes asked for,
+    /// so the cache holds at most that many matrices beyond those in use.
+    template <typename T>
+    std::shared_ptr<const ground_matrix<T>> default_ground(std::size_t N)
+    {
+        constexpr std::size_t recent_sizes = 4;
+
+        static std::mutex mutex;
+        static std::map<std::size_t, std::weak_ptr<const ground_matrix<T>>> matrices;
+        static std::list<std::shared_ptr<const ground_matrix<T>>> recent;
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto matrix = matrices[N].lock();
+        if (!matrix) {
+            matrix = std::make_shared<const ground_matrix<T>>(default_ground_matrix<T>(N, N));
+            matrices[N] = matrix;
+        }
+
+        // most recent size first
+        recent.remove(matrix);
+        recent.push_front(matrix);
+        if (recent.size() > recent_sizes) {
+            recent.pop_back();
+            for (auto it = matrices.begin(); it != matrices.end();) {
+                it = it->second.expired() ? matrices.erase(it) : std::next(it);
+            }
+        }
+        return matrix;
+    }
+
+    /// default ground matrices of one EMD object constructed without a cost matrix, shared by its copies. The matrix
+    /// of the last histogram size is read without a lock, so the global cache of default_ground is only consulted
+    /// when the size changes; every matrix used stays held as long as the object.
+    template <typename T>
+    struct default_ground_cache {
+        std::atomic<const ground_matrix<T>*> last { nullptr };
+        std::mutex mutex;
+        std::vector<std::shared_ptr<const ground_matrix<T>>> held;
+
+        const ground_matrix<T>& get(std::size_t N)
+        {
+            const ground_matrix<T>* matrix = last.load(std::memory_order_acquire);
+            if (matrix && matrix->N == N) {
+                return *matrix;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = std::find_if(held.begin(), held.end(), [N](const auto& m) { return m->N == N; });
+            if (found == held.end()) {
+                held.push_back(default_ground<T>(N));
+                found = std::prev(held.end());
+            }
+            last.store(found->get(), std::memory_order_release);
+            return **found;
+        }
+    };
+
     // Forward declarations
     template <typename T, FLOW_TYPE_T FLOW_TYPE>
     struct emd_impl;
@@ -651,9 +922,10 @@ namespace EMD_details {
     template <typename Container, FLOW_TYPE_T FLOW_TYPE>
     struct emd_impl_integral_types {
         typedef typename Container::value_type T;
+        template <typename S>
         T operator()(const Container& POrig, const Container& QOrig, const std::vector<T>& Pc,
             const std::vector<T>& Qc,  // P, Q, C replaced with Pc, Qc, Cc by Max F
-            const std::vector<std::vector<T>>& Cc,
+            const cost_matrix<S>& Cc,
             // T maxC, // disabled by MaxF //now updated inside
             T extra_mass_penalty,
             std::vector<std::vector<T>>* F  //,
@@ -670,7 +942,6 @@ namespace EMD_details {
             // Ensuring that the supplier - P, have more mass.
             std::vector<T> P;
             std::vector<T> Q;
-            std::vector<std::vector<T>> C(Cc);
             T abs_diff_sum_P_sum_Q;
             T sum_P = 0;
             T sum_Q = 0;
@@ -683,12 +954,6 @@ namespace EMD_details {
                 needToSwapFlow = true;
                 P.assign(std::begin(Qc), std::end(Qc));
                 Q.assign(std::begin(Pc), std::end(Pc));
-                // transpose C
-                for (std::size_t i = 0; i < N; ++i) {
-                    for (std::size_t j = 0; j < N; ++j) {
-                        C[i][j] = Cc[j][i];
-                    }
-                }
                 abs_diff_sum_P_sum_Q = sum_Q - sum_P;
             } else {
                 P.assign(std::begin(Pc), std::end(Pc));
@@ -698,6 +963,11 @@ namespace EMD_details {
             // if (needToSwapFlow) cout << "needToSwapFlow" << endl;
             // end of re-insertion
 
+            // C is read transposed when the flow is swapped instead of being copied on every call
+            auto C = [&Cc, needToSwapFlow](std::size_t i, std::size_t j) -> T {
+                return needToSwapFlow ? T(Cc(j, i)) : T(Cc(i, j));
+            };
+
             // creating the b vector that contains all vertexes
             std::vector<T> b(2 * N + 2);
             const size_t THRESHOLD_NODE = 2 * N;
@@ -724,9 +994,9 @@ namespace EMD_details {
                 for (std::size_t i = 0; i < N; ++i) {
                     {
                         for (std::size_t j = 0; j < N; ++j) {
-                            assert(C[i][j] >= 0);
-                            if (C[i][j] > maxC)
-                                maxC = C[i][j];
+                            assert(C(i, j) >= 0);
+                            if (C(i, j) > maxC)
+                                maxC = C(i, j);
                         }
                     }
                 }
@@ -754,9 +1024,9 @@ namespace EMD_details {
                         for (size_t j = 0; j < N; ++j) {
                             if (b[j + N] == 0)
                                 continue;
-                            if (C[i][j] == maxC)
+                            if (C(i, j) == maxC)
                                 continue;
-                            c[i].push_back(edge<T>(j + N, C[i][j]));
+                            c[i].push_back(edge<T>(j + N, C(i, j)));
                         }
                     }  // j
                 }
@@ -771,7 +1041,7 @@ namespace EMD_details {
                         for (size_t j = 0; j < N; ++j) {
                             if (b[j + N] == 0)
                                 continue;
-                            if (C[i][j] == maxC)
+                            if (C(i, j) == maxC)
                                 continue;
                             sources_that_flow_not_only_to_thresh.insert(i);
                             sinks_that_get_flow_not_only_from_thresh.insert(j + N);
@@ -933,8 +1203,13 @@ namespace EMD_details {
         typedef long long int CONVERT_TO_T;
         // typedef int T;
 
+        /**
+         * C is a cost_matrix, floating point types also accept the quantized_costs of a cost matrix computed
+         * beforehand
+         */
+        template <typename Costs>
         T operator()(const Container& POrig, const Container& QOrig, const std::vector<T>& P, const std::vector<T>& Q,
-            const std::vector<std::vector<T>>& C,
+            const Costs& C,
             // T maxC, // disabled by Max F
             T extra_mass_penalty,
             std::vector<std::vector<T>>* F  //,
@@ -942,24 +1217,29 @@ namespace EMD_details {
         )
         {
             /*** integral types ***/
-            if (std::is_integral<T>::value) {
+            if constexpr (std::is_integral<T>::value) {
                 // return emd_impl_integral_types<Container, FLOW_TYPE>()(POrig, QOrig, P, Q, C, maxC, extra_mass_penalty,
                 // F, abs_diff_sum_P_sum_Q);
                 return emd_impl_integral_types<Container, FLOW_TYPE>()(POrig, QOrig, P, Q, C, extra_mass_penalty,
                     F);  // replaced by Max F
             }
             /*** floating types ***/
-            else if (std::is_floating_point<T>::value) {
+            else if constexpr (!std::is_same<Costs, quantized_costs>::value) {
+                return (*this)(POrig, QOrig, P, Q, quantize_costs(C, ground_matrix<T>::MULT_FACTOR), extra_mass_penalty, F);
+            } else {
 
-                // TODO: static assert
-                assert(sizeof(CONVERT_TO_T) >= 8);
+                static_assert(sizeof(CONVERT_TO_T) >= 8, "flows are quantized to 64 bit integers");
 
                 // This condition should hold:
                 // ( 2^(sizeof(CONVERT_TO_T*8)) >= ( MULT_FACTOR^2 )
                 // Note that it can be problematic to check it because
                 // of overflow problems. I simply checked it with Linux calc
                 // which has arbitrary precision.
-                const double MULT_FACTOR = 1000000;
+                const double MULT_FACTOR = ground_matrix<T>::MULT_FACTOR;
+
+                // the cost matrix does not depend on the histograms, it is quantized once per ground matrix
+                const double imaxC = C.maxC;
+                const double CnormFactor = C.normFactor;
 
                 // Constructing the input
                 const size_t N = P.size();
@@ -967,33 +1247,28 @@ namespace EMD_details {
                 std::vector<CONVERT_TO_T> iQOrig(N);
                 std::vector<CONVERT_TO_T> iP(N);
                 std::vector<CONVERT_TO_T> iQ(N);
-                std::vector<std::vector<CONVERT_TO_T>> iC(N, std::vector<CONVERT_TO_T>(N));
-                std::vector<std::vector<CONVERT_TO_T>> iF(N, std::vector<CONVERT_TO_T>(N));
+                std::vector<std::vector<CONVERT_TO_T>> iF;
+                if (FLOW_TYPE != NO_FLOW) {
+                    iF.assign(N, std::vector<CONVERT_TO_T>(N));
+                }
 
                 // Converting to CONVERT_TO_T
                 double sumP = 0.0;
                 double sumQ = 0.0;
-                double imaxC = C[0][0];
                 for (size_t i = 0; i < N; ++i) {
                     sumP += POrig[i];
                     sumQ += QOrig[i];
-                    for (size_t j = 0; j < N; ++j) {
-                        if (C[i][j] > imaxC)
-                            imaxC = C[i][j];
-                    }
                 }
                 double minSum = std::min(sumP, sumQ);
                 double maxSum = std::max(sumP, sumQ);
                 double PQnormFactor = MULT_FACTOR / maxSum;
-                double CnormFactor = MULT_FACTOR / imaxC;
                 for (size_t i = 0; i < N; ++i) {
                     iPOrig[i] = static_cast<CONVERT_TO_T>(floor(POrig[i] * PQnormFactor + 0.5));
                     iQOrig[i] = static_cast<CONVERT_TO_T>(floor(QOrig[i] * PQnormFactor + 0.5));
                     iP[i] = static_cast<CONVERT_TO_T>(floor(P[i] * PQnormFactor + 0.5));
                     iQ[i] = static_cast<CONVERT_TO_T>(floor(Q[i] * PQnormFactor + 0.5));
-                    for (size_t j = 0; j < N; ++j) {
-                        iC[i][j] = static_cast<CONVERT_TO_T>(floor(C[i][j] * CnormFactor + 0.5));
-                        if (FLOW_TYPE != NO_FLOW) {
+                    if (FLOW_TYPE != NO_FLOW) {
+                        for (size_t j = 0; j < N; ++j) {
                             iF[i][j] = static_cast<CONVERT_TO_T>(floor(((*F)[i][j]) * PQnormFactor + 0.5));
                         }
                     }
@@ -1002,7 +1277,7 @@ namespace EMD_details {
                 // computing distance without extra mass penalty
                 //            double dist = emd_impl<std::vector<CONVERT_TO_T>, FLOW_TYPE>()(iPOrig, iQOrig, iP, iQ, iC,
                 //            imaxC, 0, &iF, abs_diff_sum_P_sum_Q);
-                double dist = emd_impl<std::vector<CONVERT_TO_T>, FLOW_TYPE>()(iPOrig, iQOrig, iP, iQ, iC, 0,
+                double dist = emd_impl<std::vector<CONVERT_TO_T>, FLOW_TYPE>()(iPOrig, iQOrig, iP, iQ, C.C, 0,
                     &iF);  // replaced by Max F
                 // unnormalize
                 dist = dist / PQnormFactor;
@@ -1068,25 +1343,6 @@ namespace EMD_details {
 //     return (*this)(Pc, Qc, C, extra_mass_penalty, F);
 // }
 template <typename V>
-inline auto EMD<V>::default_ground_matrix(std::size_t rows, std::size_t cols) const
-    -> std::vector<std::vector<value_type>>
-{
-    std::vector<std::vector<value_type>> matrix(rows, std::vector<value_type>(cols, 0));
-    if (rows == 1 && cols == 1) {
-        matrix[0][0] = 1;
-        return matrix;
-    }
-    int t = std::min(rows, cols) / 2;  // by default, ground distance saturates at the half of maximum distance possible
-
-    for (size_t i = 0; i < rows; i++) {
-        for (size_t j = 0; j < cols; j++) {
-            matrix[i][j] = std::min(t,
-                std::abs((int)(i - j)));  // non-square matrix is supported here, BUT IS NOT SUPPORTED IN THE EMD IMPL
-        }
-    }
-    return matrix;
-}
-template <typename V>
 template <typename Container>
 auto EMD<V>::operator()(const Container& Pc, const Container& Qc) const -> distance_type
 // const std::vector<std::vector<typename Container::value_type>> &C,
@@ -1094,13 +1350,20 @@ auto EMD<V>::operator()(const Container& Pc, const Container& Qc) const -> dista
 // typename Container::value_type extra_mass_penalty,
 // std::vector<std::vector<typename Container::value_type>> *F) const
 {
-    if (!is_C_initialized) {
-        C = default_ground_matrix(Pc.size(), Pc.size());
-        is_C_initialized = true;
-    }
+    // an EMD constructed without cost matrix uses the shared default matrix of the size of the histograms
+    const auto& matrix = ground ? *ground : defaults->get(Pc.size());
 
     using T = value_type;
     const EMD_details::FLOW_TYPE_T FLOW_TYPE = EMD_details::NO_FLOW;
+
+    // closed forms need neither copies of the histograms nor the solver
+    using structure = typename EMD_details::ground_matrix<value_type>::structure;
+    if (matrix.kind == structure::uniform) {
+        return EMD_details::uniform_emd(matrix, Pc, Qc, extra_mass_penalty);
+    }
+    if (matrix.kind == structure::line && EMD_details::equal_mass<T>(Pc, Qc, matrix.N)) {
+        return EMD_details::line_emd(matrix, Pc, Qc);
+    }
     //    // if maxC is not given seperatly // disabled by Max F when rolled back to original version
     //    if (maxC == std::numeric_limits<T>::min())
     //    {
@@ -1158,11 +1421,46 @@ auto EMD<V>::operator()(const Container& Pc, const Container& Qc) const -> dista
 
     //    return EMD_details::emd_impl<std::vector<T>, FLOW_TYPE>()(Pc, Qc, P, Q, C, maxC, extra_mass_penalty, F,
     //    abs_diff_sum_P_sum_Q);
-    return EMD_details::emd_impl<Container, FLOW_TYPE>()(Pc, Qc, P, Q, C, extra_mass_penalty,
-        F);  // turned to original state by Max F
+    if constexpr (std::is_floating_point<T>::value) {
+        return EMD_details::emd_impl<Container, FLOW_TYPE>()(Pc, Qc, P, Q, matrix.quantized, extra_mass_penalty, F);
+    } else {
+        return EMD_details::emd_impl<Container, FLOW_TYPE>()(Pc, Qc, P, Q, matrix.costs, extra_mass_penalty,
+            F);  // turned to original state by Max F
+    }
 
 };  // EMD
 
+template <typename V>
+template <typename Container>
+auto EMD<V>::lower_bound(const Container& Pc, const Container& Qc) const -> distance_type
+{
+    const auto& matrix = ground ? *ground : defaults->get(Pc.size());
+
+    // the solver sums floating histograms in double, the same sums keep the bound below its result
+    using Sum = typename std::conditional<std::is_floating_point<value_type>::value, double, value_type>::type;
+    Sum sum_P = 0;
+    Sum sum_Q = 0;
+    for (std::size_t i = 0; i < matrix.N; ++i) {
+        sum_P += Pc[i];
+        sum_Q += Qc[i];
+    }
+    const Sum penalty = extra_mass_penalty == -1 ? Sum(matrix.maxC) : Sum(extra_mass_penalty);
+    return static_cast<distance_type>((sum_P > sum_Q ? sum_P - sum_Q : sum_Q - sum_P) * penalty);
+}
+
+template <typename V>
+template <typename Container, typename Matrix>
+void EMD<V>::batch(const std::vector<Container>& queries, const std::vector<Container>& references, Matrix& out,
+    std::size_t threads) const
+{
+    out.resize(queries.size(), references.size());
+    if (queries.empty() || references.empty()) {
+        return;
+    }
+    parallel_grid(queries.size(), references.size(), threads,
+        [&](std::size_t i, std::size_t j) { out(i, j) = (*this)(queries[i], references[j]); });
+}
+
 }  // namespace metric
 
 #endif
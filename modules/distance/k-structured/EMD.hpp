@@ -7,30 +7,51 @@ Copyright (c) 2018 Michael Welsch
 */
 #ifndef _METRIC_DISTANCE_K_STRUCTURED_EMD_HPP
 #define _METRIC_DISTANCE_K_STRUCTURED_EMD_HPP
+#include <memory>
 #include <vector>
 
 namespace metric {
 
+namespace EMD_details {
+    template <typename T>
+    struct ground_matrix;
+
+    template <typename T>
+    struct default_ground_cache;
+
+    template <typename T>
+    std::vector<std::vector<T>> default_ground_matrix(std::size_t rows, std::size_t cols);
+}
+
 /**
  * @class EMD
  *
  * @brief Earth mover's distance
  *
+ * @details The structure of the cost matrix is analysed once. Uniform matrices (e.g. thresholded 2d grids) and 1-D
+ * line matrices |x_i - x_j| with histograms of equal mass are computed in closed form, other matrices by the
+ * min-cost-flow solver.
+ *
+ * The ground matrix is built at construction, or for an EMD without cost matrix taken from a cache of default matrices
+ * when a histogram size is first seen. It is immutable and is shared by copies of the object, so one EMD can be
+ * used concurrently from several threads. Floating point costs are stored as the 32 bit integers used by the solver.
  */
 template <typename V>
 struct EMD {
     using value_type = V;
     using distance_type = value_type;
 
-    explicit EMD() {}
+    explicit EMD()
+        : defaults(std::make_shared<EMD_details::default_ground_cache<value_type>>())
+    {
+    }
     /**
      * @brief Construct a new EMD object with cost matrix
      *
      * @param C_ cost matrix
      */
     explicit EMD(std::vector<std::vector<value_type>>&& C_)
-        : C(C_)
-        , is_C_initialized(true)
+        : ground(std::make_shared<const EMD_details::ground_matrix<value_type>>(C_))
     {
     }
 
@@ -43,10 +64,10 @@ struct EMD {
      */
     EMD(std::size_t rows, std::size_t cols, const value_type& extra_mass_penalty_ = -1,
         std::vector<std::vector<value_type>>* F_ = nullptr)
-        : C(default_ground_matrix(rows, cols))
+        : ground(std::make_shared<const EMD_details::ground_matrix<value_type>>(
+            EMD_details::default_ground_matrix<value_type>(rows, cols)))
         , extra_mass_penalty(extra_mass_penalty_)
         , F(F_)
-        , is_C_initialized(true)
     {
     }
 
@@ -59,10 +80,9 @@ struct EMD {
      */
     EMD(const std::vector<std::vector<value_type>>& C_, const value_type& extra_mass_penalty_ = -1,
         std::vector<std::vector<value_type>>* F_ = nullptr)
-        : C(C_)
+        : ground(std::make_shared<const EMD_details::ground_matrix<value_type>>(C_))
         , extra_mass_penalty(extra_mass_penalty_)
         , F(F_)
-        , is_C_initialized(true)
     {
     }
 
@@ -77,18 +97,43 @@ struct EMD {
     template <typename Container>
     distance_type operator()(const Container& Pc, const Container& Qc) const;
 
+    /**
+     * @brief Calculate a lower bound of the EMD distance in linear time, the penalty for the extra mass
+     *
+     * @details Every unit of mass that is not transported costs the extra mass penalty, the transport itself costs
+     * nothing less than zero for a non negative cost matrix.
+     *
+     * @param Pc first histogram
+     * @param Qc second histogram
+     * @return value not greater than the EMD distance between Pc and Qc
+     */
+    template <typename Container>
+    distance_type lower_bound(const Container& Pc, const Container& Qc) const;
+
+    /**
+     * @brief Calculate the distances between every query and every reference
+     *
+     * @details The pairs are evaluated in tiles, the query rows are split between threads.
+     *
+     * @param queries first records
+     * @param references second records
+     * @param out matrix resized to queries.size() x references.size(), e.g. blaze::DynamicMatrix<distance_type>
+     * @param threads number of threads, 0 means one per hardware thread
+     */
+    template <typename Container, typename Matrix>
+    void batch(const std::vector<Container>& queries, const std::vector<Container>& references, Matrix& out,
+        std::size_t threads = 1) const;
+
     EMD(EMD&&) = default;
     EMD(const EMD&) = default;
     EMD& operator=(const EMD&) = default;
     EMD& operator=(EMD&&) = default;
 
 private:
-    mutable std::vector<std::vector<value_type>> C;
+    std::shared_ptr<const EMD_details::ground_matrix<value_type>> ground;  // null for the default matrix
+    std::shared_ptr<EMD_details::default_ground_cache<value_type>> defaults;  // default matrices used so far
     value_type extra_mass_penalty = -1;
     std::vector<std::vector<value_type>>* F = nullptr;
-    mutable bool is_C_initialized = false;
-
-    std::vector<std::vector<value_type>> default_ground_matrix(std::size_t rows, std::size_t cols) const;
 };
 
 }  // namespace metric
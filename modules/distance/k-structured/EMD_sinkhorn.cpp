@@ -0,0 +1,193 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (c) 2020 Panda Team
+*/
+#ifndef _METRIC_DISTANCE_K_STRUCTURED_EMD_SINKHORN_CPP
+#define _METRIC_DISTANCE_K_STRUCTURED_EMD_SINKHORN_CPP
+
+#include "EMD_sinkhorn.hpp"
+#include "../../utils/parallel.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace metric {
+
+namespace EMD_sinkhorn_details {
+
+    // support of a histogram, the logarithm of its normalized masses and the dual potential on that support
+    template <typename V>
+    struct Marginal {
+        std::vector<std::size_t> support;
+        std::vector<V> log_mass;
+        std::vector<V> potential;
+    };
+
+    // per thread buffers, they only grow
+    template <typename V>
+    struct Scratch {
+        Marginal<V> P;
+        Marginal<V> Q;
+    };
+
+    template <typename V>
+    Scratch<V>& scratch()
+    {
+        thread_local Scratch<V> buffers;
+        return buffers;
+    }
+
+    /**
+     * @brief fill the support and the log of the normalized masses of a histogram
+     *
+     * @return mass of the histogram
+     */
+    template <typename V, typename Container>
+    V set_marginal(const Container& P, std::size_t N, Marginal<V>& marginal)
+    {
+        V mass = 0;
+        for (std::size_t i = 0; i < N; ++i) {
+            mass += P[i];
+        }
+        marginal.support.clear();
+        marginal.log_mass.clear();
+        if (!(mass > 0)) {
+            return 0;
+        }
+        for (std::size_t i = 0; i < N; ++i) {
+            if (P[i] > 0) {
+                marginal.support.push_back(i);
+                marginal.log_mass.push_back(std::log(V(P[i]) / mass));
+            }
+        }
+        return mass;
+    }
+
+    // log(sum_s exp(potential[s] + k[support[s]])) without overflow
+    template <typename V>
+    V log_sum_exp(const V* k, const Marginal<V>& marginal)
+    {
+        const std::size_t n = marginal.support.size();
+        V max = -std::numeric_limits<V>::infinity();
+        for (std::size_t s = 0; s < n; ++s) {
+            max = std::max(max, marginal.potential[s] + k[marginal.support[s]]);
+        }
+        if (max == -std::numeric_limits<V>::infinity()) {
+            return max;
+        }
+        V sum = 0;
+        for (std::size_t s = 0; s < n; ++s) {
+            sum += std::exp(marginal.potential[s] + k[marginal.support[s]] - max);
+        }
+        return max + std::log(sum);
+    }
+
+    /**
+     * @brief log domain Sinkhorn iterations between two unit mass histograms
+     *
+     * @param K -C / regularization, row major
+     * @param Kt transposed K
+     * @return transport cost of the regularized plan
+     */
+    template <typename V>
+    V solve(const std::vector<V>& K, const std::vector<V>& Kt, std::size_t N, V regularization,
+        std::size_t max_iterations, V tolerance, Marginal<V>& P, Marginal<V>& Q)
+    {
+        P.potential.assign(P.support.size(), 0);
+        Q.potential.assign(Q.support.size(), 0);
+
+        for (std::size_t iteration = 0; iteration < max_iterations; ++iteration) {
+            // the column marginals are exact after a column update, so the row update measures the remaining error
+            V error = 0;
+            for (std::size_t s = 0; s < P.support.size(); ++s) {
+                const V lse = log_sum_exp(&K[P.support[s] * N], Q);
+                error += std::abs(std::exp(P.potential[s] + lse) - std::exp(P.log_mass[s]));
+                P.potential[s] = P.log_mass[s] - lse;
+            }
+            if (iteration > 0 && error <= tolerance) {
+                break;
+            }
+            for (std::size_t t = 0; t < Q.support.size(); ++t) {
+                Q.potential[t] = Q.log_mass[t] - log_sum_exp(&Kt[Q.support[t] * N], P);
+            }
+        }
+
+        V cost = 0;
+        for (std::size_t s = 0; s < P.support.size(); ++s) {
+            const V* k = &K[P.support[s] * N];
+            for (std::size_t t = 0; t < Q.support.size(); ++t) {
+                const V kst = k[Q.support[t]];
+                cost -= std::exp(P.potential[s] + Q.potential[t] + kst) * kst;
+            }
+        }
+        return cost * regularization;
+    }
+
+}  // namespace EMD_sinkhorn_details
+
+template <typename V>
+EMD_sinkhorn<V>::EMD_sinkhorn(const std::vector<std::vector<value_type>>& C_, value_type regularization_,
+    std::size_t max_iterations_, value_type tolerance_, std::size_t threads_)
+    : regularization(regularization_)
+    , max_iterations(max_iterations_)
+    , tolerance(tolerance_)
+    , threads(threads_)
+    , N(C_.size())
+    , K(N * N)
+    , Kt(N * N)
+{
+    for (std::size_t i = 0; i < N; ++i) {
+        for (std::size_t j = 0; j < N; ++j) {
+            K[i * N + j] = -C_[i][j] / regularization;
+            Kt[j * N + i] = K[i * N + j];
+        }
+    }
+}
+
+template <typename V>
+template <typename Container>
+auto EMD_sinkhorn<V>::operator()(const Container& Pc, const Container& Qc) const -> distance_type
+{
+    auto& buffers = EMD_sinkhorn_details::scratch<value_type>();
+    const value_type mass = EMD_sinkhorn_details::set_marginal(Pc, N, buffers.P);
+    if (mass == 0 || EMD_sinkhorn_details::set_marginal(Qc, N, buffers.Q) == 0) {
+        return 0;
+    }
+    return mass
+        * EMD_sinkhorn_details::solve(K, Kt, N, regularization, max_iterations, tolerance, buffers.P, buffers.Q);
+}
+
+template <typename V>
+template <typename Container>
+auto EMD_sinkhorn<V>::one_to_many(const Container& Pc, const std::vector<Container>& Qs) const
+    -> std::vector<distance_type>
+{
+    std::vector<distance_type> result(Qs.size(), 0);
+    EMD_sinkhorn_details::Marginal<value_type> P;
+    const value_type mass = EMD_sinkhorn_details::set_marginal(Pc, N, P);
+    if (mass == 0) {
+        return result;
+    }
+
+    parallel_for(Qs.size(), threads, [&](std::size_t begin, std::size_t end, std::size_t) {
+        auto& buffers = EMD_sinkhorn_details::scratch<value_type>();
+        buffers.P.support = P.support;
+        buffers.P.log_mass = P.log_mass;
+        for (std::size_t q = begin; q < end; ++q) {
+            if (EMD_sinkhorn_details::set_marginal(Qs[q], N, buffers.Q) > 0) {
+                result[q] = mass
+                    * EMD_sinkhorn_details::solve(
+                        K, Kt, N, regularization, max_iterations, tolerance, buffers.P, buffers.Q);
+            }
+        }
+    });
+    return result;
+}
+
+}  // namespace metric
+
+#endif
@@ -0,0 +1,88 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (c) 2020 Panda Team
+*/
+#ifndef _METRIC_DISTANCE_K_STRUCTURED_EMD_SINKHORN_HPP
+#define _METRIC_DISTANCE_K_STRUCTURED_EMD_SINKHORN_HPP
+
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+namespace metric {
+
+/**
+ * @class EMD_sinkhorn
+ *
+ * @brief Entropy regularized approximation of the Earth mover's distance (Sinkhorn iterations)
+ *
+ * @details The dual potentials are updated in the log domain, so small regularization values do not underflow.
+ * Both histograms are normalized to unit mass, the result is the transport cost of the regularized plan times the
+ * mass of the first histogram. Extra mass is not penalized as in EMD.
+ *
+ * Accuracy: for histograms of equal mass m the result is never below the exact EMD (up to the marginal error
+ * allowed by tolerance) and exceeds it by at most regularization * log(nP * nQ) * m, where nP and nQ are the
+ * numbers of nonzero bins. The number of iterations grows roughly with max cost / regularization, so
+ * regularization of 1% - 5% of the largest cost is a reasonable trade-off. When max_iterations is reached before
+ * tolerance, the plan does not match the marginals yet and the result may also fall below the exact EMD.
+ */
+template <typename V>
+struct EMD_sinkhorn {
+    static_assert(std::is_floating_point<V>::value, "EMD_sinkhorn requires a floating point value type");
+
+    using value_type = V;
+    using distance_type = value_type;
+
+    /**
+     * @brief Construct a new EMD_sinkhorn object
+     *
+     * @param C_ square cost matrix
+     * @param regularization_ weight of the entropy term, in units of the cost
+     * @param max_iterations_ largest number of Sinkhorn iterations per distance
+     * @param tolerance_ the iterations stop when the L1 error of the row marginals falls below tolerance
+     * @param threads_ number of threads used by one_to_many, 0 means one per hardware thread
+     */
+    EMD_sinkhorn(const std::vector<std::vector<value_type>>& C_, value_type regularization_,
+        std::size_t max_iterations_ = 1000, value_type tolerance_ = 1e-6, std::size_t threads_ = 1);
+
+    /**
+     * @brief Calculate approximate EMD distance between Pc and Qc
+     *
+     * @param Pc first histogram
+     * @param Qc second histogram
+     * @return approximate EMD distance
+     */
+    template <typename Container>
+    distance_type operator()(const Container& Pc, const Container& Qc) const;
+
+    /**
+     * @brief Calculate approximate EMD distances between Pc and every histogram of Qs
+     *
+     * @details The kernel matrix and the logarithm of Pc are shared between the comparisons.
+     *
+     * @param Pc first histogram
+     * @param Qs histograms to compare with
+     * @return approximate EMD distance for every histogram of Qs
+     */
+    template <typename Container>
+    std::vector<distance_type> one_to_many(const Container& Pc, const std::vector<Container>& Qs) const;
+
+    value_type regularization;
+    std::size_t max_iterations = 1000;
+    value_type tolerance = 1e-6;
+    std::size_t threads = 1;
+
+private:
+    std::size_t N;
+    std::vector<value_type> K;  // -C / regularization, row major
+    std::vector<value_type> Kt;  // transposed K for the column updates
+};
+
+}  // namespace metric
+
+#include "EMD_sinkhorn.cpp"
+
+#endif  // Header Guard
@@ -9,57 +9,315 @@ Copyright (c) 2018 Michael Welsch
 #define _METRIC_DISTANCE_K_STRUCTURED_EDIT_CPP
 
 #include "Edit.hpp"
+#include "../../utils/parallel.hpp"
 #include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
 #include <vector>
 
 namespace metric {
 
-template <typename V>
-template <typename Container>
-auto Edit<V>::operator()(const Container& str1, const Container& str2) const -> distance_type
-{
-    size_t sizeA = str1.size();
-    size_t sizeB = str2.size();
+namespace Edit_details {
+
+    template <typename Container>
+    using element_t = std::decay_t<decltype(std::declval<const Container&>()[0])>;
+
+    // strings of bytes are handled by the bit-parallel algorithm
+    template <typename Container>
+    constexpr bool is_byte_string = std::is_integral<element_t<Container>>::value && sizeof(element_t<Container>) == 1;
+
+    // per thread buffers, they only grow, so calls do not allocate once the buffers fit the longest input seen
+    struct Scratch {
+        std::vector<int> D0;
+        std::vector<int> Di;
+        std::vector<std::uint64_t> peq;  // 256 match masks per 64 characters of the pattern, kept zeroed between calls
+        std::vector<std::uint64_t> Pv;
+        std::vector<std::uint64_t> Mv;
+    };
+
+    inline Scratch& scratch()
+    {
+        thread_local Scratch buffers;
+        return buffers;
+    }
+
+    /**
+     * @brief Myers/Hyyro bit-parallel Levenshtein distance for byte strings, one machine word per 64 characters of
+     * the pattern
+     *
+     * @param pattern shorter non empty string
+     * @param text longer non empty string
+     * @param upper_bound the computation stops when the distance is known to exceed upper_bound
+     * @return Edit distance between pattern and text if it does not exceed upper_bound, otherwise some value greater
+     * than upper_bound
+     */
+    template <typename Pattern, typename Text>
+    int bit_parallel(const Pattern& pattern, const Text& text, int upper_bound)
+    {
+        const std::size_t m = pattern.size();
+        const std::size_t n = text.size();
+        const std::size_t words = (m + 63) / 64;
+        const std::uint64_t last_bit = std::uint64_t(1) << ((m - 1) % 64);
+        const std::uint64_t high_bit = std::uint64_t(1) << 63;
+
+        auto& buffers = scratch();
+        if (buffers.peq.size() < 256 * words) {
+            buffers.peq.resize(256 * words, 0);
+        }
+        std::uint64_t* peq = buffers.peq.data();
+        for (std::size_t i = 0; i < m; ++i) {
+            peq[static_cast<unsigned char>(pattern[i]) * words + i / 64] |= std::uint64_t(1) << (i % 64);
+        }
+
+        int score = m;  // distance between the whole pattern and the processed prefix of text
+        if (words == 1) {
+            std::uint64_t Pv = ~std::uint64_t(0);
+            std::uint64_t Mv = 0;
+            for (std::size_t j = 0; j < n; ++j) {
+                const std::uint64_t Eq = peq[static_cast<unsigned char>(text[j])];
+                const std::uint64_t Xv = Eq | Mv;
+                const std::uint64_t Xh = (((Eq & Pv) + Pv) ^ Pv) | Eq;
+                std::uint64_t Ph = Mv | ~(Xh | Pv);
+                std::uint64_t Mh = Pv & Xh;
+                if (Ph & last_bit) {
+                    ++score;
+                } else if (Mh & last_bit) {
+                    --score;
+                }
+                Ph = (Ph << 1) | 1;
+                Mh <<= 1;
+                Pv = Mh | ~(Xv | Ph);
+                Mv = Ph & Xv;
+                // each remaining character of text can decrease the distance by at most one
+                if (score - int(n - j - 1) > upper_bound) {
+                    score -= n - j - 1;
+                    break;
+                }
+            }
+        } else {
+            if (buffers.Pv.size() < words) {
+                buffers.Pv.resize(words);
+                buffers.Mv.resize(words);
+            }
+            std::uint64_t* Pv = buffers.Pv.data();
+            std::uint64_t* Mv = buffers.Mv.data();
+            std::fill(Pv, Pv + words, ~std::uint64_t(0));
+            std::fill(Mv, Mv + words, 0);
+            for (std::size_t j = 0; j < n; ++j) {
+                const std::uint64_t* Eqs = peq + static_cast<unsigned char>(text[j]) * words;
+                int hin = 1;  // horizontal delta entering the top of the block, the first row of the table is 0..n
+                for (std::size_t b = 0; b < words; ++b) {
+                    std::uint64_t Eq = Eqs[b];
+                    const std::uint64_t Xv = Eq | Mv[b];
+                    if (hin < 0) {
+                        Eq |= 1;
+                    }
+                    const std::uint64_t Xh = (((Eq & Pv[b]) + Pv[b]) ^ Pv[b]) | Eq;
+                    std::uint64_t Ph = Mv[b] | ~(Xh | Pv[b]);
+                    std::uint64_t Mh = Pv[b] & Xh;
+                    const std::uint64_t out_bit = b + 1 == words ? last_bit : high_bit;
+                    const int hout = (Ph & out_bit) ? 1 : ((Mh & out_bit) ? -1 : 0);
+                    Ph <<= 1;
+                    Mh <<= 1;
+                    if (hin < 0) {
+                        Mh |= 1;
+                    } else if (hin > 0) {
+                        Ph |= 1;
+                    }
+                    Pv[b] = Mh | ~(Xv | Ph);
+                    Mv[b] = Ph & Xv;
+                    hin = hout;
+                }
+                score += hin;
+                if (score - int(n - j - 1) > upper_bound) {
+                    score -= n - j - 1;
+                    break;
+                }
+            }
+        }
 
-    // TODO: check empty strings.
+        for (std::size_t i = 0; i < m; ++i) {
+            peq[static_cast<unsigned char>(pattern[i]) * words + i / 64] = 0;
+        }
+        return score;
+    }
 
-    std::vector<int> D0(sizeB + 1);
-    std::vector<int> Di(sizeB + 1);
+    /**
+     * @brief Ukkonen banded Levenshtein distance, only cells within k of the diagonal are evaluated
+     *
+     * @param str1 first string
+     * @param str2 second string
+     * @param k band radius, must be smaller than the length of the longer string
+     * @return Edit distance between str1 and str2 if it does not exceed k, otherwise k + 1
+     */
+    template <typename Container1, typename Container2>
+    int banded(const Container1& str1, const Container2& str2, int k)
+    {
+        const int sizeA = str1.size();
+        const int sizeB = str2.size();
+        const int out_of_band = k + 1;
 
-    int C1, C2, C3;
+        auto& buffers = scratch();
+        if (int(buffers.D0.size()) < sizeB + 2) {
+            buffers.D0.resize(sizeB + 2);
+            buffers.Di.resize(sizeB + 2);
+        }
+        int* D0 = buffers.D0.data();
+        int* Di = buffers.Di.data();
 
-    // first element
-    D0[0] = 0;
+        // first row
+        for (int j = 0; j <= std::min(sizeB, k); ++j) {
+            D0[j] = j;
+        }
+        D0[std::min(sizeB, k) + 1] = out_of_band;
 
-    // first row
-    for (std::size_t j = 0; j < sizeB + 1; j++) {
-        // editDistance[0][j] = j;
-        D0[j] = j;
+        for (int i = 1; i <= sizeA; ++i) {
+            const int lo = std::max(1, i - k);
+            const int hi = std::min(sizeB, i + k);
+            Di[lo - 1] = lo == 1 ? std::min(i, out_of_band) : out_of_band;
+            int row_min = Di[lo - 1];
+            for (int j = lo; j <= hi; ++j) {
+                int d;
+                if (str1[i - 1] == str2[j - 1]) {
+                    d = D0[j - 1];
+                } else {
+                    d = std::min({ D0[j], Di[j - 1], D0[j - 1] }) + 1;
+                }
+                Di[j] = std::min(d, out_of_band);
+                row_min = std::min(row_min, Di[j]);
+            }
+            Di[hi + 1] = out_of_band;
+            if (row_min > k) {
+                return out_of_band;
+            }
+            std::swap(D0, Di);
+        }
+        return D0[sizeB];
     }
 
-    // second-->last row
-    for (std::size_t i = 1; i < sizeA + 1; i++) {
-        // every first element in row
-        Di[0] = i;
-
-        // remaining elements in row
-        for (std::size_t j = 1; j < sizeB + 1; j++) {
-            if (str1[i - 1] == str2[j - 1]) {
-                Di[j] = D0[j - 1];
-            } else {
-                C1 = D0[j];
-                C2 = Di[j - 1];
-                C3 = D0[j - 1];
-                Di[j] = (C1 < ((C2 < C3) ? C2 : C3)) ? C1 : ((C2 < C3) ? C2 : C3);  // Di[j] = std::min({C1,C2,C3});
-                Di[j] += 1;
+    /**
+     * @brief classic two row Levenshtein dynamic programming for arbitrary element types
+     *
+     * @param str1 first string
+     * @param str2 second string
+     * @param upper_bound the computation stops when a row minimum exceeds upper_bound
+     * @return Edit distance between str1 and str2 if it does not exceed upper_bound, otherwise some value greater
+     * than upper_bound
+     */
+    template <typename Container1, typename Container2>
+    int full(const Container1& str1, const Container2& str2, int upper_bound)
+    {
+        size_t sizeA = str1.size();
+        size_t sizeB = str2.size();
+
+        auto& buffers = scratch();
+        if (buffers.D0.size() < sizeB + 1) {
+            buffers.D0.resize(sizeB + 1);
+            buffers.Di.resize(sizeB + 1);
+        }
+        int* D0 = buffers.D0.data();
+        int* Di = buffers.Di.data();
+
+        int C1, C2, C3;
+
+        // first row
+        for (std::size_t j = 0; j < sizeB + 1; j++) {
+            // editDistance[0][j] = j;
+            D0[j] = j;
+        }
+
+        // second-->last row
+        for (std::size_t i = 1; i < sizeA + 1; i++) {
+            // every first element in row
+            Di[0] = i;
+            int row_min = Di[0];
+
+            // remaining elements in row
+            for (std::size_t j = 1; j < sizeB + 1; j++) {
+                if (str1[i - 1] == str2[j - 1]) {
+                    Di[j] = D0[j - 1];
+                } else {
+                    C1 = D0[j];
+                    C2 = Di[j - 1];
+                    C3 = D0[j - 1];
+                    Di[j] = (C1 < ((C2 < C3) ? C2 : C3)) ? C1 : ((C2 < C3) ? C2 : C3);  // Di[j] = std::min({C1,C2,C3});
+                    Di[j] += 1;
+                }
+                row_min = Di[j] < row_min ? Di[j] : row_min;
             }
+            // every path to the last cell crosses this row, so the row minimum is a lower bound of the distance
+            if (row_min > upper_bound) {
+                return row_min;
+            }
+            std::swap(D0, Di);
+        }
+
+        return D0[sizeB];
+    }
+
+}  // namespace Edit_details
+
+template <typename V>
+template <typename Container>
+auto Edit<V>::operator()(const Container& str1, const Container& str2) const -> distance_type
+{
+    return this->operator()(str1, str2, std::numeric_limits<distance_type>::max());
+}
+
+template <typename V>
+template <typename Container>
+auto Edit<V>::operator()(const Container& str1, const Container& str2, distance_type upper_bound) const
+    -> distance_type
+{
+    const size_t sizeA = str1.size();
+    const size_t sizeB = str2.size();
+
+    const distance_type length_difference = lower_bound(str1, str2);
+    if (length_difference > upper_bound) {
+        return length_difference;
+    }
+    if (sizeA == 0 || sizeB == 0) {
+        return length_difference;
+    }
+
+    const distance_type longest = std::max(sizeA, sizeB);
+    const bool bounded = upper_bound < longest;  // the distance never exceeds the longer length
+
+    if constexpr (Edit_details::is_byte_string<Container>) {
+        // the band costs about one operation per cell, a bit-parallel word covers 64 cells in about 16 operations
+        const std::size_t words = (std::min(sizeA, sizeB) + 63) / 64;
+        if (bounded && std::size_t(2 * upper_bound + 1) < 16 * words) {
+            return Edit_details::banded(str1, str2, upper_bound);
+        }
+        return sizeA <= sizeB ? Edit_details::bit_parallel(str1, str2, upper_bound)
+                              : Edit_details::bit_parallel(str2, str1, upper_bound);
+    } else {
+        if (bounded) {
+            return Edit_details::banded(str1, str2, upper_bound);
         }
-        std::swap(D0, Di);
+        return Edit_details::full(str1, str2, upper_bound);
     }
+}
 
-    distance_type rvalue = D0[sizeB];  // +1 -1
+template <typename V>
+template <typename Container>
+auto Edit<V>::lower_bound(const Container& str1, const Container& str2) const -> distance_type
+{
+    // every insertion or deletion changes the length by one
+    const size_t sizeA = str1.size();
+    const size_t sizeB = str2.size();
+    return sizeA > sizeB ? sizeA - sizeB : sizeB - sizeA;
+}
 
-    return rvalue;
+template <typename V>
+template <typename Container, typename Matrix>
+void Edit<V>::batch(const std::vector<Container>& queries, const std::vector<Container>& references, Matrix& out,
+    std::size_t threads) const
+{
+    out.resize(queries.size(), references.size());
+    parallel_grid(queries.size(), references.size(), threads,
+        [&](std::size_t i, std::size_t j) { out(i, j) = (*this)(queries[i], references[j]); });
 }
 
 }  // namespace metric
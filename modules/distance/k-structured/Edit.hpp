@@ -8,12 +8,17 @@ Copyright (c) 2018 Michael Welsch
 
 #ifndef _METRIC_DISTANCE_K_STRUCTURED_EDIT_HPP
 #define _METRIC_DISTANCE_K_STRUCTURED_EDIT_HPP
+#include <cstddef>
 #include <string_view>
+#include <vector>
 namespace metric {
 
 /**
  * @class Edit
  * @breaf Edit distance(for strings)
+ * @details Strings of bytes use the Myers/Hyyro bit-parallel algorithm, other element types the two row dynamic
+ * programming; bounded queries with a small bound are evaluated in a band around the diagonal. Working buffers are
+ * kept per thread, so repeated calls do not allocate.
  * @tparam
  */
 template <typename V>
@@ -32,6 +37,45 @@ struct Edit {
     template <typename Container>
     distance_type operator()(const Container& str1, const Container& str2) const;
 
+    /**
+     * @brief Calculate Edit distance between two STL-like containers, abandoning as soon as it exceeds upper_bound
+     *
+     * @tparam Container
+     * @param str1
+     * @param str2
+     * @param upper_bound largest distance of interest
+     * @return Edit distance between str1 and str2 if it does not exceed upper_bound, otherwise some value greater
+     * than upper_bound
+     */
+    template <typename Container>
+    distance_type operator()(const Container& str1, const Container& str2, distance_type upper_bound) const;
+
+    /**
+     * @brief Calculate a lower bound of the Edit distance in constant time, the difference of the lengths
+     *
+     * @tparam Container
+     * @param str1
+     * @param str2
+     * @return value not greater than the Edit distance between str1 and str2
+     */
+    template <typename Container>
+    distance_type lower_bound(const Container& str1, const Container& str2) const;
+
+    /**
+     * @brief Calculate the distances between every query and every reference
+     *
+     * @details The pairs are evaluated in tiles, the query rows are split between threads. Every thread reuses its own working
+     * buffers.
+     *
+     * @param queries first records
+     * @param references second records
+     * @param out matrix resized to queries.size() x references.size(), e.g. blaze::DynamicMatrix<distance_type>
+     * @param threads number of threads, 0 means one per hardware thread
+     */
+    template <typename Container, typename Matrix>
+    void batch(const std::vector<Container>& queries, const std::vector<Container>& references, Matrix& out,
+        std::size_t threads = 1) const;
+
     /**
      * @brief calculate Edit distance for null terminated strings
      *
@@ -43,6 +87,20 @@ struct Edit {
     {
         return this->operator()(std::basic_string_view<V>(str1), std::basic_string_view<V>(str2));
     }
+
+    /**
+     * @brief calculate Edit distance for null terminated strings, abandoning as soon as it exceeds upper_bound
+     *
+     * @param str1
+     * @param str2
+     * @param upper_bound largest distance of interest
+     * @return Edit distance between str1 and str2 if it does not exceed upper_bound, otherwise some value greater
+     * than upper_bound
+     */
+    distance_type operator()(const V* str1, const V* str2, distance_type upper_bound) const
+    {
+        return this->operator()(std::basic_string_view<V>(str1), std::basic_string_view<V>(str2), upper_bound);
+    }
 };
 
 }  // namespace metric
@@ -8,7 +8,12 @@ Copyright (c) 2018 Michael Welsch
 #ifndef _METRIC_DISTANCE_K_STRUCTURED_SSIM_CPP
 #define _METRIC_DISTANCE_K_STRUCTURED_SSIM_CPP
 #include "SSIM.hpp"
+#include "../../utils/parallel.hpp"
+#include <algorithm>
+#include <array>
 #include <cmath>
+#include <stdexcept>
+#include <utility>
 #include <vector>
 
 #ifndef M_PI
@@ -40,6 +45,219 @@ namespace SSIM_details {
         }
         return gauss;
     }
+
+    // side of the Gaussian window
+    constexpr std::size_t window = 11;
+
+    // number of output rows filtered at once, it bounds the plane buffers to strip_rows + window - 1 rows
+    constexpr std::size_t strip_rows = 32;
+
+    // fewer windows than this in a whole batch are evaluated by the calling thread, starting threads costs more
+    constexpr std::size_t parallel_windows = std::size_t(1) << 16;
+
+    // rows and columns of an image, throws unless it is at least one window large and has rows of equal length
+    template <typename Container>
+    std::pair<std::size_t, std::size_t> image_size(const Container& img)
+    {
+        if (img.size() < window || img[0].size() < window) {
+            throw std::invalid_argument("SSIM: images must have at least 11 rows and 11 columns");
+        }
+        const std::size_t cols = img[0].size();
+        for (const auto& row : img) {
+            if (row.size() != cols) {
+                throw std::invalid_argument("SSIM: all rows of an image must have the same length");
+            }
+        }
+        return { img.size(), cols };
+    }
+
+    // normalized 1D factor of the gaussian_blur(window) filter, which is the outer product of it with itself
+    inline const std::array<double, window>& gaussian_kernel()
+    {
+        static const std::array<double, window> kernel = [] {
+            std::array<double, window> gauss;
+            const int d = window / 2;
+            double Norm = 0.0;
+            for (int x = 0; x < int(window); x++) {
+                gauss[x] = std::exp(-double((x - d) * (x - d)) / 2.25);
+                Norm += gauss[x];
+            }
+            for (auto& g : gauss) {
+                g /= Norm;
+            }
+            return gauss;
+        }();
+        return kernel;
+    }
+
+    // out[j] = sum_x kernel[x] * in[j + x], the inner loops run over j so that they vectorize
+    inline void filter_row(const double* in, double* out, std::size_t size)
+    {
+        const auto& gauss = gaussian_kernel();
+        for (std::size_t j = 0; j < size; ++j) {
+            out[j] = gauss[0] * in[j];
+        }
+        for (std::size_t x = 1; x < window; ++x) {
+            const double g = gauss[x];
+            const double* shifted = in + x;
+            for (std::size_t j = 0; j < size; ++j) {
+                out[j] += g * shifted[j];
+            }
+        }
+    }
+
+    // out[j] = sum_y kernel[y] * in[y * stride + j]
+    inline void filter_column(const double* in, std::size_t stride, double* out, std::size_t size)
+    {
+        const auto& gauss = gaussian_kernel();
+        for (std::size_t j = 0; j < size; ++j) {
+            out[j] = gauss[0] * in[j];
+        }
+        for (std::size_t y = 1; y < window; ++y) {
+            const double g = gauss[y];
+            const double* shifted = in + y * stride;
+            for (std::size_t j = 0; j < size; ++j) {
+                out[j] += g * shifted[j];
+            }
+        }
+    }
+    // constants of the local distance, fixed per metric object
+    struct Constants {
+        double C1;
+        double C2;
+        double C3;
+        double sscale;
+        double mask;
+        bool is_visibility;
+    };
+
+    inline Constants make_constants(double dynamic_range, double masking)
+    {
+        Constants c;
+        c.is_visibility = (masking < 2.0);  // use stabilizer
+        c.mask = masking;
+        c.C1 = std::pow(0.01 /*K1*/ * dynamic_range, 2);
+        c.C2 = std::pow(0.03 /*K2*/ * dynamic_range, 2);
+        c.sscale = window * window;
+        c.C3 = c.C2 * std::pow(c.sscale, 2.0 / c.mask - 1.0);  // scaling
+        return c;
+    }
+
+    /**
+     * @brief square root of the local ssim distance of the window at row i, column j
+     *
+     * @param mu1, mu2 filtered pixel values of the window
+     * @param sigma1, sigma2 filtered squared pixel values of the window
+     */
+    template <typename Container>
+    double local_distance(const Container& img1, const Container& img2, std::size_t i, std::size_t j, double mu1,
+        double mu2, double sigma1, double sigma2, const Constants& c)
+    {
+        const auto& gauss = gaussian_kernel();
+        const double mask = c.mask;
+
+        double visibility = 1;  // default
+        if (c.is_visibility) {
+            double l2norm1 = 0.0;
+            double l2norm2 = 0.0;
+            double lpnorm1 = 0.0;
+            double lpnorm2 = 0.0;
+            for (size_t y = 0; y < window; y++) {
+                const auto& row1 = img1[i + y];
+                const auto& row2 = img2[i + y];
+                for (size_t x = 0; x < window; x++) {
+                    double valv = gauss[y] * gauss[x] * c.sscale;
+                    double v1 = std::abs(row1[j + x] - mu1);
+                    double v2 = std::abs(row2[j + x] - mu2);
+                    l2norm1 += v1 * v1 * valv;
+                    l2norm2 += v2 * v2 * valv;
+                    lpnorm1 += (mask == 1.0 ? v1 : std::pow(v1, mask)) * valv;
+                    lpnorm2 += (mask == 1.0 ? v2 : std::pow(v2, mask)) * valv;
+                }
+            }
+            lpnorm1 = std::pow(lpnorm1, 2.0 / mask);
+            lpnorm2 = std::pow(lpnorm2, 2.0 / mask);
+            visibility = (l2norm1 + l2norm2 + c.C3) / (lpnorm1 + lpnorm2 + c.C3);
+            visibility = std::pow(visibility, mask / 2.0);
+
+            if (visibility > 1) {
+                visibility = 1;
+            } else if (visibility < 0) {
+                visibility = 0;
+            }
+        }
+
+        sigma1 -= mu1 * mu1;
+        sigma2 -= mu2 * mu2;
+
+        if (sigma1 < 0) {
+            sigma1 = 0;
+        }
+        if (sigma2 < 0) {
+            sigma2 = 0;
+        }
+
+        const double sigma12 = std::sqrt(sigma1 * sigma2);
+
+        // Structural Indicies
+        const double S1 = (2.0 * mu1 * mu2 + c.C1) / (mu1 * mu1 + mu2 * mu2 + c.C1);
+        const double S2 = (2.0 * sigma12 + c.C2) / (sigma1 + sigma2 + c.C2);
+
+        // sum up the local ssim_distance
+        const double value = 2.0 - S1 - S2;
+        return value > 0.0 ? std::sqrt(value) : 0.0;
+    }
+
+    // per thread buffers of the strip filter, they only grow
+    struct Scratch {
+        std::vector<double> line;
+        std::vector<double> horizontal;
+        std::vector<double> vertical;
+    };
+
+    inline Scratch& scratch()
+    {
+        thread_local Scratch buffers;
+        return buffers;
+    }
+
+    // an image filtered with the Gaussian window: local means and local means of the squares, row major
+    struct Filtered {
+        std::vector<double> mean;
+        std::vector<double> square;
+    };
+
+    // the same row and column passes as the strips of SSIM::operator(), over the whole image at once
+    template <typename Container>
+    void filter_image(const Container& img, Filtered& filtered)
+    {
+        const size_t rows = img.size();
+        const size_t cols = img[0].size();
+        const size_t out_rows = rows - window + 1;
+        const size_t out_cols = cols - window + 1;
+
+        auto& buffers = scratch();
+        buffers.line.resize(2 * cols);
+        buffers.horizontal.resize(2 * rows * out_cols);
+        double* line = buffers.line.data();
+        double* horizontal = buffers.horizontal.data();
+        for (size_t r = 0; r < rows; ++r) {
+            for (size_t c = 0; c < cols; ++c) {
+                const double k = img[r][c];
+                line[c] = k;
+                line[cols + c] = k * k;
+            }
+            filter_row(line, &horizontal[r * out_cols], out_cols);
+            filter_row(line + cols, &horizontal[(rows + r) * out_cols], out_cols);
+        }
+
+        filtered.mean.resize(out_rows * out_cols);
+        filtered.square.resize(out_rows * out_cols);
+        for (size_t i = 0; i < out_rows; ++i) {
+            filter_column(&horizontal[i * out_cols], out_cols, &filtered.mean[i * out_cols], out_cols);
+            filter_column(&horizontal[(rows + i) * out_cols], out_cols, &filtered.square[i * out_cols], out_cols);
+        }
+    }
 }  // namespace SSIM_details
 
 namespace detail {
@@ -63,99 +281,130 @@ auto SSIM<D, V>::operator()(const Container& img1, const Container& img2) const
     if constexpr (is_vec_of_vec<Container>() != true) {
         static_assert(true, "container should be 2D");
     } else {
-        double sum = 0.0;
-        bool is_visibility = (masking < 2.0);  // use stabilizer
-
-        // create gaussian filter matrix
-        size_t n = 11;
-        auto gauss = SSIM_details::gaussian_blur(n);
-
-        double C1 = std::pow(0.01 /*K1*/ * dynamic_range, 2);
-        double C2 = std::pow(0.03 /*K2*/ * dynamic_range, 2);
-
-        for (size_t i = 0; i < img1.size() - n + 1; ++i) {
-            for (size_t j = 0; j < img1[0].size() - n + 1; ++j) {
-                // initialize values
-                double mu1 = 0.0, mu2 = 0.0;
-                double sigma1 = 0.0, sigma2 = 0;
-                double corr = 0.0, sigma12 = 0;
-                double S1 = 0;
-                double S2 = 0;
-
-                for (size_t y = 0; y < n; y++) {
-                    for (size_t x = 0; x < n; x++) {
-                        double k1 = img1[i + y][j + x];
-                        double k2 = img2[i + y][j + x];
-                        double valv = gauss[y][x];
-                        mu1 += k1 * valv;
-                        mu2 += k2 * valv;
-                        sigma1 += k1 * k1 * valv;
-                        sigma2 += k2 * k2 * valv;
-                        corr += k1 * k2 * valv;
-                    }
-                }
+        const size_t n = SSIM_details::window;
+        const auto size = SSIM_details::image_size(img1);
+        if (SSIM_details::image_size(img2) != size) {
+            throw std::invalid_argument("SSIM: the images must have the same size");
+        }
+        const auto constants = SSIM_details::make_constants(dynamic_range, masking);
+
+        const size_t cols = size.second;
+        const size_t out_rows = size.first - n + 1;
+        const size_t out_cols = cols - n + 1;
+        const size_t plane_rows = SSIM_details::strip_rows + n - 1;
+
+        std::vector<double> partial_sums(thread_count(threads), 0.0);
+        const size_t chunks = parallel_for(out_rows, threads, [&](size_t begin, size_t end, size_t chunk) {
+            // four planes: both images and their squares, first as read, then filtered along rows and columns
+            auto& buffers = SSIM_details::scratch();
+            buffers.line.resize(4 * cols);
+            buffers.horizontal.resize(4 * plane_rows * out_cols);
+            buffers.vertical.resize(4 * out_cols);
+            double* line = buffers.line.data();
+            double* horizontal = buffers.horizontal.data();
+            double* vertical = buffers.vertical.data();
+            double sum = 0.0;
 
-                double visibility = 1;  // default
-                if (is_visibility) {
-                    double l2norm1 = 0.0;
-                    double l2norm2 = 0.0;
-                    double lpnorm1 = 0.0;
-                    double lpnorm2 = 0.0;
-                    double sscale = n * n;
-                    double C3 = C2 * std::pow(sscale, 2.0 / masking - 1.0);  // scaling
-                    for (size_t y = 0; y < n; y++) {
-                        for (size_t x = 0; x < n; x++) {
-                            double k1 = img1[i + y][j + x];
-                            double k2 = img2[i + y][j + x];
-                            double valv = gauss[y][x] * sscale;
-                            double v1 = k1 - mu1;
-                            double v2 = k2 - mu2;
-                            l2norm1 += v1 * v1 * valv;
-                            l2norm2 += v2 * v2 * valv;
-                            lpnorm1 += std::pow(std::abs(v1), masking) * valv;
-                            lpnorm2 += std::pow(std::abs(v2), masking) * valv;
-                        }
+            for (size_t strip = begin; strip < end; strip += SSIM_details::strip_rows) {
+                const size_t strip_end = std::min(strip + SSIM_details::strip_rows, end);
+
+                for (size_t r = 0; r < strip_end - strip + n - 1; ++r) {
+                    const auto& row1 = img1[strip + r];
+                    const auto& row2 = img2[strip + r];
+                    for (size_t c = 0; c < cols; ++c) {
+                        const double k1 = row1[c];
+                        const double k2 = row2[c];
+                        line[c] = k1;
+                        line[cols + c] = k2;
+                        line[2 * cols + c] = k1 * k1;
+                        line[3 * cols + c] = k2 * k2;
                     }
-                    lpnorm1 = std::pow(lpnorm1, 2.0 / masking);
-                    lpnorm2 = std::pow(lpnorm2, 2.0 / masking);
-                    visibility = (l2norm1 + l2norm2 + C3) / (lpnorm1 + lpnorm2 + C3);
-                    visibility = std::pow(visibility, masking / 2.0);
-
-                    if (visibility > 1) {
-                        visibility = 1;
-                    } else if (visibility < 0) {
-                        visibility = 0;
+                    for (size_t p = 0; p < 4; ++p) {
+                        SSIM_details::filter_row(
+                            &line[p * cols], &horizontal[(p * plane_rows + r) * out_cols], out_cols);
                     }
                 }
 
-                sigma1 -= mu1 * mu1;
-                sigma2 -= mu2 * mu2;
-                corr -= mu1 * mu2;
+                for (size_t i = strip; i < strip_end; ++i) {
+                    for (size_t p = 0; p < 4; ++p) {
+                        SSIM_details::filter_column(&horizontal[(p * plane_rows + i - strip) * out_cols], out_cols,
+                            &vertical[p * out_cols], out_cols);
+                    }
 
-                if (sigma1 < 0) {
-                    sigma1 = 0;
-                }
-                if (sigma2 < 0) {
-                    sigma2 = 0;
+                    for (size_t j = 0; j < out_cols; ++j) {
+                        sum += SSIM_details::local_distance(img1, img2, i, j, vertical[j], vertical[out_cols + j],
+                            vertical[2 * out_cols + j], vertical[3 * out_cols + j], constants);
+                    }
                 }
+            }
+            partial_sums[chunk] = sum;
+        });
 
-                sigma12 = std::sqrt(sigma1 * sigma2);
+        double sum = 0.0;
+        for (size_t chunk = 0; chunk < chunks; ++chunk) {
+            sum += partial_sums[chunk];
+        }
+        return sum / (out_rows * out_cols);  // normalize the sum
+    }
+    return distance_type {};
+}
 
-                // Structural Indicies
-                S1 = (2.0 * mu1 * mu2 + C1) / (mu1 * mu1 + mu2 * mu2 + C1);
-                S2 = (2.0 * sigma12 + C2) / (sigma1 + sigma2 + C2);
+template <typename D, typename V>
+template <typename Container, typename Matrix>
+void SSIM<D, V>::batch(const std::vector<Container>& queries, const std::vector<Container>& references, Matrix& out,
+    std::size_t threads) const
+{
+    static_assert(is_vec_of_vec<Container>(), "container should be 2D");
+    out.resize(queries.size(), references.size());
+    if (queries.empty() || references.empty()) {
+        return;
+    }
 
-                // sum up the local ssim_distance
-                double value = 2.0 - S1 - S2;
-                if (value > 0.0) {
-                    sum += std::sqrt(value);
-                }
+    // every pair is compared window by window, so all images must have the size of the first one
+    const auto size = SSIM_details::image_size(queries[0]);
+    for (const auto* images : { &queries, &references }) {
+        for (const auto& img : *images) {
+            if (SSIM_details::image_size(img) != size) {
+                throw std::invalid_argument("SSIM: all images of a batch must have the same size");
             }
         }
-
-        return sum / ((img1.size() - n + 1) * (img1[0].size() - n + 1));  // normalize the sum
     }
-    return distance_type {};
+    const size_t out_rows = size.first - SSIM_details::window + 1;
+    const size_t out_cols = size.second - SSIM_details::window + 1;
+    if (queries.size() * references.size() * out_rows * out_cols < SSIM_details::parallel_windows) {
+        threads = 1;
+    }
+
+    // the filtered planes of an image do not depend on the image it is compared with
+    std::vector<SSIM_details::Filtered> filtered_queries(queries.size());
+    std::vector<SSIM_details::Filtered> filtered_references(references.size());
+    parallel_for(queries.size() + references.size(), threads, [&](size_t begin, size_t end, size_t) {
+        for (size_t k = begin; k < end; ++k) {
+            if (k < queries.size()) {
+                SSIM_details::filter_image(queries[k], filtered_queries[k]);
+            } else {
+                SSIM_details::filter_image(references[k - queries.size()], filtered_references[k - queries.size()]);
+            }
+        }
+    });
+
+    const auto constants = SSIM_details::make_constants(dynamic_range, masking);
+    parallel_grid(queries.size(), references.size(), threads, [&](size_t q, size_t r) {
+        const auto& img1 = queries[q];
+        const auto& img2 = references[r];
+        const auto& f1 = filtered_queries[q];
+        const auto& f2 = filtered_references[r];
+
+        double sum = 0.0;
+        for (size_t i = 0; i < out_rows; ++i) {
+            for (size_t j = 0; j < out_cols; ++j) {
+                const size_t k = i * out_cols + j;
+                sum += SSIM_details::local_distance(
+                    img1, img2, i, j, f1.mean[k], f2.mean[k], f1.square[k], f2.square[k], constants);
+            }
+        }
+        out(q, r) = sum / (out_rows * out_cols);
+    }, 4);
 }
 
 }  // namespace metric
@@ -9,6 +9,9 @@ Copyright (c) 2018 Michael Welsch
 #ifndef _METRIC_DISTANCE_K_STRUCTURED_SSIM_HPP
 #define _METRIC_DISTANCE_K_STRUCTURED_SSIM_HPP
 
+#include <cstddef>
+#include <vector>
+
 namespace metric {
 
 /**
@@ -16,6 +19,8 @@ namespace metric {
  *
  * @brief structural similarity (for images)
  *
+ * @details Local means and variances are computed with a separable 11x11 Gaussian filter over contiguous planes.
+ * The image is processed in strips of rows, optionally split between threads.
  */
 template <typename D, typename V> // added D as distance_type (to get f.e. double distance for int values of pixels) -> Stepan Mamontov
 struct SSIM {
@@ -29,10 +34,13 @@ struct SSIM {
      *
      * @param dynamic_range_  dynamic range of the pixel values
      * @param masking_
+     * @param threads_ number of threads splitting the image rows, 0 means one per hardware thread
      */
-    SSIM(const typename V::value_type dynamic_range_, const typename V::value_type masking_)
+    SSIM(const typename V::value_type dynamic_range_, const typename V::value_type masking_,
+        std::size_t threads_ = 1)
         : dynamic_range(dynamic_range_)
         , masking(masking_)
+        , threads(threads_)
     {
     }
 
@@ -42,12 +50,31 @@ struct SSIM {
      * @param img1 first image
      * @param img2 second image
      * @return  structural similarity
+     * @throws std::invalid_argument if the images differ in size or are smaller than the 11x11 window
      */
     template <typename Container>
     distance_type operator()(const Container& img1, const Container& img2) const;
 
+    /**
+     * @brief Calculate structural similarity between every query image and every reference image
+     *
+     * @details Every image is filtered once for the whole batch instead of once per pair, so the batch keeps two
+     * planes of the image size per image. Each pair is then evaluated by one thread; the results equal those of
+     * operator() with threads = 1. Batches of fewer than 2^16 windows in all pairs run on the calling thread.
+     *
+     * @param queries first images
+     * @param references second images, of the same size as the queries
+     * @param out matrix resized to queries.size() x references.size(), e.g. blaze::DynamicMatrix<distance_type>
+     * @param threads number of threads, 0 means one per hardware thread
+     * @throws std::invalid_argument if the images differ in size or are smaller than the 11x11 window
+     */
+    template <typename Container, typename Matrix>
+    void batch(const std::vector<Container>& queries, const std::vector<Container>& references, Matrix& out,
+        std::size_t threads = 1) const;
+
     typename V::value_type dynamic_range = 255.0;
     typename V::value_type masking = 2.0;
+    std::size_t threads = 1;
 };
 
 }  // namespace metric
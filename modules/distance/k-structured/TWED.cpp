@@ -8,78 +8,156 @@ Copyright (c) 2018 Michael Welsch
 #ifndef _METRIC_DISTANCE_K_STRUCTURED_TWED_CPP
 #define _METRIC_DISTANCE_K_STRUCTURED_TWED_CPP
 #include "TWED.hpp"
+#include "../../utils/parallel.hpp"
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <tuple>
+#include <utility>
 #include <vector>
 
 namespace metric {
 
-/*** distance measure with time elastic cost matrix. ***/
-template <typename V>
-template <typename Container>
-auto TWED<V>::operator()(const Container& As, const Container& Bs) const -> distance_type
-{
-    std::vector<value_type> A;
-    A.reserve(As.size());
-    std::vector<value_type> timeA;
-    timeA.reserve(As.size());
-
-    std::vector<value_type> B;
-    B.reserve(Bs.size());
-
-    std::vector<value_type> timeB;
-    timeB.reserve(Bs.size());
+namespace TWED_details {
 
-    for (auto it = As.cbegin(); it != As.cend(); ++it) {
-        if constexpr(std::is_same<blaze::CompressedVector<V>, Container>::value) {
-                timeA.push_back(it->index());  // Read access to the index of the non-zero element.
-                A.push_back(it->value());  // Read access to the value of the non-zero element.
+    // number of samples, for sparse vectors only the non zero elements are samples
+    template <typename Container>
+    std::size_t count(const Container& c)
+    {
+        if constexpr (blaze::IsSparseVector_v<Container>) {
+            return c.nonZeros();
         } else {
-            timeA.push_back(std::distance(As.begin(), it));  // Read access to the index of the non-zero element.
-            A.push_back(*it);  // Read access to the value of the non-zero element.
+            return c.size();
         }
     }
 
-    for (auto it = Bs.cbegin(); it != Bs.cend(); ++it) {
-        if constexpr (std::is_same<blaze::CompressedVector<V>, Container>::value) {
-            timeB.push_back(it->index());  // Read access to the index of the non-zero element.
-            B.push_back(it->value());  // Read access to the value of the non-zero element.
+    // value and time of the sample at the iterator, dense containers are sampled at their positions
+    template <typename V, typename Container, typename Iterator>
+    std::pair<V, V> sample(const Iterator& it, std::size_t position)
+    {
+        if constexpr (blaze::IsSparseVector_v<Container>) {
+            return { it->value(), V(it->index()) };
         } else {
-            timeB.push_back(std::distance(Bs.begin(), it));  // Read access to the index of the non-zero element.
-            B.push_back(*it);  // Read access to the value of the non-zero element.
+            return { *it, V(position) };
+        }
+    }
+
+    // per thread DP rows, they only grow, so calls do not allocate once the rows fit the longest input seen
+    template <typename V>
+    struct Scratch {
+        std::vector<V> D0;
+        std::vector<V> Di;
+    };
+
+    template <typename V>
+    Scratch<V>& scratch()
+    {
+        thread_local Scratch<V> buffers;
+        return buffers;
+    }
+
+}  // namespace TWED_details
+
+/*** distance measure with time elastic cost matrix. ***/
+template <typename V>
+template <typename Container>
+auto TWED<V>::operator()(const Container& As, const Container& Bs) const -> distance_type
+{
+    return this->operator()(As, Bs, std::numeric_limits<distance_type>::max());
+}
+
+template <typename V>
+template <typename Container>
+auto TWED<V>::operator()(const Container& As, const Container& Bs, distance_type upper_bound) const
+    -> distance_type
+{
+    // with non negative costs every path to the last cell crosses each row, so a row minimum is a lower bound
+    const bool can_abandon = penalty >= 0 && elastic >= 0;
+    if (can_abandon && upper_bound < std::numeric_limits<distance_type>::max()) {
+        const value_type bound = lower_bound(As, Bs);
+        if (bound > upper_bound) {
+            return bound;
         }
     }
 
     value_type C1, C2, C3;
 
-    int sizeB = B.size();
-    int sizeA = A.size();
+    const int sizeA = TWED_details::count(As);
+    const int sizeB = TWED_details::count(Bs);
+
+    // cells further than w from the diagonal are not evaluated
+    const int w = band == 0 ? std::max(sizeA, sizeB) : std::max(int(band), std::abs(sizeA - sizeB));
+    const value_type out_of_band = std::numeric_limits<value_type>::max() / 2;
+
+    auto& buffers = TWED_details::scratch<value_type>();
+    if (int(buffers.D0.size()) < sizeB + 1) {
+        buffers.D0.resize(sizeB + 1);
+        buffers.Di.resize(sizeB + 1);
+    }
+    value_type* D0 = buffers.D0.data();
+    value_type* Di = buffers.Di.data();
 
-    std::vector<value_type> D0(sizeB);
-    std::vector<value_type> Di(sizeB);
+    auto itA = As.cbegin();
+    auto [a_prev, timeA_prev] = TWED_details::sample<value_type, Container>(itA, 0);
+    auto itB = Bs.cbegin();
+    auto [b_prev, timeB_prev] = TWED_details::sample<value_type, Container>(itB, 0);
 
     // first element
-    D0[0] = std::abs(A[0] - B[0]) + elastic * (std::abs(timeA[0] - 0));  // C3
+    D0[0] = std::abs(a_prev - b_prev) + elastic * (std::abs(timeA_prev - 0));  // C3
 
     // first row
-    for (int j = 1; j < sizeB; j++) {
-        D0[j] = D0[j - 1] + std::abs(B[j - 1] - B[j]) + elastic * (timeB[j] - timeB[j - 1]) + penalty;  // C2
+    const int first_hi = std::min(sizeB - 1, w);
+    for (int j = 1; j <= first_hi; j++) {
+        const auto [b, timeB] = TWED_details::sample<value_type, Container>(++itB, j);
+        D0[j] = D0[j - 1] + std::abs(b_prev - b) + elastic * (timeB - timeB_prev) + penalty;  // C2
+        b_prev = b;
+        timeB_prev = timeB;
     }
+    D0[first_hi + 1] = out_of_band;
+
+    // the sample before the band, moved forward with it so that the rows cost no seeks on forward iterators
+    auto bandB = Bs.cbegin();
+    int bandPosition = 0;
 
     // second-->last row
     for (int i = 1; i < sizeA; i++) {
+        const auto [a, timeA] = TWED_details::sample<value_type, Container>(++itA, i);
+        const value_type deltaA = std::abs(a_prev - a);
+        const value_type elasticA = elastic * (timeA - timeA_prev);
+        const int lo = std::max(1, i - w);
+        const int hi = std::min(sizeB - 1, i + w);
+
         // every first element in row
-        Di[0] = D0[0] + std::abs(A[i - 1] - A[i]) + elastic * (timeA[i] - timeA[i - 1]) + penalty;  // C1
+        Di[0] = i <= w ? D0[0] + deltaA + elasticA + penalty : out_of_band;  // C1
+        value_type row_min = Di[0];
+        if (lo > 1) {
+            Di[lo - 1] = out_of_band;
+        }
 
         // remaining elements in row
-        for (int j = 1; j < sizeB; j++) {
-            C1 = D0[j] + std::abs(A[i - 1] - A[i]) + elastic * (timeA[i] - timeA[i - 1]) + penalty;
-            C2 = Di[j - 1] + std::abs(B[j - 1] - B[j]) + elastic * (timeB[j] - timeB[j - 1]) + penalty;
-            C3 = D0[j - 1] + std::abs(A[i] - B[j]) + std::abs(A[i - 1] - B[j - 1])
-                + elastic * (std::abs(timeA[i] - timeB[j]) + std::abs(timeA[i - 1] - timeB[j - 1]));
+        for (; bandPosition < lo - 1; ++bandPosition) {
+            ++bandB;
+        }
+        itB = bandB;
+        std::tie(b_prev, timeB_prev) = TWED_details::sample<value_type, Container>(itB, lo - 1);
+        for (int j = lo; j <= hi; j++) {
+            const auto [b, timeB] = TWED_details::sample<value_type, Container>(++itB, j);
+            C1 = D0[j] + deltaA + elasticA + penalty;
+            C2 = Di[j - 1] + std::abs(b_prev - b) + elastic * (timeB - timeB_prev) + penalty;
+            C3 = D0[j - 1] + std::abs(a - b) + std::abs(a_prev - b_prev)
+                + elastic * (std::abs(timeA - timeB) + std::abs(timeA_prev - timeB_prev));
             Di[j] = (C1 < ((C2 < C3) ? C2 : C3)) ? C1 : ((C2 < C3) ? C2 : C3);  // Di[j] = std::min({C1,C2,C3});
-            //std::cout << Di[j] << " [" << C1 << " " << C2 << " " << C3 << "] |  "; // code for debug, added by Max F
+            row_min = Di[j] < row_min ? Di[j] : row_min;
+            b_prev = b;
+            timeB_prev = timeB;
+        }
+        Di[hi + 1] = out_of_band;
+        if (can_abandon && row_min > upper_bound) {
+            return row_min;
         }
-        //std::cout << "\n"; // code for debug, added by Max F
         std::swap(D0, Di);
+        a_prev = a;
+        timeA_prev = timeA;
     }
 
     distance_type rvalue = D0[sizeB - 1];
@@ -87,6 +165,37 @@ auto TWED<V>::operator()(const Container& As, const Container& Bs) const -> dist
     return rvalue;
 }
 
+template <typename V>
+template <typename Container>
+auto TWED<V>::lower_bound(const Container& As, const Container& Bs) const -> distance_type
+{
+    if (penalty < 0 || elastic < 0) {
+        return std::numeric_limits<value_type>::lowest();
+    }
+    const int sizeA = TWED_details::count(As);
+    const int sizeB = TWED_details::count(Bs);
+
+    const auto [a0, timeA0] = TWED_details::sample<value_type, Container>(As.cbegin(), 0);
+    const auto [b0, timeB0] = TWED_details::sample<value_type, Container>(Bs.cbegin(), 0);
+    const value_type first = std::abs(a0 - b0) + elastic * (std::abs(timeA0 - 0));
+
+    // at least |sizeA - sizeB| steps are not diagonal and each of them costs at least the penalty
+    value_type rest = penalty * std::abs(sizeA - sizeB);
+    if (sizeA > 1 && sizeB > 1) {
+        // every path ends with one of the three steps into the last cell
+        const auto [a1, timeA1] = TWED_details::sample<value_type, Container>(std::prev(As.cend(), 2), sizeA - 2);
+        const auto [a2, timeA2] = TWED_details::sample<value_type, Container>(std::prev(As.cend()), sizeA - 1);
+        const auto [b1, timeB1] = TWED_details::sample<value_type, Container>(std::prev(Bs.cend(), 2), sizeB - 2);
+        const auto [b2, timeB2] = TWED_details::sample<value_type, Container>(std::prev(Bs.cend()), sizeB - 1);
+        const value_type C1 = std::abs(a1 - a2) + elastic * (timeA2 - timeA1) + penalty;
+        const value_type C2 = std::abs(b1 - b2) + elastic * (timeB2 - timeB1) + penalty;
+        const value_type C3 = std::abs(a2 - b2) + std::abs(a1 - b1)
+            + elastic * (std::abs(timeA2 - timeB2) + std::abs(timeA1 - timeB1));
+        rest = std::max(rest, std::min({ C1, C2, C3 }));
+    }
+    return first + rest;
+}
+
 namespace TWED_details {
     /** add zero padding to sparsed vector (preprocessing for time elatic distance) **/
     template <typename T>
@@ -145,5 +254,15 @@ namespace TWED_details {
 
 }  // namespace TWED_details
 
+template <typename V>
+template <typename Container, typename Matrix>
+void TWED<V>::batch(const std::vector<Container>& queries, const std::vector<Container>& references, Matrix& out,
+    std::size_t threads) const
+{
+    out.resize(queries.size(), references.size());
+    parallel_grid(queries.size(), references.size(), threads,
+        [&](std::size_t i, std::size_t j) { out(i, j) = (*this)(queries[i], references[j]); });
+}
+
 }  // namespace metric
 #endif  // header guard
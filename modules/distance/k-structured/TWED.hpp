@@ -10,6 +10,9 @@ Copyright (c) 2018 Michael Welsch
 
 #include "../../../3rdparty/blaze/Math.h"
 
+#include <cstddef>
+#include <vector>
+
 namespace metric {
 
 /**
@@ -27,10 +30,13 @@ struct TWED {
      *
      * @param penalty_
      * @param elastic_
+     * @param band_ Sakoe-Chiba band radius, 0 means no band. The band is widened to the length difference of the
+     * inputs; a banded distance is never smaller than the unbanded one
      */
-    TWED(const value_type& penalty_ = 0, const value_type& elastic_ = 1)
+    TWED(const value_type& penalty_ = 0, const value_type& elastic_ = 1, std::size_t band_ = 0)
         : penalty(penalty_)
         , elastic(elastic_)
+        , band(band_)
     {
     }
 
@@ -44,8 +50,50 @@ struct TWED {
     template <typename Container>
     value_type operator()(const Container& As, const Container& Bs) const;
 
+    /**
+     * @brief Calculate TWE distance between given containers, abandoning as soon as it exceeds upper_bound
+     *
+     * @param As first container
+     * @param Bs second container
+     * @param upper_bound largest distance of interest
+     * @return TWE distance between given containers if it does not exceed upper_bound, otherwise some value
+     * greater than upper_bound
+     */
+    template <typename Container>
+    value_type operator()(const Container& As, const Container& Bs, distance_type upper_bound) const;
+
+    /**
+     * @brief Calculate a lower bound of the TWE distance in constant time
+     *
+     * @details The bound is the cost of the first cell plus the larger of the cheapest last step and the penalties
+     * of the unavoidable non diagonal steps. It is only meaningful for non negative penalty and elastic, otherwise
+     * the lowest value of value_type is returned.
+     *
+     * @param As first container
+     * @param Bs second container
+     * @return value not greater than the TWE distance between given containers
+     */
+    template <typename Container>
+    value_type lower_bound(const Container& As, const Container& Bs) const;
+
+    /**
+     * @brief Calculate the distances between every query and every reference
+     *
+     * @details The pairs are evaluated in tiles, the query rows are split between threads. Every thread reuses its own dynamic
+     * programming rows.
+     *
+     * @param queries first records
+     * @param references second records
+     * @param out matrix resized to queries.size() x references.size(), e.g. blaze::DynamicMatrix<distance_type>
+     * @param threads number of threads, 0 means one per hardware thread
+     */
+    template <typename Container, typename Matrix>
+    void batch(const std::vector<Container>& queries, const std::vector<Container>& references, Matrix& out,
+        std::size_t threads = 1) const;
+
     value_type penalty = 0;
     value_type elastic = 1;
+    std::size_t band = 0;
     bool is_zero_padded = false;
 };
 
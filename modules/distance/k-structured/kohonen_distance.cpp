@@ -8,33 +8,52 @@ Copyright (c) 2019 PANDA Team
 #ifndef _METRIC_DISTANCE_K_STRUCTURED_KOHONEN_CPP
 #define _METRIC_DISTANCE_K_STRUCTURED_KOHONEN_CPP
 #include "kohonen_distance.hpp"
+#include "../../utils/parallel.hpp"
 #include <boost/config.hpp>
 #include <boost/graph/graph_traits.hpp>
 #include <boost/graph/adjacency_list.hpp>
 #include <boost/graph/dijkstra_shortest_paths.hpp>
 #include <boost/property_map/property_map.hpp>
+#include <algorithm>
 #include <cmath>
+#include <functional>
+#include <limits>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
-#endif
-
 namespace metric {
+
+namespace kohonen_details {
+
+	// graphs up to this number of nodes get their shortest paths from Floyd-Warshall, larger ones from Dijkstra
+	constexpr size_t floyd_warshall_nodes = 64;
+
+	template <typename Metric>
+	struct is_euclidian : std::false_type {
+	};
+
+	template <typename V>
+	struct is_euclidian<Euclidian<V>> : std::true_type {
+	};
+
+}  // namespace kohonen_details
 	
 	
 template <typename D, typename Sample, typename Graph, typename Metric, typename Distribution>
-kohonen_distance<D, Sample, Graph, Metric, Distribution>::kohonen_distance(metric::SOM<Sample, Graph, Metric, Distribution> som_model) : som_model_(som_model)
+kohonen_distance<D, Sample, Graph, Metric, Distribution>::kohonen_distance(metric::SOM<Sample, Graph, Metric, Distribution> som_model, size_t threads) : som_model_(som_model)
 {
 	// calculate ground distance matrix between SOM nodes
 	//auto cost_mat = metric::EMD_details::ground_distance_matrix_of_2dgrid<typename Sample::value_type, Metric>(som_model_.get_weights());
 	//auto maxCost = metric::EMD_details::max_in_distance_matrix(cost_mat);
 	//emd_distance_ = metric::EMD<D>(cost_mat, maxCost);
 
-	calculate_distance_matrix();
+	calculate_distance_matrix(threads);
 }
 	
 
 template <typename D, typename Sample, typename Graph, typename Metric, typename Distribution>
-kohonen_distance<D, Sample, Graph, Metric, Distribution>::kohonen_distance(std::vector<Sample>& samples, size_t nodesWidth, size_t nodesHeight) : 
+kohonen_distance<D, Sample, Graph, Metric, Distribution>::kohonen_distance(std::vector<Sample>& samples, size_t nodesWidth, size_t nodesHeight, size_t threads) : 
 	som_model_(Graph(nodesWidth, nodesHeight), Metric(), 0.8, 0.2, 20)
 {
 	som_model_.train(samples);
@@ -44,13 +63,13 @@ kohonen_distance<D, Sample, Graph, Metric, Distribution>::kohonen_distance(std::
 	//auto maxCost = metric::EMD_details::max_in_distance_matrix(cost_mat);
 	//emd_distance_ = metric::EMD<D>(cost_mat, maxCost);
 
-	calculate_distance_matrix();
+	calculate_distance_matrix(threads);
 }
 	
 
 template <typename D, typename Sample, typename Graph, typename Metric, typename Distribution>
 kohonen_distance<D, Sample, Graph, Metric, Distribution>::kohonen_distance(std::vector<Sample>& samples, Graph graph, Metric metric, 
-	double start_learn_rate, double finish_learn_rate, size_t iterations, Distribution distribution) : 
+	double start_learn_rate, double finish_learn_rate, size_t iterations, Distribution distribution, size_t threads) : 
 	som_model_(graph, metric, start_learn_rate, finish_learn_rate, iterations, distribution)
 {
 	som_model_.train(samples);
@@ -60,40 +79,119 @@ kohonen_distance<D, Sample, Graph, Metric, Distribution>::kohonen_distance(std::
 	//auto maxCost = metric::EMD_details::max_in_distance_matrix(cost_mat);
 	//emd_distance_ = metric::EMD<D>(cost_mat, maxCost);
 	
-	calculate_distance_matrix();
+	calculate_distance_matrix(threads);
 }
 
 
 /*** distance measure on kohonen space. ***/
 template <typename D, typename Sample, typename Graph, typename Metric, typename Distribution>
-auto kohonen_distance<D, Sample, Graph, Metric, Distribution>::operator()(const Sample& sample_1, const Sample& sample_2) -> distance_return_type
+auto kohonen_distance<D, Sample, Graph, Metric, Distribution>::operator()(const Sample& sample_1, const Sample& sample_2) const -> distance_return_type
 {
 	// then we calculate distributions over SOM space for samples	
-	auto bmu_1 = som_model_.BMU(sample_1);
-	auto bmu_2 = som_model_.BMU(sample_2);
+	if (cache_->enabled) {
+		return ground_distance(cached_BMU(sample_1), cached_BMU(sample_2));
+	}
+	return ground_distance(BMU(sample_1), BMU(sample_2));
+}
+
+
+template <typename D, typename Sample, typename Graph, typename Metric, typename Distribution>
+size_t kohonen_distance<D, Sample, Graph, Metric, Distribution>::BMU(const Sample& sample) const
+{
+	if constexpr (kohonen_details::is_euclidian<Metric>::value) {
+		using T = typename Sample::value_type;
+		assert(sample.size() == dimensions_);
 
-	return distance_matrix_[bmu_1][bmu_2];
+		// summed in the distance type of the metric as Euclidian does, not in the type of the samples
+		using A = typename Metric::distance_type;
+		A min_distance = std::numeric_limits<A>::max();
+		size_t index = 0;
+		for (size_t i = 0; i < nodes_number_; ++i) {
+			const T* node = &nodes_[i * dimensions_];
+			A sum = 0;
+			size_t d = 0;
+			// partial sums are checked once per block of components, so the inner loop stays branch free
+			for (; d < dimensions_ && sum < min_distance; ) {
+				const size_t block_end = std::min(d + 8, dimensions_);
+				for (; d < block_end; ++d) {
+					const auto diff = sample[d] - node[d];
+					sum += diff * diff;
+				}
+			}
+			if (d == dimensions_ && sum < min_distance) {
+				min_distance = sum;
+				index = i;
+			}
+		}
+		return index;
+	} else {
+		return som_model_.BMU(sample);
+	}
 }
 
 
 template <typename D, typename Sample, typename Graph, typename Metric, typename Distribution>
-void kohonen_distance<D, Sample, Graph, Metric, Distribution>::calculate_distance_matrix()
+size_t kohonen_distance<D, Sample, Graph, Metric, Distribution>::cached_BMU(const Sample& sample) const
 {
-	
-	typedef boost::adjacency_list <boost::listS, boost::vecS, boost::undirectedS, boost::no_property, boost::property <boost::edge_weight_t, D>> Graph_t;
-	typedef typename boost::graph_traits <Graph_t>::vertex_descriptor Vertex_descriptor;
-	typedef std::pair<int, int> Edge;
+	size_t hash = sample.size();
+	for (const auto& value : sample) {
+		hash ^= std::hash<typename Sample::value_type>()(value) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+	}
+	auto same = [&sample](const Sample& other) {
+		return std::equal(sample.begin(), sample.end(), other.begin(), other.end());
+	};
+
+	// one lock per lookup: a miss searches the BMU holding the lock of its shard only
+	auto& cache = cache_->shard[hash % Cache::shards];
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	const auto found = cache.index.equal_range(hash);
+	for (auto it = found.first; it != found.second; ++it) {
+		if (same(cache.entries[it->second].sample)) {
+			return cache.entries[it->second].bmu;
+		}
+	}
+
+	const size_t bmu = BMU(sample);
+	if (cache.capacity == 0) {
+		return bmu;
+	}
+	if (cache.entries.size() < cache.capacity) {
+		cache.entries.push_back({ hash, sample, bmu });
+		cache.index.emplace(hash, cache.entries.size() - 1);
+		return bmu;
+	}
+	// the oldest entry makes room
+	const size_t slot = cache.next;
+	cache.next = (cache.next + 1) % cache.capacity;
+	const auto range = cache.index.equal_range(cache.entries[slot].hash);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second == slot) {
+			cache.index.erase(it);
+			break;
+		}
+	}
+	cache.entries[slot] = { hash, sample, bmu };
+	cache.index.emplace(hash, slot);
+	return bmu;
+}
+
 
+template <typename D, typename Sample, typename Graph, typename Metric, typename Distribution>
+void kohonen_distance<D, Sample, Graph, Metric, Distribution>::calculate_distance_matrix(size_t threads)
+{
 	std::vector<Sample> nodes = som_model_.get_weights();
+	nodes_number_ = nodes.size();
+	dimensions_ = nodes_number_ > 0 ? nodes[0].size() : 0;
 
-	std::vector<int> nodes_list(nodes.size());
-	std::iota(nodes_list.begin(), nodes_list.end(), 0);
-	
-	std::vector<Edge> edge_vector;
+	nodes_.resize(nodes_number_ * dimensions_);
+	for (size_t i = 0; i < nodes_number_; ++i) {
+		std::copy(nodes[i].begin(), nodes[i].end(), nodes_.begin() + i * dimensions_);
+	}
+
+	std::vector<std::pair<size_t, size_t>> edges;
 	std::vector<D> weights;
     Metric distance;
 
-	
 	auto matrix = som_model_.get_graph().get_matrix();
 	for (size_t i = 0; i < matrix.rows(); ++i) 
 	{
@@ -101,32 +199,83 @@ void kohonen_distance<D, Sample, Graph, Metric, Distribution>::calculate_distanc
 		{
 			if (matrix(i, j) > 0)
 			{
-				edge_vector.push_back(Edge(i, j));
+				edges.emplace_back(i, j);
 				weights.push_back(distance(nodes[i], nodes[j]));
 			}
 		}
 	}
 
-	Edge edge_array[edge_vector.size()];
-	std::copy(edge_vector.begin(), edge_vector.end(), edge_array);
-	int num_arcs = sizeof(edge_array) / sizeof(Edge);
-	Graph_t g(edge_array, edge_array + num_arcs, weights.data(), nodes_list.size());
-
-	typename boost::property_map<Graph_t, boost::edge_weight_t>::type weightmap = get(boost::edge_weight, g);
-	std::vector<Vertex_descriptor> p(num_vertices(g));
-	std::vector<D> d(num_vertices(g));
+	if (nodes_number_ <= kohonen_details::floyd_warshall_nodes) {
+		floyd_warshall(edges, weights);
+	} else {
+		dijkstra(edges, weights, threads);
+	}
+}
 
-	for (auto i = 0; i < nodes_list.size(); i++)
-	{
-		Vertex_descriptor s = vertex(nodes_list[i], g);
 
-		dijkstra_shortest_paths(g, s,
-								predecessor_map(boost::make_iterator_property_map(p.begin(), get(boost::vertex_index, g))).
-								distance_map(boost::make_iterator_property_map(d.begin(), get(boost::vertex_index, g))));
+template <typename D, typename Sample, typename Graph, typename Metric, typename Distribution>
+void kohonen_distance<D, Sample, Graph, Metric, Distribution>::floyd_warshall(
+	const std::vector<std::pair<size_t, size_t>>& edges, const std::vector<D>& weights)
+{
+	const size_t n = nodes_number_;
+	// unreachable nodes keep the largest value, as in the Dijkstra distance map
+	const D infinity = std::numeric_limits<D>::max();
+	distance_matrix_.assign(n * n, infinity);
+	for (size_t i = 0; i < n; ++i) {
+		distance_matrix_[i * n + i] = 0;
+	}
+	for (size_t e = 0; e < edges.size(); ++e) {
+		D& forward = distance_matrix_[edges[e].first * n + edges[e].second];
+		forward = std::min(forward, weights[e]);
+		distance_matrix_[edges[e].second * n + edges[e].first] = forward;
+	}
 
-		distance_matrix_.push_back(d);
+	for (size_t k = 0; k < n; ++k) {
+		const D* row_k = &distance_matrix_[k * n];
+		for (size_t i = 0; i < n; ++i) {
+			const D ik = distance_matrix_[i * n + k];
+			if (ik == infinity) {
+				continue;
+			}
+			D* row_i = &distance_matrix_[i * n];
+			for (size_t j = 0; j < n; ++j) {
+				if (row_k[j] != infinity && ik + row_k[j] < row_i[j]) {
+					row_i[j] = ik + row_k[j];
+				}
+			}
+		}
 	}
 }
 
+
+template <typename D, typename Sample, typename Graph, typename Metric, typename Distribution>
+void kohonen_distance<D, Sample, Graph, Metric, Distribution>::dijkstra(
+	const std::vector<std::pair<size_t, size_t>>& edges, const std::vector<D>& weights, size_t threads)
+{
+	typedef boost::adjacency_list <boost::listS, boost::vecS, boost::undirectedS, boost::no_property, boost::property <boost::edge_weight_t, D>> Graph_t;
+	typedef typename boost::graph_traits <Graph_t>::vertex_descriptor Vertex_descriptor;
+
+	const size_t n = nodes_number_;
+	const Graph_t g(edges.begin(), edges.end(), weights.begin(), n);
+	distance_matrix_.resize(n * n);
+
+	// the graph is only read, every thread runs its sources with its own predecessor and distance maps
+	parallel_for(n, threads, [&](size_t begin, size_t end, size_t) {
+		std::vector<Vertex_descriptor> p(n);
+		std::vector<D> d(n);
+		for (size_t i = begin; i < end; ++i)
+		{
+			Vertex_descriptor s = vertex(i, g);
+
+			dijkstra_shortest_paths(g, s,
+									predecessor_map(boost::make_iterator_property_map(p.begin(), get(boost::vertex_index, g))).
+									distance_map(boost::make_iterator_property_map(d.begin(), get(boost::vertex_index, g))));
+
+			std::copy(d.begin(), d.end(), distance_matrix_.begin() + i * n);
+		}
+	});
+}
+
 }  // namespace metric
 
+#endif
@@ -12,6 +12,13 @@ Copyright (c) 2018 Panda Team
 #include "../../mapping/SOM.hpp"
 #include "../../utils/graph.hpp"
 
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
 namespace metric {
 
 /**
@@ -25,6 +32,8 @@ namespace metric {
  * Then for every record, to get a vector of distances between all SOM nodes, it is weights for ground distances.
  * Having the vectors and ground distances we can compute EMD. It is a Kohonen distance.
  *
+ * The shortest paths between all SOM nodes are computed once at construction and stored in one contiguous matrix,
+ * so a distance costs two best matching unit searches and a lookup.
  */
 template <typename D, typename Sample, typename Graph = metric::Grid4, typename Metric = metric::Euclidian<D>, 
 	typename Distribution = std::uniform_real_distribution<typename Sample::value_type>> // D is a distance return type
@@ -35,8 +44,9 @@ struct kohonen_distance {
      * @brief Construct a new kohonen_distance object
      *
      * @param som_model - trained SOM model
+     * @param threads - number of threads used for the ground distance matrix, 0 means one per hardware thread
      */
-	kohonen_distance(metric::SOM<Sample, Graph, Metric, Distribution> som_model);
+	kohonen_distance(metric::SOM<Sample, Graph, Metric, Distribution> som_model, size_t threads = 1);
 
     /**
      * @brief Construct a new kohonen_distance object
@@ -44,8 +54,9 @@ struct kohonen_distance {
      * @param samples - samples for SOM train
      * @param nodesWidth - width of the SOM grid
      * @param nodesHeight - height of the SOM grid
+     * @param threads - number of threads used for the ground distance matrix, 0 means one per hardware thread
      */
-	kohonen_distance(std::vector<Sample>& samples, size_t nodesWidth, size_t nodesHeight);
+	kohonen_distance(std::vector<Sample>& samples, size_t nodesWidth, size_t nodesHeight, size_t threads = 1);
 
     /**
      * @brief Construct a new kohonen_distance object
@@ -57,9 +68,10 @@ struct kohonen_distance {
      * @param finish_learn_rate
      * @param iterations
      * @param distribution
+     * @param threads - number of threads used for the ground distance matrix, 0 means one per hardware thread
      */
 	kohonen_distance(std::vector<Sample>& samples, Graph graph, Metric metric = Metric(), double start_learn_rate = 0.8, double finish_learn_rate = 0.0, size_t iterations = 20, 
-		Distribution distribution = Distribution(-1, 1));
+		Distribution distribution = Distribution(-1, 1), size_t threads = 1);
 
     /**
      * @brief Compute the EMD for two records in the Kohonen space.
@@ -68,16 +80,102 @@ struct kohonen_distance {
      * @param sample_2 second sample
      * @return distance on kohonen space
      */
-    distance_return_type operator()(const Sample& sample_1, const Sample& sample_2);
+    distance_return_type operator()(const Sample& sample_1, const Sample& sample_2) const;
+
+    /**
+     * @brief Best matching unit of the sample, the same node as SOM::BMU
+     *
+     * @details For the Euclidian metric the nodes are scanned in one contiguous buffer by squared distance,
+     * a node is abandoned as soon as its partial sum exceeds the best one found so far.
+     *
+     * @param sample sample to map
+     * @return index of the closest SOM node
+     */
+    size_t BMU(const Sample& sample) const;
+
+    /**
+     * @brief Ground distance between two SOM nodes
+     *
+     * @param node_1 index of the first node
+     * @param node_2 index of the second node
+     * @return length of the shortest path between the nodes on the SOM graph
+     */
+    distance_return_type ground_distance(size_t node_1, size_t node_2) const
+    {
+        return distance_matrix_[node_1 * nodes_number_ + node_2];
+    }
+
+    /**
+     * @brief Remember the BMU of the samples seen by operator(), for workloads that compare the same samples often
+     *
+     * @details The cache and its settings are shared between copies of the object, so this call applies to all of
+     * them. It holds a copy of at most capacity samples, looked up by a hash of their values in shards with a lock
+     * each; once a shard is full, its oldest sample is dropped for every new one. The samples kept are only dropped
+     * when the capacity changes.
+     *
+     * @param enable true to look samples up in the cache, false to search every time
+     * @param capacity largest number of samples kept
+     */
+    void cache_bmu(bool enable, size_t capacity = 4096)
+    {
+        cache_->resize(capacity);
+        cache_->enabled = enable;
+    }
 
 private:
 	
-	void calculate_distance_matrix();
+	void calculate_distance_matrix(size_t threads);
+
+	void floyd_warshall(const std::vector<std::pair<size_t, size_t>>& edges, const std::vector<D>& weights);
+
+	void dijkstra(const std::vector<std::pair<size_t, size_t>>& edges, const std::vector<D>& weights, size_t threads);
+
+	size_t cached_BMU(const Sample& sample) const;
 
 	metric::SOM<Sample, Graph, Metric, Distribution> som_model_;
 	
-	//metric::EMD<D> emd_distance_;
-	std::vector<std::vector<D>> distance_matrix_;
+	size_t nodes_number_ = 0;
+	size_t dimensions_ = 0;
+	std::vector<typename Sample::value_type> nodes_;  // SOM weights, row major
+	std::vector<D> distance_matrix_;  // shortest paths between SOM nodes, row major
+
+	// rings of the last samples, indexed by the hash of their values and split into shards by that hash
+	struct Cache {
+		struct Entry {
+			size_t hash;
+			Sample sample;
+			size_t bmu;
+		};
+		struct Shard {
+			std::mutex mutex;
+			size_t capacity = 0;
+			size_t next = 0;
+			std::vector<Entry> entries;
+			std::unordered_multimap<size_t, size_t> index;
+		};
+		static constexpr size_t shards = 16;
+
+		std::atomic<bool> enabled { false };
+		std::array<Shard, shards> shard;
+
+		Cache() { resize(4096); }
+
+		// the capacity is split between the shards, a shard whose capacity changes is emptied
+		void resize(size_t capacity)
+		{
+			for (size_t s = 0; s < shards; ++s) {
+				std::lock_guard<std::mutex> lock(shard[s].mutex);
+				const size_t share = capacity / shards + (s < capacity % shards ? 1 : 0);
+				if (share != shard[s].capacity) {
+					shard[s].capacity = share;
+					shard[s].next = 0;
+					shard[s].entries.clear();
+					shard[s].index.clear();
+				}
+			}
+		}
+	};
+	std::shared_ptr<Cache> cache_ = std::make_shared<Cache>();
 };
 
 }  // namespace metric
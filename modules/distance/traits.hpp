@@ -0,0 +1,72 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (c) 2020 Panda Team
+*/
+#ifndef _METRIC_DISTANCE_TRAITS_HPP
+#define _METRIC_DISTANCE_TRAITS_HPP
+
+#include <type_traits>
+#include <utility>
+
+namespace metric {
+
+/**
+ * @brief true if Metric provides an early abandoning operator()(a, b, upper_bound)
+ *
+ * @details Such an overload returns the exact distance when it does not exceed upper_bound; otherwise it may stop
+ * early and return any value not smaller than upper_bound.
+ */
+template <typename Metric, typename A, typename B = A, typename = void>
+struct has_upper_bound : std::false_type {
+};
+
+template <typename Metric, typename A, typename B>
+struct has_upper_bound<Metric, A, B,
+    std::void_t<decltype(std::declval<const Metric&>()(std::declval<const A&>(), std::declval<const B&>(),
+        std::declval<decltype(std::declval<const Metric&>()(std::declval<const A&>(), std::declval<const B&>()))>()))>>
+    : std::true_type {
+};
+
+/**
+ * @brief true if Metric provides a cheap lower_bound(a, b), a value never greater than the distance between a and b
+ *
+ * @details Searches evaluate the bound first and skip the full distance when the bound already exceeds the distance
+ * of interest.
+ */
+template <typename Metric, typename A, typename B = A, typename = void>
+struct has_lower_bound : std::false_type {
+};
+
+template <typename Metric, typename A, typename B>
+struct has_lower_bound<Metric, A, B,
+    std::void_t<decltype(std::declval<const Metric&>().lower_bound(std::declval<const A&>(), std::declval<const B&>()))>>
+    : std::true_type {
+};
+
+/**
+ * @brief Calculate distance between a and b, which only has to be exact when it does not exceed upper_bound
+ *
+ * @param metric metric object
+ * @param a first record
+ * @param b second record
+ * @param upper_bound largest distance of interest
+ * @return distance between a and b if it does not exceed upper_bound, otherwise some value not smaller than
+ * upper_bound
+ */
+template <typename Metric, typename A, typename B, typename Distance>
+auto bounded_distance(const Metric& metric, const A& a, const B& b, const Distance& upper_bound)
+    -> decltype(metric(a, b))
+{
+    if constexpr (has_upper_bound<Metric, A, B>::value) {
+        return metric(a, b, upper_bound);
+    } else {
+        return metric(a, b);
+    }
+}
+
+}  // namespace metric
+
+#endif  // Header Guard
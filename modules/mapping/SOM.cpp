@@ -126,7 +126,7 @@ size_t SOM<recType, Graph, Metric, Distribution>::BMU(const recType& sample) con
     size_t index = 0;
 
     for (size_t i = 0; i < weights.size(); ++i) {
-        T dist = metric(sample, weights[i]);
+        T dist = bounded_distance(metric, sample, weights[i], T(minDist));
 
         if (dist < minDist) {
             minDist = dist;
@@ -31,6 +31,7 @@ W. Natita, W. Wiboonsak, and S. Dusadee
 //#include "metric.tpp"
 //#include "../distance.hpp"
 #include "../distance/k-related/Standards.hpp"
+#include "../distance/traits.hpp"
 #include "../utils/graph.hpp"
 
 #ifndef M_PI
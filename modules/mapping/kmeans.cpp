@@ -30,6 +30,7 @@ Copyright (c) 2018 M.Welsch
 #include <random>
 #include <cassert>
 #include "../distance/k-related/Standards.hpp"
+#include "../distance/k-related/Pairwise.hpp"
 namespace metric {
 
 namespace kmeans_details {
@@ -58,15 +59,17 @@ namespace kmeans_details {
     std::vector<T> closest_distance(const std::vector<std::vector<T>>& means,
         const std::vector<std::vector<T>>& datapoints, int k, std::string distance_measure)
     {
+        // all distances between datapoints and means in one block
+        const blaze::DynamicMatrix<T> block = distance_measure.compare("manhatten") == 0
+            ? pairwise(metric::Manhatten<T>(), datapoints, means)
+            : pairwise(metric::Euclidian<T>(), datapoints, means);
+
         std::vector<T> distances;
-        distances.reserve(k);
-        for (auto& d : datapoints) {
-            T closest = kmeans_details::distance(d, means[0], distance_measure);
-            for (auto& m : means) {
-                T distance = kmeans_details::distance(d, m, distance_measure);
-                if (distance < closest)
-                    closest = distance;
-            }
+        distances.reserve(datapoints.size());
+        for (size_t i = 0; i < block.rows(); ++i) {
+            T closest = blaze::min(blaze::row(block, i));
+            if (distance_measure.compare("rms") == 0)
+                closest = closest * closest;
             distances.push_back(closest);
         }
         return distances;
@@ -19,11 +19,12 @@ Matrix<recType, Metric, distType>::Matrix(const std::vector<recType>& p, Metric
     , data_(p)
 
 {
+    // one block of all distances, through the Gram matrix for Euclidian and Cosine
+    const auto distances = pairwise(metric_, p, p);
     for (size_t i = 0; i < D_.columns(); ++i) {
         D_(i, i) = 0;
         for (size_t j = i + 1; j < D_.rows(); ++j) {
-            auto distance = metric_(p[i], p[j]);
-            D_(i, j) = distance;
+            D_(i, j) = distances(i, j);
         }
     }
 }
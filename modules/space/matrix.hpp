@@ -141,6 +141,13 @@ public:
      */
     size_t size() const;
 
+    /**
+     * @brief all distances between the data records
+     *
+     * @return distance matrix, indexed by record IDs
+     */
+    const blaze::SymmetricMatrix<blaze::DynamicMatrix<distType>>& distances() const { return D_; }
+
 private:
     /*** Properties ***/
     Metric metric_;
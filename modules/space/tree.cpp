@@ -9,9 +9,12 @@ Copyright (c) 2018 Michael Welsch
 #define _METRIC_SPACE_TREE_CPP
 
 #include "tree.hpp"  // back reference for header only use
+#include "../utils/parallel.hpp"
 #include <algorithm>
 #include <cmath>
 #include <functional>
+#include <limits>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <type_traits>
@@ -117,6 +120,7 @@ public:
     Distance sepdist();  // separating distance between nodes at current level
 
     Distance dist(const recType& pp) const;  // distance between this node and point pp
+    Distance dist(const recType& pp, Distance upper_bound) const;  // same, exact only up to upper_bound
     Distance dist(Node_ptr n) const;  // distance between this node and node n
 
     Node_ptr setChild(const recType& p,
@@ -234,6 +238,13 @@ typename Node<recType, Metric>::Distance Node<recType, Metric>::dist(const recTy
     return tree_ptr->metric(get_data(), pp);
 }
 
+/*** distance between current node and point pp, the metric may abandon above upper_bound ***/
+template <class recType, class Metric>
+typename Node<recType, Metric>::Distance Node<recType, Metric>::dist(const recType& pp, Distance upper_bound) const
+{
+    return tree_ptr->metric(get_data(), pp, upper_bound);
+}
+
 /*** distance between current node and node n ***/
 template <class recType, class Metric>
 typename Node<recType, Metric>::Distance Node<recType, Metric>::dist(Node_ptr n) const
@@ -371,6 +382,26 @@ Tree<recType, Metric>::sortChildrenByDistance(Node_ptr p, pointOrNodeType x) con
     return std::make_tuple(idx, dists);
 }
 
+template <class recType, class Metric>
+std::tuple<std::vector<int>, std::vector<typename Tree<recType, Metric>::Distance>>
+Tree<recType, Metric>::sortChildrenByDistance(Node_ptr p, const recType& x, Distance upper_bound) const
+{
+    auto num_children = p->children.size();
+    std::vector<int> idx(num_children);
+    std::iota(std::begin(idx), std::end(idx), 0);
+    std::vector<Distance> dists(num_children);
+    for (unsigned i = 0; i < num_children; ++i) {
+        Distance margin = 2 * p->children[i]->covdist();
+        Distance bound = upper_bound < std::numeric_limits<Distance>::max() - margin
+            ? upper_bound + margin
+            : std::numeric_limits<Distance>::max();
+        dists[i] = p->children[i]->dist(x, bound);
+    }
+    auto comp_x = [&dists](int a, int b) { return dists[a] < dists[b]; };
+    std::sort(std::begin(idx), std::end(idx), comp_x);
+    return std::make_tuple(idx, dists);
+}
+
 /*
   _ _|                      |
    |      \  (_-<   -_)   _| _|
@@ -598,7 +629,7 @@ void Tree<recType, Metric>::nn_(
         nn.second = dist_current;
     }
 
-    auto idx__dists = sortChildrenByDistance(current, p);
+    auto idx__dists = sortChildrenByDistance(current, p, nn.second);
     auto idx = std::get<0>(idx__dists);
     auto dists = std::get<1>(idx__dists);
     for (const auto& child_idx : idx) {
@@ -652,7 +683,7 @@ std::size_t Tree<recType, Metric>::knn_(Node_ptr current, Distance dist_current,
         nnSize++;
     }
 
-    auto idx__dists = sortChildrenByDistance(current, p);
+    auto idx__dists = sortChildrenByDistance(current, p, nnList.back().second);
     auto idx = std::get<0>(idx__dists);
     auto dists = std::get<1>(idx__dists);
 
@@ -694,7 +725,7 @@ void Tree<recType, Metric>::rnn_(Node_ptr current, Distance dist_current, const
         nnList.push_back(temp);
     }
 
-    auto idx__dists = sortChildrenByDistance(current, p);
+    auto idx__dists = sortChildrenByDistance(current, p, distance);
     auto idx = std::get<0>(idx__dists);
     auto dists = std::get<1>(idx__dists);
 
@@ -1460,20 +1491,29 @@ auto Tree<recType, Metric>::distance(const recType &r1, const recType &r2) const
 }
 
 template <typename recType, typename Metric>
-auto Tree<recType, Metric>::matrix() const
+auto Tree<recType, Metric>::matrix(std::size_t threads) const
     -> blaze::SymmetricMatrix<blaze::DynamicMatrix<Distance, blaze::rowMajor>> {
-    blaze::SymmetricMatrix<blaze::DynamicMatrix<Distance, blaze::rowMajor>> m(data.size());
-    for(std::size_t i = 0; i < data.size(); i++) {
-        for(std::size_t j = i +1; j < data.size(); j++) {
-            if( data[i].second->parent == data[j].second) {
-                m(i,j) = data[i].second->parent_dist;
-            } else if (data[j].second->parent == data[i].second) {
-                m(i, j) = data[j].second->parent_dist;
-            } else {
-                m(i, j) = metric(data[i].first, data[j].first);
+    const std::size_t n = data.size();
+    blaze::SymmetricMatrix<blaze::DynamicMatrix<Distance, blaze::rowMajor>> m(n);
+    // row p is paired with row n - 1 - p, so that every thread gets the same number of distances
+    parallel_for((n + 1) / 2, threads, [&](std::size_t begin, std::size_t end, std::size_t) {
+        for (std::size_t p = begin; p < end; p++) {
+            for (std::size_t i : { p, n - 1 - p }) {
+                for(std::size_t j = i +1; j < n; j++) {
+                    if( data[i].second->parent == data[j].second) {
+                        m(i,j) = data[i].second->parent_dist;
+                    } else if (data[j].second->parent == data[i].second) {
+                        m(i, j) = data[j].second->parent_dist;
+                    } else {
+                        m(i, j) = metric(data[i].first, data[j].first);
+                    }
+                }
+                if (i == n - 1 - i) {
+                    break;
+                }
             }
         }
-    }
+    });
     return m;
 }
 }  // namespace metric
@@ -15,6 +15,7 @@ Copyright (c) 2018, Michael Welsch
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <map>
 #include <numeric>
 #include <shared_mutex>
@@ -27,6 +28,7 @@ Copyright (c) 2018, Michael Welsch
 #include "../../3rdparty/blaze/Math.h"
 #include "../../3rdparty/blaze/math/Matrix.h"
 #include "../../3rdparty/blaze/math/adaptors/SymmetricMatrix.h"
+#include "../distance/traits.hpp"
 namespace metric {
 /*
   _ \         _|             |  |       \  |        |       _)
@@ -387,10 +389,28 @@ public:
 
     /**
      * @brief convert cover tree to distance matrix
+     * @details Only the distances between a node and its parent are stored in the tree, all other pairs are measured
+     * again, split between threads.
+     * @param threads number of threads, 0 means one per hardware thread
      * @return blaze::SymmetricMatrix with distance
      *
      */
-    blaze::SymmetricMatrix<blaze::DynamicMatrix<Distance, blaze::rowMajor>> matrix() const;
+    blaze::SymmetricMatrix<blaze::DynamicMatrix<Distance, blaze::rowMajor>> matrix(std::size_t threads = 1) const;
+
+    /**
+     * @brief number of full metric evaluations the searches skipped because the lower bound of the metric already
+     * exceeded the distance of interest
+     * @details Metrics with an early abandoning operator()(a, b, upper_bound), as Edit and TWED, check their lower
+     * bound inside it; their evaluations that returned early on it are counted too, at the price of one more
+     * lower bound per abandoned evaluation.
+     * @return count since construction or the last reset_lower_bound_skips()
+     */
+    std::size_t lower_bound_skips() const { return lower_bound_skips_; }
+
+    /**
+     * @brief reset the counter returned by lower_bound_skips()
+     */
+    void reset_lower_bound_skips() { lower_bound_skips_ = 0; }
 private:
     friend class Node<recType, Metric>;
 
@@ -405,6 +425,7 @@ private:
     int truncate_level = -1;  // Relative level below which the tree is truncated
     std::atomic<std::size_t> nextID = 0;  // Next node ID
     mutable std::shared_timed_mutex global_mut;  // lock for changing the root
+    mutable std::atomic<std::size_t> lower_bound_skips_ = 0;  // full evaluations avoided by Metric::lower_bound
     std::vector<std::pair<recType, Node_ptr>> data;
 
     std::unordered_map<std::size_t, std::size_t> index_map;  // ID -> data index mapping
@@ -416,6 +437,10 @@ private:
     template <typename pointOrNodeType>
     std::tuple<std::vector<int>, std::vector<Distance>> sortChildrenByDistance(Node_ptr p, pointOrNodeType x) const;
 
+    // distances to children are exact only below upper_bound + 2 * covdist of the child, larger ones are pruned anyway
+    std::tuple<std::vector<int>, std::vector<Distance>> sortChildrenByDistance(
+        Node_ptr p, const recType& x, Distance upper_bound) const;
+
     bool grab_sub_tree(Node_ptr proot, const recType& center, std::unordered_set<std::size_t>& parsed_points,
         const std::vector<std::size_t>& distribution_sizes, std::size_t& cur_idx,
         std::vector<std::vector<std::size_t>>& result);
@@ -458,6 +483,29 @@ private:
         std::vector<std::vector<std::size_t>>& result);
 
     Distance metric(const recType& p1, const recType& p2) const { return metric_(p1, p2); }
+    Distance metric(const recType& p1, const recType& p2, Distance upper_bound) const
+    {
+        if constexpr (has_lower_bound<Metric, recType>::value) {
+            if (upper_bound < std::numeric_limits<Distance>::max()) {
+                if constexpr (has_upper_bound<Metric, recType>::value) {
+                    // the metric checks its lower bound first and returns early when it exceeds upper_bound, so
+                    // only a result above upper_bound can have been such an early return
+                    const Distance distance = metric_(p1, p2, upper_bound);
+                    if (distance > upper_bound && metric_.lower_bound(p1, p2) > upper_bound) {
+                        lower_bound_skips_.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    return distance;
+                } else {
+                    const Distance bound = metric_.lower_bound(p1, p2);
+                    if (bound > upper_bound) {
+                        lower_bound_skips_.fetch_add(1, std::memory_order_relaxed);
+                        return bound;
+                    }
+                }
+            }
+        }
+        return bounded_distance(metric_, p1, p2, upper_bound);
+    }
     Distance metric_by_id(const std::size_t id1, const std::size_t id2) {
         return metric_(data[index_map[id1]].first, data[index_map[id2]].first);
     }
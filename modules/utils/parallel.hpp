@@ -0,0 +1,113 @@
+/*
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this
+file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (c) 2020 Panda Team
+*/
+#ifndef _METRIC_UTILS_PARALLEL_HPP
+#define _METRIC_UTILS_PARALLEL_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <thread>
+#include <vector>
+
+namespace metric {
+
+/**
+ * @brief Number of threads to use for a requested thread count
+ *
+ * @param threads requested number of threads, 0 means one per hardware thread
+ * @return number of threads, at least 1
+ */
+inline std::size_t thread_count(std::size_t threads)
+{
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    return std::max<std::size_t>(threads, 1);
+}
+
+/**
+ * @brief Split [0, size) into contiguous chunks and run body(begin, end, chunk) for each chunk
+ *
+ * @details Chunk c covers an equal share of the range in order, so per chunk results reduced in chunk order give
+ * the same answer for the same number of threads. The calling thread runs the first chunk; an exception thrown by
+ * any chunk is rethrown after all chunks finished.
+ *
+ * @param size length of the range
+ * @param threads number of chunks and threads, 0 means one per hardware thread
+ * @param body callable taking (std::size_t begin, std::size_t end, std::size_t chunk)
+ * @return number of chunks used
+ */
+template <typename Body>
+std::size_t parallel_for(std::size_t size, std::size_t threads, const Body& body)
+{
+    const std::size_t chunks = std::min(thread_count(threads), std::max<std::size_t>(size, 1));
+    if (chunks == 1) {
+        body(std::size_t(0), size, std::size_t(0));
+        return 1;
+    }
+
+    std::vector<std::exception_ptr> errors(chunks);
+    auto run = [&](std::size_t chunk) {
+        try {
+            body(size * chunk / chunks, size * (chunk + 1) / chunks, chunk);
+        } catch (...) {
+            errors[chunk] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(chunks - 1);
+    for (std::size_t chunk = 1; chunk < chunks; ++chunk) {
+        workers.emplace_back(run, chunk);
+    }
+    run(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    for (auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    return chunks;
+}
+
+/**
+ * @brief Run body(i, j) for every cell of a rows x cols grid
+ *
+ * @details The rows are split between threads as in parallel_for; every thread walks its rows in tiles of
+ * tile x tile cells, so that the records of a tile stay in cache while they are paired.
+ *
+ * @param rows number of rows
+ * @param cols number of columns
+ * @param threads number of threads, 0 means one per hardware thread
+ * @param body callable taking (std::size_t i, std::size_t j)
+ * @param tile side of the tiles
+ */
+template <typename Body>
+void parallel_grid(std::size_t rows, std::size_t cols, std::size_t threads, const Body& body, std::size_t tile = 16)
+{
+    tile = std::max<std::size_t>(tile, 1);
+    parallel_for(rows, threads, [&](std::size_t begin, std::size_t end, std::size_t) {
+        for (std::size_t ib = begin; ib < end; ib += tile) {
+            const std::size_t ie = std::min(ib + tile, end);
+            for (std::size_t jb = 0; jb < cols; jb += tile) {
+                const std::size_t je = std::min(jb + tile, cols);
+                for (std::size_t i = ib; i < ie; ++i) {
+                    for (std::size_t j = jb; j < je; ++j) {
+                        body(i, j);
+                    }
+                }
+            }
+        }
+    });
+}
+
+}  // namespace metric
+
+#endif  // Header Guard
@@ -10,6 +10,8 @@
 #include "modules/correlation.hpp"
 //#include "details/metrics.hpp"
 #include "modules/distance.hpp"
+#include "modules/space/matrix.hpp"
+#include "modules/space/tree.hpp"
 #include "modules/utils/graph/connected_components.hpp"
 
 #define BOOST_TEST_MODULE Main
@@ -162,6 +164,327 @@ BOOST_AUTO_TEST_CASE(MGC_Estimate)
 
     auto mgc = metric::MGC<Rec, Met, Rec, Met>();
 
-    auto result = mgc.estimate(dataX, dataY);
-    std::cout << result << std::endl;
+    metric::MGC_estimate_stats stats;
+    auto result = mgc.estimate(dataX, dataY, 250, 0.05, 1000, 1, &stats);
+    BOOST_CHECK(stats.converged);
+    BOOST_CHECK_GT(stats.iterations, 1);
+    BOOST_CHECK_LT(stats.convergence, 0.05);
+    BOOST_CHECK(result > 0 && result < 1);
+
+    // subsamples evaluated in waves give the same estimate
+    auto parallel = metric::MGC<Rec, Met, Rec, Met>(3);
+    metric::MGC_estimate_stats parallelStats;
+    BOOST_CHECK_EQUAL(parallel.estimate(dataX, dataY, 250, 0.05, 1000, 1, &parallelStats), result);
+    BOOST_CHECK_EQUAL(parallelStats.iterations, stats.iterations);
+
+    // another seed draws other subsamples
+    BOOST_CHECK_NE(mgc.estimate(dataX, dataY, 250, 0.05, 1000, 2), result);
+}
+
+BOOST_AUTO_TEST_CASE(MGC_direct_lean)
+{
+    const size_t n = 120;
+    auto a = generateMatrix<double>(n, 2);
+    auto b = generateMatrix<double>(n, 1);
+    for (size_t i = 0; i < n; ++i) {
+        b[i][0] += a[i][0] * a[i][0];
+    }
+
+    metric::DistanceMatrix<double> X(n);
+    metric::DistanceMatrix<double> Y(n);
+    metric::Euclidian<double> euclidian;
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = i + 1; j < n; ++j) {
+            X(i, j) = euclidian(a[i], a[j]);
+            Y(i, j) = euclidian(b[i], b[j]);
+        }
+    }
+
+    // the materialized pipeline built from the public steps
+    metric::MGC_direct steps;
+    blaze::DynamicMatrix<double> A = steps.center_distance_matrix(X);
+    blaze::DynamicMatrix<double> B = steps.center_distance_matrix(Y);
+    blaze::DynamicMatrix<size_t> RXt = steps.rank_distance_matrix(X);
+    blaze::DynamicMatrix<size_t> RYt = steps.rank_distance_matrix(Y);
+    blaze::DynamicMatrix<double> At = blaze::trans(A);
+    blaze::DynamicMatrix<double> Bt = blaze::trans(B);
+    blaze::DynamicMatrix<size_t> RX = blaze::trans(RXt);
+    blaze::DynamicMatrix<size_t> RY = blaze::trans(RYt);
+    auto corr = steps.local_covariance(A, Bt, RX, RYt);
+    auto varX = steps.local_covariance(A, At, RX, RXt);
+    auto varY = steps.local_covariance(B, Bt, RY, RYt);
+    steps.normalize_generalized_correlation(corr, varX, varY);
+    auto R = steps.significant_local_correlation(corr);
+    const double expected = steps.optimal_local_generalized_correlation(corr, R);
+
+    metric::MGC_direct mgc;
+    BOOST_CHECK_EQUAL(mgc(X, Y), expected);
+
+    // A, B, their transposes, four size_t rank matrices and three covariance tables
+    const size_t materialized = n * n * (4 * sizeof(double) + 4 * sizeof(size_t) + 3 * sizeof(double));
+    BOOST_CHECK_GT(mgc.peak_memory, 0);
+    BOOST_CHECK_LE(3 * mgc.peak_memory, materialized);
+}
+
+BOOST_AUTO_TEST_CASE(MGC_threads)
+{
+    // integer records give many tied distances
+    std::default_random_engine g(7);
+    std::uniform_int_distribution<int> uniform(0, 5);
+    std::vector<std::vector<double>> a(150);
+    std::vector<std::vector<double>> b(150);
+    for (size_t i = 0; i < a.size(); ++i) {
+        a[i] = { double(uniform(g)), double(uniform(g)) };
+        b[i] = { a[i][0] + uniform(g) };
+    }
+
+    typedef std::vector<double> Rec;
+    typedef metric::Euclidian<double> Met;
+
+    // the same number of threads gives the same result, others only differ in the order of the sums
+    const double expected = metric::MGC<Rec, Met, Rec, Met>()(a, b);
+    const double parallel = metric::MGC<Rec, Met, Rec, Met>(3)(a, b);
+    BOOST_CHECK_EQUAL((metric::MGC<Rec, Met, Rec, Met>(3)(a, b)), parallel);
+    BOOST_CHECK_CLOSE(parallel, expected, 1e-12);
+    BOOST_CHECK_CLOSE((metric::MGC<Rec, Met, Rec, Met>(0)(a, b)), expected, 1e-12);
+
+    // ties are ranked in the order of their columns
+    metric::DistanceMatrix<double> X(4);
+    X(0, 1) = 1;
+    X(0, 2) = 1;
+    X(0, 3) = 1;
+    auto ranks = metric::MGC_direct(2).rank_distance_matrix(X);
+    BOOST_CHECK_EQUAL(ranks(0, 1), 1);
+    BOOST_CHECK_EQUAL(ranks(0, 3), 3);
+    BOOST_CHECK_EQUAL(ranks(1, 0), 3);
+    BOOST_CHECK_EQUAL(ranks(1, 1), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MGC_permutation_test)
+{
+    std::default_random_engine g(11);
+    std::normal_distribution<double> normal(0, 1);
+    std::vector<std::vector<double>> a(60);
+    std::vector<std::vector<double>> dependent(60);
+    std::vector<std::vector<double>> independent(60);
+    for (size_t i = 0; i < a.size(); ++i) {
+        a[i] = { normal(g) };
+        dependent[i] = { a[i][0] * a[i][0] + 0.2 * normal(g) };
+        independent[i] = { normal(g) };
+    }
+
+    typedef std::vector<double> Rec;
+    typedef metric::Euclidian<double> Met;
+    auto mgc = metric::MGC<Rec, Met, Rec, Met>();
+
+    auto result = mgc.test(a, dependent, 200);
+    BOOST_CHECK_EQUAL(result.statistic, mgc(a, dependent));
+    BOOST_CHECK_EQUAL(result.permutations, 200);
+    BOOST_CHECK_LE(result.p_value, 0.01);
+
+    // the permutations do not depend on the number of threads
+    auto parallel = metric::MGC<Rec, Met, Rec, Met>(3).test(a, dependent, 200);
+    BOOST_CHECK_EQUAL(parallel.p_value, result.p_value);
+
+    result = mgc.test(a, independent, 200);
+    BOOST_CHECK_GT(result.p_value, 0.05);
+
+    // an obviously insignificant result stops early
+    auto early = metric::MGC<Rec, Met, Rec, Met>(2).test(a, independent, 200, 0.05);
+    BOOST_CHECK_LT(early.permutations, 200);
+    BOOST_CHECK_GT(early.p_value, 0.05);
+}
+
+BOOST_AUTO_TEST_CASE(MGC_precomputed)
+{
+    typedef std::vector<double> Rec;
+    typedef metric::Euclidian<double> Met;
+
+    auto a = generateMatrix<double>(40, 2);
+    std::vector<Rec> b(a.size());
+    for (size_t i = 0; i < a.size(); ++i) {
+        b[i] = { a[i][0] * a[i][1] + 0.1 * i };
+    }
+
+    auto mgc = metric::MGC<Rec, Met, Rec, Met>();
+    const double expected = mgc(a, b);
+
+    metric::Matrix<Rec, Met, double> matrixA(a);
+    metric::Matrix<Rec, Met, double> matrixB(b);
+    BOOST_CHECK_EQUAL(mgc(matrixA, matrixB), expected);
+    BOOST_CHECK_EQUAL(mgc(matrixA.distances(), matrixB.distances()), expected);
+
+    // scipy pdist layout
+    std::vector<double> condensedA;
+    std::vector<double> condensedB;
+    for (size_t i = 0; i < a.size(); ++i) {
+        for (size_t j = i + 1; j < a.size(); ++j) {
+            condensedA.push_back(Met()(a[i], a[j]));
+            condensedB.push_back(Met()(b[i], b[j]));
+        }
+    }
+    metric::CondensedDistanceMatrix<double> viewA(condensedA.data(), a.size());
+    metric::CondensedDistanceMatrix<double> viewB(condensedB.data(), b.size());
+    BOOST_CHECK_EQUAL(mgc(viewA, viewB), expected);
+    BOOST_CHECK_EQUAL(metric::MGC_direct()(viewA, matrixB.distances()), expected);
+}
+
+BOOST_AUTO_TEST_CASE(MGC_window)
+{
+    typedef std::vector<double> Rec;
+    typedef metric::Euclidian<double> Met;
+
+    // integer samples, so that the rows have ties
+    std::default_random_engine g(3);
+    std::uniform_int_distribution<int> ud(0, 6);
+    std::vector<Rec> a(60);
+    std::vector<Rec> b(60);
+    for (size_t i = 0; i < a.size(); ++i) {
+        a[i] = { double(ud(g)), double(ud(g)) };
+        b[i] = { a[i][0] + double(ud(g)) };
+    }
+
+    auto mgc = metric::MGC<Rec, Met, Rec, Met>();
+    auto mgc3 = metric::MGC<Rec, Met, Rec, Met>(3);
+    metric::MGC_window<Rec, Met, Rec, Met> window(20);
+    metric::MGC_window<Rec, Met, Rec, Met> parallel(20, 3);
+    BOOST_CHECK_EQUAL(window(), 0);
+    for (size_t i = 0; i < a.size(); ++i) {
+        window.push(a[i], b[i]);
+        parallel.push(a[i], b[i]);
+        const size_t first = i + 1 - window.size();
+        BOOST_TEST(window.size() == std::min<size_t>(i + 1, 20));
+        if (window.size() == 1) {
+            BOOST_CHECK_EQUAL(window(), 0);
+        }
+        if (window.size() >= 5) {
+            const std::vector<Rec> lastA(a.begin() + first, a.begin() + i + 1);
+            const std::vector<Rec> lastB(b.begin() + first, b.begin() + i + 1);
+            // the local variances are summed up per thread, so the same number of threads gives the same value
+            BOOST_CHECK_EQUAL(window(), mgc(lastA, lastB));
+            BOOST_CHECK_EQUAL(parallel(), mgc3(lastA, lastB));
+        }
+    }
+
+    for (size_t i = 0; i < 10; ++i) {
+        window.pop();
+    }
+    const std::vector<Rec> lastA(a.end() - 10, a.end());
+    const std::vector<Rec> lastB(b.end() - 10, b.end());
+    BOOST_TEST(window.size() == 10);
+    BOOST_CHECK_EQUAL(window(), mgc(lastA, lastB));
+
+    for (size_t i = 0; i < 12; ++i) {
+        window.pop();
+    }
+    BOOST_TEST(window.size() == 0);
+    BOOST_CHECK_EQUAL(window(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MGC_float)
+{
+    typedef std::vector<double> Rec;
+    typedef metric::Euclidian<double> Met;
+
+    auto a = generateMatrix<double>(200, 3);
+    std::vector<Rec> b(a.size());
+    for (size_t i = 0; i < a.size(); ++i) {
+        b[i] = { a[i][0] * a[i][1] + a[i][2] };
+    }
+
+    const double expected = metric::MGC<Rec, Met, Rec, Met>()(a, b);
+    auto mgcFloat = metric::MGC<Rec, Met, Rec, Met, float>();
+    BOOST_CHECK_CLOSE(mgcFloat(a, b), expected, 1e-4);
+
+    // float distances, double statistic
+    metric::DistanceMatrix<float> X(a.size());
+    metric::DistanceMatrix<float> Y(b.size());
+    for (size_t i = 0; i < a.size(); ++i) {
+        for (size_t j = i + 1; j < a.size(); ++j) {
+            X(i, j) = Met()(a[i], a[j]);
+            Y(i, j) = Met()(b[i], b[j]);
+        }
+    }
+    metric::MGC_direct direct;
+    const auto value = direct(X, Y);
+    static_assert(std::is_same<decltype(value), const double>::value, "float distances give a double statistic");
+    BOOST_CHECK_CLOSE(value, expected, 1e-4);
+
+    metric::MGC_window<Rec, Met, Rec, Met, float> window(a.size());
+    for (size_t i = 0; i < a.size(); ++i) {
+        window.push(a[i], b[i]);
+    }
+    BOOST_CHECK_EQUAL(window(), value);
+}
+
+BOOST_AUTO_TEST_CASE(MGC_significant_region)
+{
+    // two blobs of significant local correlations, one larger than the other, and noise
+    std::default_random_engine g(11);
+    std::normal_distribution<double> nd(0, 0.05);
+    const size_t n = 60;
+    blaze::DynamicMatrix<double> corr(n, n);
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < n; ++j) {
+            const double big = (i - 40.0) * (i - 40.0) + (j - 35.0) * (j - 35.0) < 150 ? 0.6 : 0;
+            const double small = (i - 8.0) * (i - 8.0) + (j - 10.0) * (j - 10.0) < 20 ? 0.8 : 0;
+            corr(i, j) = big + small + nd(g);
+        }
+    }
+    corr(n - 1, n - 1) = 0.1;
+
+    metric::MGC_direct mgc;
+    const auto R = mgc.significant_local_correlation(corr);
+
+    // the same region from the thresholded table
+    const double sz = n - 1;
+    const double thres = std::max(
+        mgc.icdf_normal(1 - 0.02 / sz) / std::sqrt(sz * (sz - 3) / 2 - 1), corr(n - 1, n - 1));
+    blaze::DynamicMatrix<bool> significant = blaze::map(corr, [thres](double e) { return e > thres; });
+    const auto expected = metric::graph::largest_connected_component(significant)[0];
+    BOOST_TEST(R == expected);
+    BOOST_TEST(blaze::nonZeros(R) > 2 * n);
+    BOOST_TEST(metric::MGC_direct(3).significant_local_correlation(corr) == R);
+
+    double maximum = 0;
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < n; ++j) {
+            if (expected(i, j)) {
+                maximum = std::max(maximum, corr(i, j));
+            }
+        }
+    }
+    BOOST_CHECK_EQUAL(mgc.optimal_local_generalized_correlation(corr, R), maximum);
+}
+
+BOOST_AUTO_TEST_CASE(MGC_approximate)
+{
+    std::default_random_engine g(5);
+    std::normal_distribution<double> normal(0, 1);
+    std::vector<std::vector<double>> a(80);
+    std::vector<std::vector<double>> dependent(a.size());
+    std::vector<std::vector<double>> independent(a.size());
+    for (size_t i = 0; i < a.size(); ++i) {
+        a[i] = { normal(g), normal(g) };
+        dependent[i] = { a[i][0] * a[i][0] + 0.3 * normal(g) };
+        independent[i] = { normal(g) };
+    }
+
+    typedef std::vector<double> Rec;
+    typedef metric::Euclidian<double> Met;
+    auto mgc = metric::MGC<Rec, Met, Rec, Met>(2);
+
+    // all neighbours and all samples for the means give the exact statistic
+    BOOST_CHECK_CLOSE(mgc.approximate(a, dependent, a.size(), a.size()), mgc(a, dependent), 1e-9);
+
+    const double approximate = mgc.approximate(a, dependent, 20, 40);
+    BOOST_CHECK_GT(approximate, 0.1);
+    BOOST_CHECK_LE(approximate, mgc(a, dependent));
+    BOOST_CHECK_LT(std::abs(mgc.approximate(a, independent, 20, 40)), 0.05);
+
+    // the neighbour graphs hold float distances
+    const auto graph = metric::MGC_details::neighbour_graph<Met, float>(a, 20, { 0, 1, 2 });
+    static_assert(std::is_same<decltype(graph.distances)::value_type, float>::value, "float neighbour distances");
+    auto mgcFloat = metric::MGC<Rec, Met, Rec, Met, float>(2);
+    BOOST_CHECK_CLOSE(mgcFloat.approximate(a, dependent, 20, 40), approximate, 1e-3);
 }
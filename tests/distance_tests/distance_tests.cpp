@@ -0,0 +1,882 @@
+/*
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+  Copyright (c) 2020 Panda Team
+*/
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+#include "modules/distance.hpp"
+#include "modules/utils/parallel.hpp"
+
+#define BOOST_TEST_MODULE Main
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+
+template <typename T>
+std::vector<std::vector<T>> generateRecords(size_t count, size_t dim, unsigned seed = 0)
+{
+    std::default_random_engine g(seed);
+    std::normal_distribution<T> nd(0, 1);
+
+    std::vector<std::vector<T>> records(count, std::vector<T>(dim));
+    for (auto& r : records) {
+        for (auto& v : r) {
+            v = nd(g);
+        }
+    }
+    return records;
+}
+
+template <typename T>
+blaze::DynamicMatrix<T> toMatrix(const std::vector<std::vector<T>>& records)
+{
+    blaze::DynamicMatrix<T> m(records.size(), records[0].size());
+    for (size_t i = 0; i < m.rows(); ++i) {
+        for (size_t j = 0; j < m.columns(); ++j) {
+            m(i, j) = records[i][j];
+        }
+    }
+    return m;
+}
+
+template <typename Metric, typename T>
+void checkPairwise(const Metric& metric, const std::vector<std::vector<T>>& a, const std::vector<std::vector<T>>& b,
+    double tolerance)
+{
+    auto fromRecords = metric::pairwise(metric, a, b);
+    auto fromMatrices = metric::pairwise(metric, toMatrix(a), toMatrix(b));
+    BOOST_REQUIRE_EQUAL(fromRecords.rows(), a.size());
+    BOOST_REQUIRE_EQUAL(fromRecords.columns(), b.size());
+    for (size_t i = 0; i < a.size(); ++i) {
+        auto row = metric::one_to_many(metric, a[i], b);
+        auto rowFromMatrix = metric::one_to_many(metric, blaze::DynamicVector<T, blaze::rowVector>(blaze::row(toMatrix(a), i)), toMatrix(b));
+        for (size_t j = 0; j < b.size(); ++j) {
+            const auto expected = metric(a[i], b[j]);
+            BOOST_CHECK_CLOSE(fromRecords(i, j), expected, tolerance);
+            BOOST_CHECK_CLOSE(fromMatrices(i, j), expected, tolerance);
+            BOOST_CHECK_CLOSE(row[j], expected, tolerance);
+            BOOST_CHECK_CLOSE(rowFromMatrix[j], expected, tolerance);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(pairwise_gram_metrics)
+{
+    auto a = generateRecords<double>(70, 13, 1);
+    auto b = generateRecords<double>(130, 13, 2);
+    checkPairwise(metric::Euclidian<double>(), a, b, 1e-8);
+    checkPairwise(metric::Cosine<double>(), a, b, 1e-8);
+}
+
+BOOST_AUTO_TEST_CASE(pairwise_near_duplicates)
+{
+    // records far from the origin and 1e-4 apart, where |a|^2 + |b|^2 - 2ab cancels
+    std::vector<std::vector<double>> a(2, std::vector<double>(16, 1000));
+    a[1][3] += 1e-4;
+    metric::Euclidian<double> euclidian;
+    const auto distances = metric::pairwise(euclidian, a, a);
+    BOOST_CHECK_CLOSE(distances(0, 1), 1e-4, 1e-6);
+    BOOST_CHECK_EQUAL(distances(1, 1), 0);
+    const auto fromMatrix = metric::one_to_many(euclidian, blaze::DynamicVector<double>(16, 1000), toMatrix(a));
+    BOOST_CHECK_CLOSE(fromMatrix[1], 1e-4, 1e-6);
+}
+
+BOOST_AUTO_TEST_CASE(pairwise_generic_metrics)
+{
+    auto a = generateRecords<double>(70, 13, 3);
+    auto b = generateRecords<double>(130, 13, 4);
+    checkPairwise(metric::Manhatten<double>(), a, b, 1e-12);
+    checkPairwise(metric::Chebyshev<double>(), a, b, 1e-12);
+}
+
+BOOST_AUTO_TEST_CASE(pairwise_ragged_records)
+{
+    std::vector<std::vector<double>> a = { { 0, 1 }, { 1, 2, 3 } };
+    std::vector<std::vector<double>> b = { { 3, 4 }, { 1, 1, 1 }, { 0 } };
+    metric::Euclidian<double> euclidian;
+    auto distances = metric::pairwise(euclidian, a, b);
+    for (size_t i = 0; i < a.size(); ++i) {
+        for (size_t j = 0; j < b.size(); ++j) {
+            BOOST_CHECK_EQUAL(distances(i, j), euclidian(a[i], b[j]));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(fixed_size_records_and_integer_p_norm)
+{
+    const auto records = generateRecords<double>(20, 70, 11);
+    auto toArray = [](const std::vector<double>& record) {
+        std::array<double, 70> values;
+        std::copy(record.begin(), record.end(), values.begin());
+        return values;
+    };
+    auto toShortArray = [](const std::vector<double>& record) {
+        std::array<double, 5> values;
+        std::copy(record.begin(), record.begin() + 5, values.begin());
+        return values;
+    };
+    using Linear = metric::P_norm<double, 1>;
+    using Square = metric::P_norm<double, 2>;
+    using Cubic = metric::P_norm<double, 3>;
+    using Quintic = metric::P_norm<double, 5>;
+    using Maximum = metric::P_norm<double, metric::P_norm_infinity>;
+
+    for (size_t i = 0; i + 1 < records.size(); ++i) {
+        const auto& a = records[i];
+        const auto& b = records[i + 1];
+        const std::vector<double> a5(a.begin(), a.begin() + 5), b5(b.begin(), b.begin() + 5);
+
+        // same summation order, so the fixed size kernels match exactly
+        BOOST_CHECK_EQUAL(metric::Euclidian<double>()(toArray(a), toArray(b)), metric::Euclidian<double>()(a, b));
+        BOOST_CHECK_EQUAL(metric::Manhatten<double>()(toArray(a), toArray(b)), metric::Manhatten<double>()(a, b));
+        BOOST_CHECK_EQUAL(metric::Cosine<double>()(toArray(a), toArray(b)), metric::Cosine<double>()(a, b));
+        BOOST_CHECK_EQUAL(metric::Chebyshev<double>()(toArray(a), toArray(b)), metric::Chebyshev<double>()(a, b));
+        BOOST_CHECK_EQUAL(
+            metric::Euclidian<double>()(toShortArray(a), toShortArray(b)), metric::Euclidian<double>()(a5, b5));
+        BOOST_CHECK_EQUAL(metric::P_norm<double>(1.5)(toShortArray(a), toShortArray(b)),
+            metric::P_norm<double>(1.5)(a5, b5));
+
+        BOOST_CHECK_CLOSE(Linear()(a, b), metric::P_norm<double>(1)(a, b), 1e-12);
+        BOOST_CHECK_CLOSE(Square()(a, b), metric::P_norm<double>(2)(a, b), 1e-12);
+        BOOST_CHECK_CLOSE(Cubic()(toArray(a), toArray(b)), metric::P_norm<double>(3)(a, b), 1e-12);
+        BOOST_CHECK_CLOSE(Quintic()(a, b), metric::P_norm<double>(5)(a, b), 1e-12);
+        BOOST_CHECK_EQUAL(Maximum()(a, b), metric::Chebyshev<double>()(a, b));
+    }
+    BOOST_CHECK_EQUAL(Cubic().p, 3);
+}
+
+BOOST_AUTO_TEST_CASE(sparse_records)
+{
+    std::default_random_engine g(12);
+    std::uniform_real_distribution<double> value(-1, 1);
+    std::bernoulli_distribution nonzero(0.1);
+    const size_t dim = 300;
+    std::vector<std::vector<double>> dense(10, std::vector<double>(dim, 0));
+    std::vector<blaze::CompressedVector<double>> sparse(dense.size(), blaze::CompressedVector<double>(dim));
+    for (size_t r = 0; r < dense.size(); ++r) {
+        for (size_t i = 0; i < dim; ++i) {
+            if (nonzero(g)) {
+                dense[r][i] = value(g);
+                sparse[r][i] = dense[r][i];
+            }
+        }
+    }
+
+    metric::Euclidian<double> euclidian;
+    metric::Manhatten<double> manhatten;
+    metric::Cosine<double> cosine;
+    for (size_t r = 0; r + 1 < dense.size(); ++r) {
+        const auto& a = dense[r];
+        const auto& b = dense[r + 1];
+        const auto& sa = sparse[r];
+        const auto& sb = sparse[r + 1];
+        BOOST_CHECK_CLOSE(euclidian(sa, sb), euclidian(a, b), 1e-12);
+        BOOST_CHECK_CLOSE(euclidian(sa, b), euclidian(a, b), 1e-12);
+        BOOST_CHECK_CLOSE(euclidian(a, sb), euclidian(a, b), 1e-12);
+        BOOST_CHECK_CLOSE(euclidian(sa, sb, 1e9), euclidian(a, b), 1e-12);
+        BOOST_CHECK_CLOSE(manhatten(sa, sb), manhatten(a, b), 1e-12);
+        BOOST_CHECK_CLOSE(manhatten(sa, b), manhatten(a, b), 1e-12);
+        BOOST_CHECK_CLOSE(manhatten(sa, sb, 1e9), manhatten(a, b), 1e-12);
+        BOOST_CHECK_CLOSE(cosine(sa, sb), cosine(a, b), 1e-12);
+        BOOST_CHECK_CLOSE(cosine(a, sb), cosine(a, b), 1e-12);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(upper_bound_overloads)
+{
+    std::vector<double> a = { 0, 1, 2, 3, 4, 5, 4, 3, 2 };
+    std::vector<double> b = { 1, 1, 2, 1, 0, 2, 4, 1, 1 };
+
+    metric::Euclidian<double> euclidian;
+    metric::Manhatten<double> manhatten;
+    metric::TWED<double> twed(0.5, 1);
+    metric::Edit<char> edit;
+    std::string s1 = "kitten sitting";
+    std::string s2 = "sitting kitten";
+
+    static_assert(metric::has_upper_bound<metric::Euclidian<double>, std::vector<double>>::value);
+    static_assert(metric::has_upper_bound<metric::Edit<char>, std::string>::value);
+    static_assert(!metric::has_upper_bound<metric::Chebyshev<double>, std::vector<double>>::value);
+
+    // exact below the bound
+    BOOST_CHECK_EQUAL(euclidian(a, b, 100), euclidian(a, b));
+    BOOST_CHECK_EQUAL(manhatten(a, b, 100), manhatten(a, b));
+    BOOST_CHECK_EQUAL(twed(a, b, 100), twed(a, b));
+    BOOST_CHECK_EQUAL(edit(s1, s2, 100), edit(s1, s2));
+
+    // not smaller than the bound above it
+    BOOST_CHECK_GE(euclidian(a, b, 1), 1);
+    BOOST_CHECK_GE(manhatten(a, b, 1), 1);
+    BOOST_CHECK_GE(twed(a, b, 1), 1);
+    BOOST_CHECK_GE(edit(s1, s2, 1), 1);
+    BOOST_CHECK_LE(edit(s1, s2, 1), edit(s1, s2));
+
+    // records of different lengths, the missing entries are 0
+    const std::vector<double> shorter = { 1, 1 };
+    const std::vector<double> longer = { 1, 2, 3 };
+    BOOST_CHECK_EQUAL(manhatten(shorter, longer), 4);
+    BOOST_CHECK_EQUAL(manhatten(longer, shorter), 4);
+    BOOST_CHECK_EQUAL(manhatten(shorter, longer, 100), 4);
+    BOOST_CHECK_GE(manhatten(longer, shorter, 2), 2);
+
+    // metrics without the overload are evaluated in full
+    metric::Chebyshev<double> chebyshev;
+    BOOST_CHECK_EQUAL(metric::bounded_distance(chebyshev, a, b, 0.5), chebyshev(a, b));
+}
+
+template <typename Container>
+int referenceEdit(const Container& a, const Container& b)
+{
+    std::vector<std::vector<int>> d(a.size() + 1, std::vector<int>(b.size() + 1));
+    for (size_t i = 0; i <= a.size(); ++i) {
+        d[i][0] = i;
+    }
+    for (size_t j = 0; j <= b.size(); ++j) {
+        d[0][j] = j;
+    }
+    for (size_t i = 1; i <= a.size(); ++i) {
+        for (size_t j = 1; j <= b.size(); ++j) {
+            d[i][j] = std::min({ d[i - 1][j] + 1, d[i][j - 1] + 1, d[i - 1][j - 1] + (a[i - 1] == b[j - 1] ? 0 : 1) });
+        }
+    }
+    return d[a.size()][b.size()];
+}
+
+BOOST_AUTO_TEST_CASE(edit_bit_parallel_and_banded)
+{
+    std::default_random_engine g(5);
+    std::uniform_int_distribution<int> length(0, 200);
+    std::uniform_int_distribution<int> letter('a', 'd');
+    metric::Edit<char> edit;
+    for (int t = 0; t < 300; ++t) {
+        std::string a(length(g), ' ');
+        std::string b(t % 3 == 0 ? a.size() + t % 7 : length(g), ' ');
+        for (auto& c : a) {
+            c = letter(g);
+        }
+        for (size_t i = 0; i < b.size(); ++i) {
+            // mostly similar strings to exercise small distances
+            b[i] = (t % 3 == 0 && i < a.size() && letter(g) != 'a') ? a[i] : letter(g);
+        }
+        std::vector<int> va(a.begin(), a.end());
+        std::vector<int> vb(b.begin(), b.end());
+
+        const int expected = referenceEdit(a, b);
+        BOOST_CHECK_EQUAL(edit(a, b), expected);
+        BOOST_CHECK_EQUAL(edit(b, a), expected);
+        BOOST_CHECK_EQUAL(edit(va, vb), expected);
+        for (int k : { 0, 1, 3, 10, 40, 150 }) {
+            if (expected <= k) {
+                BOOST_CHECK_EQUAL(edit(a, b, k), expected);
+                BOOST_CHECK_EQUAL(edit(va, vb, k), expected);
+            } else {
+                BOOST_CHECK_GT(edit(a, b, k), k);
+                BOOST_CHECK_GT(edit(va, vb, k), k);
+            }
+        }
+    }
+    BOOST_CHECK_EQUAL(edit("", "abc"), 3);
+    BOOST_CHECK_EQUAL(edit("kitten", "sitting"), 3);
+}
+
+template <typename T>
+T referenceTWED(const std::vector<T>& A, const std::vector<T>& timeA, const std::vector<T>& B,
+    const std::vector<T>& timeB, T penalty, T elastic)
+{
+    std::vector<std::vector<T>> D(A.size(), std::vector<T>(B.size()));
+    D[0][0] = std::abs(A[0] - B[0]) + elastic * std::abs(timeA[0]);
+    for (size_t j = 1; j < B.size(); ++j) {
+        D[0][j] = D[0][j - 1] + std::abs(B[j - 1] - B[j]) + elastic * (timeB[j] - timeB[j - 1]) + penalty;
+    }
+    for (size_t i = 1; i < A.size(); ++i) {
+        D[i][0] = D[i - 1][0] + std::abs(A[i - 1] - A[i]) + elastic * (timeA[i] - timeA[i - 1]) + penalty;
+        for (size_t j = 1; j < B.size(); ++j) {
+            T C1 = D[i - 1][j] + std::abs(A[i - 1] - A[i]) + elastic * (timeA[i] - timeA[i - 1]) + penalty;
+            T C2 = D[i][j - 1] + std::abs(B[j - 1] - B[j]) + elastic * (timeB[j] - timeB[j - 1]) + penalty;
+            T C3 = D[i - 1][j - 1] + std::abs(A[i] - B[j]) + std::abs(A[i - 1] - B[j - 1])
+                + elastic * (std::abs(timeA[i] - timeB[j]) + std::abs(timeA[i - 1] - timeB[j - 1]));
+            D[i][j] = std::min({ C1, C2, C3 });
+        }
+    }
+    return D.back().back();
+}
+
+BOOST_AUTO_TEST_CASE(twed_dense_sparse_and_band)
+{
+    std::default_random_engine g(11);
+    std::uniform_int_distribution<int> length(1, 60);
+    std::normal_distribution<double> nd(0, 1);
+    std::bernoulli_distribution nonzero(0.3);
+    metric::TWED<double> twed(0.5, 1);
+    for (int t = 0; t < 100; ++t) {
+        std::vector<double> a(length(g)), b(length(g));
+        for (auto& v : a) {
+            v = nd(g);
+        }
+        for (auto& v : b) {
+            v = nd(g);
+        }
+        std::vector<double> ta(a.size()), tb(b.size());
+        std::iota(ta.begin(), ta.end(), 0);
+        std::iota(tb.begin(), tb.end(), 0);
+
+        const double expected = referenceTWED(a, ta, b, tb, 0.5, 1.0);
+        BOOST_CHECK_EQUAL(twed(a, b), expected);
+        BOOST_CHECK_LE(twed.lower_bound(a, b), expected);
+        for (double k : { 0.5, 5.0, 50.0 }) {
+            if (expected <= k) {
+                BOOST_CHECK_EQUAL(twed(a, b, k), expected);
+            } else {
+                BOOST_CHECK_GE(twed(a, b, k), k);
+            }
+        }
+        metric::TWED<double> banded(0.5, 1, 3);
+        BOOST_CHECK_GE(banded(a, b), expected);
+        metric::TWED<double> wide(0.5, 1, 100);
+        BOOST_CHECK_EQUAL(wide(a, b), expected);
+
+        // sparse input, time is the index of the non zero element
+        blaze::CompressedVector<double> sa(80), sb(80);
+        sa.reserve(80);
+        sb.reserve(80);
+        std::vector<double> va, vta, vb, vtb;
+        for (size_t i = 0; i < 80; ++i) {
+            if (nonzero(g) || i == 0) {
+                sa.append(i, nd(g));
+                va.push_back(sa[i]);
+                vta.push_back(i);
+            }
+            if (nonzero(g) || i == 0) {
+                sb.append(i, nd(g));
+                vb.push_back(sb[i]);
+                vtb.push_back(i);
+            }
+        }
+        const double sparse_expected = referenceTWED(va, vta, vb, vtb, 0.5, 1.0);
+        BOOST_CHECK_EQUAL(twed(sa, sb), sparse_expected);
+        BOOST_CHECK_LE(twed.lower_bound(sa, sb), sparse_expected);
+    }
+}
+
+double referenceSSIM(const std::vector<std::vector<double>>& img1, const std::vector<std::vector<double>>& img2,
+    double dynamic_range, double masking)
+{
+    const size_t n = 11;
+    auto gauss = metric::SSIM_details::gaussian_blur(n);
+    double C1 = std::pow(0.01 * dynamic_range, 2);
+    double C2 = std::pow(0.03 * dynamic_range, 2);
+    double sum = 0;
+    for (size_t i = 0; i < img1.size() - n + 1; ++i) {
+        for (size_t j = 0; j < img1[0].size() - n + 1; ++j) {
+            double mu1 = 0, mu2 = 0, sigma1 = 0, sigma2 = 0;
+            for (size_t y = 0; y < n; y++) {
+                for (size_t x = 0; x < n; x++) {
+                    double k1 = img1[i + y][j + x], k2 = img2[i + y][j + x], valv = gauss[y][x];
+                    mu1 += k1 * valv;
+                    mu2 += k2 * valv;
+                    sigma1 += k1 * k1 * valv;
+                    sigma2 += k2 * k2 * valv;
+                }
+            }
+            double visibility = 1;
+            if (masking < 2.0) {
+                double l2norm1 = 0, l2norm2 = 0, lpnorm1 = 0, lpnorm2 = 0;
+                double sscale = n * n;
+                double C3 = C2 * std::pow(sscale, 2.0 / masking - 1.0);
+                for (size_t y = 0; y < n; y++) {
+                    for (size_t x = 0; x < n; x++) {
+                        double valv = gauss[y][x] * sscale;
+                        double v1 = img1[i + y][j + x] - mu1, v2 = img2[i + y][j + x] - mu2;
+                        l2norm1 += v1 * v1 * valv;
+                        l2norm2 += v2 * v2 * valv;
+                        lpnorm1 += std::pow(std::abs(v1), masking) * valv;
+                        lpnorm2 += std::pow(std::abs(v2), masking) * valv;
+                    }
+                }
+                visibility = std::pow((l2norm1 + l2norm2 + C3)
+                        / (std::pow(lpnorm1, 2.0 / masking) + std::pow(lpnorm2, 2.0 / masking) + C3),
+                    masking / 2.0);
+                visibility = std::min(1.0, std::max(0.0, visibility));
+            }
+            sigma1 = std::max(0.0, sigma1 - mu1 * mu1);
+            sigma2 = std::max(0.0, sigma2 - mu2 * mu2);
+            double S1 = (2.0 * mu1 * mu2 + C1) / (mu1 * mu1 + mu2 * mu2 + C1);
+            double S2 = (2.0 * std::sqrt(sigma1 * sigma2) + C2) / (sigma1 + sigma2 + C2);
+            double value = 2.0 - S1 - S2;
+            if (value > 0.0) {
+                sum += std::sqrt(value);
+            }
+        }
+    }
+    return sum / ((img1.size() - n + 1) * (img1[0].size() - n + 1));
+}
+
+BOOST_AUTO_TEST_CASE(ssim_separable)
+{
+    std::default_random_engine g(3);
+    std::uniform_real_distribution<double> pixel(0, 255);
+    std::vector<std::vector<double>> img1(70, std::vector<double>(45)), img2(70, std::vector<double>(45));
+    for (size_t i = 0; i < img1.size(); ++i) {
+        for (size_t j = 0; j < img1[0].size(); ++j) {
+            img1[i][j] = pixel(g);
+            img2[i][j] = 0.7 * img1[i][j] + 0.3 * pixel(g);
+        }
+    }
+    for (double masking : { 2.0, 1.0, 1.5 }) {
+        const double expected = referenceSSIM(img1, img2, 255, masking);
+        metric::SSIM<double, std::vector<double>> ssim(255, masking);
+        metric::SSIM<double, std::vector<double>> parallel_ssim(255, masking, 3);
+        BOOST_CHECK_CLOSE(ssim(img1, img2), expected, 1e-9);
+        BOOST_CHECK_CLOSE(parallel_ssim(img1, img2), expected, 1e-9);
+    }
+}
+
+// the min-cost-flow solver on histograms pre-flowed like EMD::operator() does
+template <typename T>
+T solverEMD(const std::vector<T>& Pc, const std::vector<T>& Qc, const std::vector<std::vector<T>>& C)
+{
+    std::vector<T> P(Pc), Q(Qc);
+    for (size_t i = 0; i < P.size(); ++i) {
+        const T flow = std::min(P[i], Q[i]);
+        P[i] -= flow;
+        Q[i] -= flow;
+    }
+    return metric::EMD_details::emd_impl<std::vector<T>, metric::EMD_details::NO_FLOW>()(
+        Pc, Qc, P, Q, metric::EMD_details::cost_matrix<T>(C), T(-1), nullptr);
+}
+
+BOOST_AUTO_TEST_CASE(emd_closed_forms)
+{
+    std::default_random_engine g(4);
+    std::uniform_int_distribution<int> count(0, 20);
+    std::uniform_real_distribution<double> mass(0, 1);
+    const size_t n = 12;
+
+    // 1-D histograms on irregular bin positions
+    std::vector<int> xi(n);
+    std::vector<double> xd(n);
+    for (size_t i = 1; i < n; ++i) {
+        xi[i] = xi[i - 1] + count(g) % 4;
+        xd[i] = xd[i - 1] + mass(g);
+    }
+    std::vector<std::vector<int>> Ci(n, std::vector<int>(n));
+    std::vector<std::vector<double>> Cd(n, std::vector<double>(n));
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < n; ++j) {
+            Ci[i][j] = std::abs(xi[i] - xi[j]);
+            Cd[i][j] = std::abs(xd[i] - xd[j]);
+        }
+    }
+    // uniform cost matrix of a 3x4 grid with the default thresholded ground distance
+    const auto grid = metric::EMD_details::ground_distance_matrix_of_2dgrid<double>(3, 4);
+    // the default saturated |i - j| matrix is solved by the general path
+    std::vector<std::vector<int>> Cs(n, std::vector<int>(n));
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < n; ++j) {
+            Cs[i][j] = std::min(int(n / 2), std::abs(int(i) - int(j)));
+        }
+    }
+    const metric::EMD<int> saturated(n, n);
+    const metric::EMD<int> line_int(Ci);
+    const metric::EMD<double> line_double(Cd);
+    const metric::EMD<double> uniform(grid);
+    for (int trial = 0; trial < 20; ++trial) {
+        std::vector<int> Pi(n), Qi(n);
+        std::vector<double> Pd(n), Qd(n);
+        for (size_t i = 0; i < n; ++i) {
+            Pi[i] = count(g);
+            Qi[i] = count(g);
+            Pd[i] = mass(g);
+            Qd[i] = mass(g);
+        }
+        // unequal masses go through the solver for line matrices, floating point solutions are quantized to 1e-6
+        BOOST_CHECK_EQUAL(line_int(Pi, Qi), solverEMD(Pi, Qi, Ci));
+        BOOST_CHECK_EQUAL(saturated(Pi, Qi), solverEMD(Pi, Qi, Cs));
+        BOOST_CHECK_CLOSE(line_double(Pd, Qd), solverEMD(Pd, Qd, Cd), 1e-2);
+        BOOST_CHECK_CLOSE(uniform(Pd, Qd), solverEMD(Pd, Qd, grid), 1e-2);
+
+        // equal masses take the cumulative sum path
+        const int diff = std::accumulate(Pi.begin(), Pi.end(), 0) - std::accumulate(Qi.begin(), Qi.end(), 0);
+        (diff > 0 ? Qi : Pi)[trial % n] += std::abs(diff);
+        const double sumP = std::accumulate(Pd.begin(), Pd.end(), 0.0);
+        const double sumQ = std::accumulate(Qd.begin(), Qd.end(), 0.0);
+        for (size_t i = 0; i < n; ++i) {
+            Pd[i] /= sumP;
+            Qd[i] /= sumQ;
+        }
+        BOOST_CHECK_EQUAL(line_int(Pi, Qi), solverEMD(Pi, Qi, Ci));
+        BOOST_CHECK_CLOSE(line_double(Pd, Qd), solverEMD(Pd, Qd, Cd), 1e-2);
+        BOOST_CHECK_CLOSE(uniform(Pd, Qd), solverEMD(Pd, Qd, grid), 1e-2);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(emd_non_square_ground_matrix)
+{
+    typedef metric::EMD<double> Emd;
+    BOOST_CHECK_THROW(Emd(4, 3), std::invalid_argument);
+    BOOST_CHECK_THROW(Emd(3, 4), std::invalid_argument);
+    BOOST_CHECK_THROW(Emd(std::vector<std::vector<double>> { { 0, 1 }, { 1 } }), std::invalid_argument);
+    BOOST_CHECK_NO_THROW(Emd(3, 3));
+}
+
+BOOST_AUTO_TEST_CASE(emd_default_ground_released)
+{
+    std::weak_ptr<const metric::EMD_details::ground_matrix<double>> first
+        = metric::EMD_details::default_ground<double>(101);
+    BOOST_TEST(!first.expired());  // kept among the recent sizes
+    BOOST_TEST(metric::EMD_details::default_ground<double>(101) == first.lock());
+
+    for (size_t n = 102; n < 110; ++n) {
+        metric::EMD_details::default_ground<double>(n);
+    }
+    BOOST_TEST(first.expired());
+
+    // held by a user, a matrix stays shared
+    const auto held = metric::EMD_details::default_ground<double>(120);
+    for (size_t n = 102; n < 110; ++n) {
+        metric::EMD_details::default_ground<double>(n);
+    }
+    BOOST_TEST(metric::EMD_details::default_ground<double>(120) == held);
+
+    // an EMD without cost matrix holds the default matrices of the sizes it was used with
+    const metric::EMD<double> lazy;
+    const std::vector<double> P(130, 1);
+    const std::vector<double> Q(130, 2);
+    const double expected = lazy(P, Q);
+    std::weak_ptr<const metric::EMD_details::ground_matrix<double>> used
+        = metric::EMD_details::default_ground<double>(130);
+    for (size_t n = 102; n < 110; ++n) {
+        metric::EMD_details::default_ground<double>(n);
+    }
+    BOOST_TEST(!used.expired());
+    BOOST_TEST(lazy(std::vector<double>(5, 1), std::vector<double>(5, 1)) == 0);
+    BOOST_TEST(lazy(P, Q) == expected);
+}
+
+BOOST_AUTO_TEST_CASE(emd_shared_between_threads)
+{
+    std::default_random_engine g(6);
+    std::uniform_real_distribution<double> mass(0, 1);
+    const size_t n = 10;
+    std::vector<std::vector<double>> histograms(40, std::vector<double>(n));
+    for (auto& h : histograms) {
+        for (auto& v : h) {
+            v = mass(g);
+        }
+    }
+    const metric::EMD<double> general(n, n);
+    const metric::EMD<double> lazy;  // default matrix chosen from the size of the histograms
+    std::vector<double> expected(histograms.size());
+    for (size_t i = 0; i < histograms.size(); ++i) {
+        expected[i] = general(histograms[0], histograms[i]);
+    }
+    std::vector<double> concurrent(histograms.size());
+    std::vector<double> concurrent_lazy(histograms.size());
+    metric::parallel_for(histograms.size(), 4, [&](size_t begin, size_t end, size_t) {
+        const auto copy = general;  // copies share the ground matrix
+        for (size_t i = begin; i < end; ++i) {
+            concurrent[i] = copy(histograms[0], histograms[i]);
+            concurrent_lazy[i] = lazy(histograms[0], histograms[i]);
+        }
+    });
+    for (size_t i = 0; i < histograms.size(); ++i) {
+        BOOST_CHECK_EQUAL(concurrent[i], expected[i]);
+        BOOST_CHECK_EQUAL(concurrent_lazy[i], expected[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(emd_sinkhorn_accuracy)
+{
+    std::default_random_engine g(5);
+    std::uniform_real_distribution<double> mass(0, 1);
+    const size_t n = 16;
+    std::vector<std::vector<double>> C(n, std::vector<double>(n));
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < n; ++j) {
+            C[i][j] = std::abs(double(i) - double(j));
+        }
+    }
+    const double regularization = 0.1;
+    const metric::EMD<double> exact(C);
+    const metric::EMD_sinkhorn<double> sinkhorn(C, regularization, 20000, 1e-9);
+    const metric::EMD_sinkhorn<double> parallel_sinkhorn(C, regularization, 20000, 1e-9, 3);
+
+    std::vector<double> P(n);
+    std::vector<std::vector<double>> Qs(10, std::vector<double>(n));
+    for (size_t i = 0; i < n; ++i) {
+        P[i] = i % 5 == 0 ? 0 : mass(g);
+    }
+    const double sumP = std::accumulate(P.begin(), P.end(), 0.0);
+    for (auto& Q : Qs) {
+        for (auto& q : Q) {
+            q = mass(g);
+        }
+        const double sumQ = std::accumulate(Q.begin(), Q.end(), 0.0);
+        for (auto& q : Q) {
+            q *= sumP / sumQ;
+        }
+    }
+
+    const auto batch = parallel_sinkhorn.one_to_many(P, Qs);
+    BOOST_REQUIRE_EQUAL(batch.size(), Qs.size());
+    for (size_t q = 0; q < Qs.size(); ++q) {
+        const double expected = exact(P, Qs[q]);
+        const double approximation = sinkhorn(P, Qs[q]);
+        // the entropic plan is feasible, its cost lies above the optimum by at most regularization * log(nP * nQ)
+        BOOST_CHECK_GE(approximation, expected - 1e-6);
+        BOOST_CHECK_LE(approximation, expected + regularization * std::log(double(n * n)) * sumP);
+        BOOST_CHECK_CLOSE(batch[q], approximation, 1e-10);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(voi_parallel_and_prebuilt_trees)
+{
+    const auto a = generateRecords<double>(300, 2, 7);
+    auto b = generateRecords<double>(300, 1, 8);
+    for (size_t i = 0; i < b.size(); ++i) {
+        b[i][0] += a[i][0];
+    }
+
+    using Cheb = metric::Chebyshev<double>;
+    using Eucl = metric::Euclidian<double>;
+    const double serial = metric::entropy(a, 3, 2.0, Cheb());
+    const metric::Tree<std::vector<double>, Cheb> tree_a(a, -1, Cheb());
+    BOOST_CHECK_CLOSE(metric::entropy(a, 3, 2.0, Cheb(), 4), serial, 1e-9);
+    BOOST_CHECK_CLOSE(metric::entropy(a, tree_a, 3, 2.0, Cheb(), 4), serial, 1e-9);
+
+    const metric::VOI_kl<double> voi_kl;
+    const metric::VOI_kl<double> parallel_voi_kl(3, 2, 4);
+    const metric::Tree<std::vector<double>, Eucl> euclidian_a(a, -1, Eucl());
+    const metric::Tree<std::vector<double>, Eucl> euclidian_b(b, -1, Eucl());
+    const double expected = voi_kl(a, b);
+    BOOST_CHECK_CLOSE(parallel_voi_kl(a, b), expected, 1e-9);
+    BOOST_CHECK_CLOSE(parallel_voi_kl(a, b, euclidian_a, euclidian_b), expected, 1e-9);
+
+    // the kNN estimator of the mutual information adds random noise, so only the scale is compared
+    const double mi = metric::mutualInformation(a, b);
+    BOOST_CHECK_CLOSE(metric::mutualInformation(a, b, 3, Cheb(), 2, 4), mi, 1e-3);
+}
+
+BOOST_AUTO_TEST_CASE(voi_discrete)
+{
+    std::default_random_engine g(9);
+    std::uniform_int_distribution<int> symbol(0, 5);
+    std::uniform_int_distribution<long long> wide(-1000000000LL, 1000000000LL);
+    const size_t n = 5000;
+    std::vector<std::vector<int>> a(n, std::vector<int>(2)), b(n, std::vector<int>(1));
+    std::vector<std::vector<long long>> c(n, std::vector<long long>(1)), d(n, std::vector<long long>(1));
+    for (size_t i = 0; i < n; ++i) {
+        a[i] = { symbol(g), symbol(g) % 2 };
+        b[i] = { (a[i][0] + symbol(g) / 4) % 6 };
+        c[i] = { wide(g) % 700 * 1000003LL };  // sparse alphabet, counted through the hash table
+        d[i] = { c[i][0] / 1000003LL % 7 + symbol(g) / 5 };
+    }
+
+    // reference entropies from std::map counts
+    auto reference = [](const auto& X) {
+        std::map<std::decay_t<decltype(X[0])>, double> counts;
+        for (const auto& x : X) {
+            counts[x] += 1;
+        }
+        double h = 0;
+        for (const auto& entry : counts) {
+            const double p = entry.second / X.size();
+            h -= p * std::log2(p);
+        }
+        return h;
+    };
+    auto joint = [](const auto& X, const auto& Y) {
+        std::vector<std::vector<long long>> XY(X.size());
+        for (size_t i = 0; i < X.size(); ++i) {
+            XY[i].assign(X[i].begin(), X[i].end());
+            XY[i].insert(XY[i].end(), Y[i].begin(), Y[i].end());
+        }
+        return XY;
+    };
+
+    for (size_t threads : { 1, 4 }) {
+        BOOST_CHECK_CLOSE(metric::discrete_entropy(a, 2.0, threads), reference(a), 1e-9);
+        BOOST_CHECK_CLOSE(metric::discrete_entropy(c, 2.0, threads), reference(c), 1e-9);
+
+        const double hab = reference(joint(a, b));
+        const double mi = reference(a) + reference(b) - hab;
+        BOOST_CHECK_CLOSE(metric::mutualInformation(a, b, 2.0, threads), mi, 1e-9);
+        BOOST_CHECK_CLOSE(metric::VOI<double>(3, 2, threads)(a, b), 2 * hab - reference(a) - reference(b), 1e-9);
+        BOOST_CHECK_CLOSE(metric::VOI_normalized<double>(3, 2, threads)(a, b), 1 - mi / hab, 1e-9);
+
+        const double hcd = reference(joint(c, d));
+        BOOST_CHECK_CLOSE(metric::VOI<double>(3, 2, threads)(c, d), 2 * hcd - reference(c) - reference(d), 1e-9);
+    }
+    BOOST_CHECK_EQUAL(metric::VOI_normalized<double>()(b, b), 0);
+}
+
+BOOST_AUTO_TEST_CASE(kohonen_ground_matrix_and_bmu)
+{
+    using Record = std::vector<double>;
+    using Metric = metric::Euclidian<double>;
+    const auto samples = generateRecords<double>(200, 3, 10);
+
+    // 4 x 4 nodes go through Floyd-Warshall, 9 x 9 through Dijkstra
+    for (size_t side : { 4, 9 }) {
+        metric::SOM<Record, metric::Grid4, Metric> som(metric::Grid4(side, side), Metric(), 0.8, 0.2, 20);
+        som.train(samples);
+        const metric::kohonen_distance<double, Record, metric::Grid4, Metric> serial(som);
+        metric::kohonen_distance<double, Record, metric::Grid4, Metric> parallel(som, 4);
+
+        // reference shortest paths by relaxing every node pair
+        const auto nodes = som.get_weights();
+        const auto matrix = som.get_graph().get_matrix();
+        const size_t n = nodes.size();
+        std::vector<double> paths(n * n, std::numeric_limits<double>::max());
+        for (size_t i = 0; i < n; ++i) {
+            paths[i * n + i] = 0;
+            for (size_t j = 0; j < n; ++j) {
+                if (i != j && (matrix(i, j) > 0 || matrix(j, i) > 0)) {
+                    paths[i * n + j] = Metric()(nodes[i], nodes[j]);
+                }
+            }
+        }
+        for (size_t k = 0; k < n; ++k) {
+            for (size_t i = 0; i < n; ++i) {
+                for (size_t j = 0; j < n; ++j) {
+                    paths[i * n + j] = std::min(paths[i * n + j], paths[i * n + k] + paths[k * n + j]);
+                }
+            }
+        }
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t j = 0; j < n; ++j) {
+                BOOST_CHECK_CLOSE(serial.ground_distance(i, j) + 1, paths[i * n + j] + 1, 1e-9);
+                BOOST_CHECK_EQUAL(parallel.ground_distance(i, j), serial.ground_distance(i, j));
+            }
+        }
+
+        parallel.cache_bmu(true);
+        for (size_t i = 0; i + 1 < samples.size(); ++i) {
+            BOOST_CHECK_EQUAL(serial.BMU(samples[i]), som.BMU(samples[i]));
+            BOOST_CHECK_EQUAL(parallel(samples[i], samples[i + 1]), serial(samples[i], samples[i + 1]));
+            BOOST_CHECK_EQUAL(parallel(samples[i], samples[i + 1]), serial(samples[i], samples[i + 1]));
+        }
+
+        // a cache smaller than the samples keeps evicting
+        parallel.cache_bmu(true, 3);
+        for (size_t i = 0; i + 1 < samples.size(); ++i) {
+            BOOST_CHECK_EQUAL(parallel(samples[i], samples[i + 1]), serial(samples[i], samples[i + 1]));
+            BOOST_CHECK_EQUAL(parallel(samples[i + 1], samples[0]), serial(samples[i + 1], samples[0]));
+        }
+    }
+
+    // float samples, distances summed in double by the metric
+    using FloatRecord = std::vector<float>;
+    std::vector<FloatRecord> single(samples.size());
+    for (size_t i = 0; i < samples.size(); ++i) {
+        single[i].assign(samples[i].begin(), samples[i].end());
+    }
+    metric::SOM<FloatRecord, metric::Grid4, Metric> float_som(metric::Grid4(4, 4), Metric(), 0.8, 0.2, 20);
+    float_som.train(single);
+    const metric::kohonen_distance<double, FloatRecord, metric::Grid4, Metric> float_distance(float_som);
+    for (const auto& sample : single) {
+        BOOST_CHECK_EQUAL(float_distance.BMU(sample), float_som.BMU(sample));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(lower_bounds)
+{
+    std::default_random_engine g(13);
+    std::uniform_int_distribution<int> mass(0, 9);
+    const size_t bins = 6;
+    metric::EMD<double> emd(bins, bins);
+    metric::EMD<int> integral_emd(bins, bins);
+    metric::Edit<char> edit;
+    for (size_t t = 0; t < 50; ++t) {
+        std::vector<double> p(bins), q(bins);
+        std::vector<int> ip(bins), iq(bins);
+        for (size_t i = 0; i < bins; ++i) {
+            ip[i] = mass(g);
+            iq[i] = mass(g);
+            p[i] = ip[i] * 0.37;
+            q[i] = iq[i] * 0.37;
+        }
+        BOOST_CHECK_LE(emd.lower_bound(p, q), emd(p, q) * (1 + 1e-9));
+        BOOST_CHECK_LE(integral_emd.lower_bound(ip, iq), integral_emd(ip, iq));
+
+        const std::string a(mass(g), 'x'), b(mass(g), 'y');
+        BOOST_CHECK_LE(edit.lower_bound(a, b), edit(a, b));
+    }
+    using Record = std::vector<double>;
+    BOOST_CHECK((metric::has_lower_bound<metric::EMD<double>, Record>::value));
+    BOOST_CHECK((metric::has_lower_bound<metric::TWED<double>, Record>::value));
+    BOOST_CHECK((!metric::has_lower_bound<metric::Euclidian<double>, Record>::value));
+}
+
+BOOST_AUTO_TEST_CASE(structured_batch)
+{
+    std::default_random_engine g(14);
+    std::uniform_real_distribution<double> value(0, 1);
+    std::uniform_int_distribution<int> length(5, 30);
+    auto check = [](const auto& metric, const auto& queries, const auto& references) {
+        blaze::DynamicMatrix<typename std::decay_t<decltype(metric)>::distance_type> serial, parallel;
+        metric.batch(queries, references, serial);
+        metric.batch(queries, references, parallel, 3);
+        BOOST_REQUIRE_EQUAL(serial.rows(), queries.size());
+        BOOST_REQUIRE_EQUAL(serial.columns(), references.size());
+        for (size_t i = 0; i < queries.size(); ++i) {
+            for (size_t j = 0; j < references.size(); ++j) {
+                BOOST_CHECK_EQUAL(serial(i, j), metric(queries[i], references[j]));
+                BOOST_CHECK_EQUAL(parallel(i, j), serial(i, j));
+            }
+        }
+    };
+
+    std::vector<std::vector<double>> curves(12), histograms(9, std::vector<double>(8));
+    std::vector<std::string> strings(15);
+    for (auto& curve : curves) {
+        curve.resize(length(g));
+        for (auto& v : curve) {
+            v = value(g);
+        }
+    }
+    for (auto& histogram : histograms) {
+        for (auto& v : histogram) {
+            v = value(g);
+        }
+    }
+    for (auto& s : strings) {
+        s.resize(length(g));
+        for (auto& c : s) {
+            c = char('a' + int(value(g) * 4));
+        }
+    }
+    check(metric::TWED<double>(0.5, 1), curves, std::vector<std::vector<double>>(curves.begin(), curves.begin() + 5));
+    check(metric::Edit<char>(), strings, std::vector<std::string>(strings.begin() + 3, strings.end()));
+    check(metric::EMD<double>(8, 8), histograms, histograms);
+
+    std::vector<std::vector<std::vector<double>>> images(5, std::vector<std::vector<double>>(30, std::vector<double>(24)));
+    for (auto& image : images) {
+        for (auto& row : image) {
+            for (auto& pixel : row) {
+                pixel = 255 * value(g);
+            }
+        }
+    }
+    for (double masking : { 2.0, 1.5 }) {
+        check(metric::SSIM<double, std::vector<double>>(255, masking), images,
+            std::vector<std::vector<std::vector<double>>>(images.begin() + 1, images.end()));
+    }
+
+    // a reference of another size is rejected instead of read with the size of the queries
+    const metric::SSIM<double, std::vector<double>> ssim(255, 2.0);
+    auto smaller = images;
+    smaller[2].pop_back();
+    blaze::DynamicMatrix<double> out;
+    BOOST_CHECK_THROW(ssim.batch(images, smaller, out), std::invalid_argument);
+    BOOST_CHECK_THROW(ssim(images[0], smaller[2]), std::invalid_argument);
+}
@@ -22,7 +22,10 @@ Copyright (c) 2018 Panda Team
 #include <boost/serialization/vector.hpp>
 #include <boost/serialization/unordered_map.hpp>
 
+#include <algorithm>
 #include <iostream>
+#include <random>
+#include <string>
 #include <vector>
 #include "modules/space.hpp"
 
@@ -73,6 +76,150 @@ BOOST_AUTO_TEST_CASE(test_knn)
     BOOST_TEST(k1[6].first->get_data() == -200);
 }
 
+BOOST_AUTO_TEST_CASE(test_knn_upper_bound_metric)
+{
+    // Euclidian abandons distance evaluation above the pruning bound, results must match brute force
+    std::mt19937 gen(7);
+    std::uniform_real_distribution<double> dis(-1, 1);
+    std::vector<std::vector<double>> data(300, std::vector<double>(8));
+    for (auto& r : data) {
+        for (auto& v : r) {
+            v = dis(gen);
+        }
+    }
+    metric::Euclidian<double> euclidian;
+    metric::Tree<std::vector<double>, metric::Euclidian<double>> tree(data);
+    for (std::size_t q = 0; q < 20; ++q) {
+        std::vector<double> query(8);
+        for (auto& v : query) {
+            v = dis(gen);
+        }
+        std::vector<double> dists;
+        for (const auto& r : data) {
+            dists.push_back(euclidian(query, r));
+        }
+        std::sort(dists.begin(), dists.end());
+
+        auto knn = tree.knn(query, 5);
+        BOOST_REQUIRE(knn.size() == 5);
+        for (std::size_t i = 0; i < knn.size(); ++i) {
+            BOOST_TEST(knn[i].second == dists[i]);
+        }
+        BOOST_TEST(tree.nn(query)->dist(query) == dists[0]);
+        auto rnn = tree.rnn(query, dists[10]);
+        BOOST_TEST(rnn.size() == 10);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_knn_lower_bound_metric)
+{
+    // Edit rejects candidates by their length difference before the full evaluation, results must match brute force
+    std::mt19937 gen(8);
+    std::uniform_int_distribution<int> length(1, 60);
+    std::uniform_int_distribution<int> letter('a', 'd');
+    auto random_string = [&]() {
+        std::string s(length(gen), 'a');
+        for (auto& c : s) {
+            c = char(letter(gen));
+        }
+        return s;
+    };
+    std::vector<std::string> data(300);
+    for (auto& s : data) {
+        s = random_string();
+    }
+    metric::Edit<char> edit;
+    metric::Tree<std::string, metric::Edit<char>> tree(data);
+    tree.reset_lower_bound_skips();
+    for (std::size_t q = 0; q < 20; ++q) {
+        const auto query = random_string();
+        std::vector<int> dists;
+        for (const auto& r : data) {
+            dists.push_back(edit(query, r));
+        }
+        std::sort(dists.begin(), dists.end());
+
+        auto knn = tree.knn(query, 5);
+        BOOST_REQUIRE(knn.size() == 5);
+        for (std::size_t i = 0; i < knn.size(); ++i) {
+            BOOST_TEST(knn[i].second == dists[i]);
+        }
+    }
+    // Edit returns early on its own length difference, the tree counts those evaluations as skipped
+    BOOST_TEST(tree.lower_bound_skips() > 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_knn_lower_bound_abandoning_metric)
+{
+    // TWED checks its lower bound inside its early abandoning operator, the skips must be counted as for Edit
+    std::mt19937 gen(10);
+    std::uniform_real_distribution<double> value(0, 1);
+    std::uniform_int_distribution<int> length(2, 80);
+    auto random_curve = [&]() {
+        std::vector<double> curve(length(gen));
+        for (auto& v : curve) {
+            v = value(gen);
+        }
+        return curve;
+    };
+    std::vector<std::vector<double>> data(150);
+    for (auto& curve : data) {
+        curve = random_curve();
+    }
+    metric::TWED<double> twed(1, 0.1);
+    metric::Tree<std::vector<double>, metric::TWED<double>> tree(data, -1, twed);
+    tree.reset_lower_bound_skips();
+    for (std::size_t q = 0; q < 10; ++q) {
+        const auto query = random_curve();
+        std::vector<double> dists;
+        for (const auto& r : data) {
+            dists.push_back(twed(query, r));
+        }
+        std::sort(dists.begin(), dists.end());
+
+        auto knn = tree.knn(query, 3);
+        BOOST_REQUIRE(knn.size() == 3);
+        for (std::size_t i = 0; i < knn.size(); ++i) {
+            BOOST_CHECK_CLOSE(knn[i].second + 1, dists[i] + 1, 1e-9);
+        }
+    }
+    BOOST_TEST(tree.lower_bound_skips() > 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_knn_lower_bound_only_metric)
+{
+    // EMD has a lower bound from the difference of the masses but no early abandoning operator, the tree checks it
+    std::mt19937 gen(9);
+    std::uniform_int_distribution<int> mass(0, 20);
+    std::vector<std::vector<double>> data(150, std::vector<double>(6));
+    for (auto& h : data) {
+        for (auto& v : h) {
+            v = mass(gen);
+        }
+    }
+    metric::EMD<double> emd(6, 6);
+    metric::Tree<std::vector<double>, metric::EMD<double>> tree(data, -1, emd);
+    tree.reset_lower_bound_skips();
+    for (std::size_t q = 0; q < 10; ++q) {
+        std::vector<double> query(6);
+        for (auto& v : query) {
+            v = mass(gen);
+        }
+        std::vector<double> dists;
+        for (const auto& r : data) {
+            dists.push_back(emd(query, r));
+        }
+        std::sort(dists.begin(), dists.end());
+
+        auto knn = tree.knn(query, 3);
+        BOOST_REQUIRE(knn.size() == 3);
+        for (std::size_t i = 0; i < knn.size(); ++i) {
+            BOOST_CHECK_CLOSE(knn[i].second + 1, dists[i] + 1, 1e-9);
+        }
+    }
+    BOOST_TEST(tree.lower_bound_skips() > 0);
+}
+
 BOOST_AUTO_TEST_CASE(test_erase)
 {
     std::vector<int> data = { 3, 5, -10, 50, 1, -200, 200 };
@@ -134,6 +281,19 @@ BOOST_AUTO_TEST_CASE(test_to_json)
     BOOST_TEST(tree.to_json() == json2);
 }
 
+BOOST_AUTO_TEST_CASE(test_matrix_near_duplicates)
+{
+    // records far from the origin and 1e-4 apart, where |a|^2 + |b|^2 - 2ab cancels
+    std::vector<std::vector<double>> data(3, std::vector<double>(16, 1000));
+    data[1][0] += 1e-4;
+    data[2][5] += 3e-4;
+
+    metric::Matrix<std::vector<double>, metric::Euclidian<double>, double> m(data);
+    BOOST_CHECK_CLOSE(m(0, 1), 1e-4, 1e-6);
+    BOOST_CHECK_CLOSE(m(0, 2), 3e-4, 1e-6);
+    BOOST_CHECK_CLOSE(m(1, 2), std::sqrt(1e-8 + 9e-8), 1e-6);
+}
+
 // BOOST_AUTO_TEST_CASE(test_serialize_boost_text)
 // {
 //     std::vector<int> data = { 3, 5, -10, 50, 1, -200, 200 };
@@ -433,4 +593,5 @@ BOOST_AUTO_TEST_CASE(tree_to_distance_matrix) {
             BOOST_TEST(m(i,j) == dist(data[i], data[j]));
         }
     }
+    BOOST_TEST((tree.matrix(3) == m));
 }